@@ -13,13 +13,41 @@
 #include <linux/version.h>
 #include <linux/eventfd.h>
 #include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/rculist.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 #include <fmac.h>
 
-#define FMAC_SHM_SIZE PAGE_SIZE
+#define FMAC_RING_RECS (FMAC_RING_SIZE / sizeof(struct fmac_event))
 
 static void *shared_buffer;
+static struct fmac_shm_hdr *shm_hdr;
+static struct fmac_event *shm_ring;
+static DEFINE_SPINLOCK(ring_lock);
+static u64 ring_head;
+static u64 last_seq;
+static u32 last_dirty_off, last_dirty_len;
+static DEFINE_SPINLOCK(event_lock);
 struct eventfd_ctx *event_ctx = NULL;
+
+struct fmac_subscriber {
+	struct list_head node;
+	wait_queue_head_t wq;
+	u32 mask;
+	atomic_t pending;
+	struct rcu_head rcu;
+};
+
+static LIST_HEAD(subscribers);
+static DEFINE_SPINLOCK(sub_lock);
+static atomic_t nr_subscribers = ATOMIC_INIT(0);
+#ifdef CONFIG_NKSU_DEBUG
 u32 last_hash;
+#endif
 
 static int fmac_anon_mmap(struct file *file, struct vm_area_struct *vma)
 {
@@ -61,15 +89,27 @@ int fmac_anonfd_get(void)
 int bind_eventfd(int fd)
 {
 	struct eventfd_ctx *ctx = eventfd_ctx_fdget(fd);
+	struct eventfd_ctx *old;
+	unsigned long flags;
+
 	if (IS_ERR(ctx))
 		return PTR_ERR(ctx);
 
+	spin_lock_irqsave(&event_lock, flags);
+	old = event_ctx;
 	event_ctx = ctx;
+	spin_unlock_irqrestore(&event_lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
 	return 0;
 }
 
 void notify_user(void)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&event_lock, flags);
 	if (event_ctx) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
 		eventfd_signal(event_ctx);
@@ -77,30 +117,218 @@ void notify_user(void)
 		eventfd_signal(event_ctx, 1);
 #endif
 	}
+	spin_unlock_irqrestore(&event_lock, flags);
 }
 
-void eventfd_cleanup(void)
+struct fmac_subscriber *fmac_subscriber_alloc(void)
 {
-	if (event_ctx) {
-		eventfd_ctx_put(event_ctx);
-		event_ctx = NULL;
+	struct fmac_subscriber *sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+
+	if (!sub)
+		return NULL;
+	INIT_LIST_HEAD(&sub->node);
+	init_waitqueue_head(&sub->wq);
+	atomic_set(&sub->pending, 0);
+	return sub;
+}
+
+/* a zero mask unsubscribes; only subscribed fds cost anything on emit */
+void fmac_subscriber_set_mask(struct fmac_subscriber *sub, u32 mask)
+{
+	spin_lock(&sub_lock);
+	if (mask && !sub->mask) {
+		list_add_tail_rcu(&sub->node, &subscribers);
+		atomic_inc(&nr_subscribers);
+	} else if (!mask && sub->mask) {
+		list_del_rcu(&sub->node);
+		atomic_dec(&nr_subscribers);
+	}
+	WRITE_ONCE(sub->mask, mask);
+	spin_unlock(&sub_lock);
+}
+
+void fmac_subscriber_free(struct fmac_subscriber *sub)
+{
+	if (!sub)
+		return;
+	fmac_subscriber_set_mask(sub, 0);
+	kfree_rcu(sub, rcu);
+}
+
+__poll_t fmac_subscriber_poll(struct fmac_subscriber *sub, struct file *file,
+			      poll_table *wait)
+{
+	poll_wait(file, &sub->wq, wait);
+	return atomic_read(&sub->pending) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/* returns and clears the number of events seen since the last call */
+ssize_t fmac_subscriber_read(struct fmac_subscriber *sub, bool nonblock,
+			     char __user *buf, size_t count)
+{
+	u64 n;
+	int ret;
+
+	if (count < sizeof(n))
+		return -EINVAL;
+
+	for (;;) {
+		n = atomic_xchg(&sub->pending, 0);
+		if (n)
+			break;
+		if (nonblock)
+			return -EAGAIN;
+		ret = wait_event_interruptible(sub->wq,
+					       atomic_read(&sub->pending));
+		if (ret)
+			return ret;
+	}
+
+	return copy_to_user(buf, &n, sizeof(n)) ? -EFAULT : sizeof(n);
+}
+
+static void fmac_subscribers_wake(u32 type)
+{
+	struct fmac_subscriber *sub;
+	u32 bit = FMAC_EV_MASK(type);
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(sub, &subscribers, node) {
+		if (!(READ_ONCE(sub->mask) & bit))
+			continue;
+		atomic_inc(&sub->pending);
+		wake_up_interruptible(&sub->wq);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Producers are serialized by ring_lock, so the ring is single-producer
+ * from the consumers' point of view.  ring_head is the authoritative copy;
+ * the mapped header is only a mirror for consumers, and a bogus tail
+ * written by userspace just makes the ring look full.
+ */
+void fmac_event_emit(u32 type, u32 uid, s32 arg, const char *data)
+{
+	struct fmac_event *ev;
+	unsigned long flags;
+	u64 head, tail;
+	bool was_empty;
+
+	if (!READ_ONCE(shm_hdr))
+		return;
+
+	spin_lock_irqsave(&ring_lock, flags);
+
+	/* fmac_anonfd_exit() clears it under the lock before freeing */
+	if (!shm_hdr) {
+		spin_unlock_irqrestore(&ring_lock, flags);
+		return;
+	}
+
+	head = ring_head;
+	tail = READ_ONCE(shm_hdr->tail);
+	if (head - tail >= FMAC_RING_RECS) {
+		WRITE_ONCE(shm_hdr->dropped, shm_hdr->dropped + 1);
+		spin_unlock_irqrestore(&ring_lock, flags);
+		return;
 	}
+
+	ev = &shm_ring[head % FMAC_RING_RECS];
+	/* readers check seq on both sides of their copy; see anonfd.h */
+	WRITE_ONCE(ev->seq, U64_MAX);
+	smp_wmb();
+	ev->ts_ns = ktime_get_boottime_ns();
+	ev->type = type;
+	ev->pid = task_tgid_nr(current);
+	ev->uid = uid;
+	ev->arg = arg;
+	if (data)
+		strscpy(ev->data, data, sizeof(ev->data));
+	else
+		ev->data[0] = '\0';
+	smp_store_release(&ev->seq, head);
+
+	ring_head = head + 1;
+	smp_store_release(&shm_hdr->head, ring_head);
+	smp_mb();
+	was_empty = READ_ONCE(shm_hdr->tail) == head;
+
+	spin_unlock_irqrestore(&ring_lock, flags);
+
+	if (was_empty)
+		notify_user();
+	if (atomic_read(&nr_subscribers))
+		fmac_subscribers_wake(type);
+}
+
+void eventfd_cleanup(void)
+{
+	struct eventfd_ctx *old;
+	unsigned long flags;
+
+	spin_lock_irqsave(&event_lock, flags);
+	old = event_ctx;
+	event_ctx = NULL;
+	spin_unlock_irqrestore(&event_lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
 }
 
+#ifdef CONFIG_NKSU_DEBUG
 static u32 get_mem_hash(void)
 {
-	return jhash(shared_buffer, FMAC_SHM_SIZE, 0);
+	return jhash(shared_buffer + FMAC_SHM_DATA_OFF, FMAC_SHM_DATA_SIZE, 0);
 }
 
-bool check_mmap_write(void)
+/* catch writers that forget to bump data_seq */
+static void check_mmap_hash(bool seq_changed)
 {
 	u32 now_hash = get_mem_hash();
-	if (now_hash != last_hash) {
-		last_hash = now_hash;
-		return true;
-	} else {
+
+	if (now_hash != last_hash && !seq_changed)
+		pr_warn("shm data changed without a data_seq bump\n");
+	last_hash = now_hash;
+}
+#endif
+
+bool check_mmap_write(void)
+{
+	u64 seq;
+	u32 off, len;
+	bool changed;
+
+	if (!shm_hdr)
 		return false;
+
+	seq = smp_load_acquire(&shm_hdr->data_seq);
+	changed = seq != last_seq;
+	if (changed) {
+		off = READ_ONCE(shm_hdr->dirty_off);
+		len = READ_ONCE(shm_hdr->dirty_len);
+		if (off >= FMAC_SHM_DATA_SIZE ||
+		    len > FMAC_SHM_DATA_SIZE - off || !len) {
+			off = 0;
+			len = FMAC_SHM_DATA_SIZE;
+		}
+		last_dirty_off = off;
+		last_dirty_len = len;
+		last_seq = seq;
+		smp_store_release(&shm_hdr->data_ack, seq);
 	}
+
+#ifdef CONFIG_NKSU_DEBUG
+	check_mmap_hash(changed);
+#endif
+	return changed;
+}
+
+/* range reported with the last change seen by check_mmap_write() */
+void fmac_shm_dirty_range(u32 *off, u32 *len)
+{
+	*off = last_dirty_off;
+	*len = last_dirty_len;
 }
 
 int fmac_anonfd_init(void)
@@ -109,14 +337,33 @@ int fmac_anonfd_init(void)
 	if (!shared_buffer)
 		return -ENOMEM;
 
-	pr_info("anonfd shared buffer allocated: %p\n", shared_buffer);
+	shm_hdr = shared_buffer;
+	shm_ring = shared_buffer + FMAC_RING_OFF;
+	ring_head = 0;
+
+	shm_hdr->magic = FMAC_SHM_MAGIC;
+	shm_hdr->version = FMAC_SHM_VERSION;
+	shm_hdr->rec_size = sizeof(struct fmac_event);
+	shm_hdr->nr_recs = FMAC_RING_RECS;
+	shm_hdr->data_off = FMAC_SHM_DATA_OFF;
+	shm_hdr->ring_off = FMAC_RING_OFF;
+
+	pr_info("anonfd shared buffer allocated: %p (%lu records)\n",
+		shared_buffer, (unsigned long)FMAC_RING_RECS);
+	last_seq = 0;
+#ifdef CONFIG_NKSU_DEBUG
 	last_hash = get_mem_hash();
+#endif
 	return 0;
 }
 
 void fmac_anonfd_exit(void)
 {
 	if (shared_buffer) {
+		spin_lock_irq(&ring_lock);
+		shm_hdr = NULL;
+		shm_ring = NULL;
+		spin_unlock_irq(&ring_lock);
 		vfree(shared_buffer);
 		shared_buffer = NULL;
 	}
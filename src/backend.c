@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-3.0
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
+#include <asm/syscall.h>
+
+#include <fmac.h>
+
+static char *hook_backend;
+module_param(hook_backend, charp, 0444);
+MODULE_PARM_DESC(hook_backend,
+		 "hook backend: syscall, ftrace or tracepoint");
+
+/* first entry is the build default */
+static const struct nksu_hook_backend *const backends[] = {
+#ifdef CONFIG_NKSU_SYSCALL
+	&nksu_syscall_backend,
+#endif
+#ifdef CONFIG_NKSU_FTRACE
+	&nksu_ftrace_backend,
+#endif
+	&nksu_tracepoint_backend,
+};
+
+static const struct nksu_hook_backend *active_backend;
+
+bool nksu_backend_marks_threads(void)
+{
+	return active_backend && active_backend->mark_threads;
+}
+
+static bool backend_has_cmd_slot(void)
+{
+#ifdef CONFIG_NKSU_SYSCALL
+	return nksu_get_syscall_nr() >= 0;
+#else
+	return false;
+#endif
+}
+
+static const struct nksu_hook_backend *backend_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		if (sysfs_streq(name, backends[i]->name))
+			return backends[i];
+	}
+	return NULL;
+}
+
+int nksu_backend_init(void)
+{
+	const struct nksu_hook_backend *be;
+	int ret;
+
+	if (!hook_backend || !*hook_backend) {
+		be = backends[0];
+	} else {
+		be = backend_lookup(hook_backend);
+		if (!be) {
+			pr_err("[backend]: '%s' is not built in\n",
+			       hook_backend);
+			return -EINVAL;
+		}
+	}
+
+	ret = nksu_hook_load(be);
+	if (ret)
+		return ret;
+
+	active_backend = be;
+	pr_info("[backend]: using %s\n", be->name);
+	if (!backend_has_cmd_slot())
+		pr_info("[backend]: no command syscall with %s, ctl fd only\n",
+			be->name);
+	return 0;
+}
+
+void nksu_backend_exit(void)
+{
+	if (!active_backend)
+		return;
+
+	nksu_hook_unload(active_backend);
+	active_backend = NULL;
+}
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-3.0
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/ftrace.h>
+#include <linux/kallsyms.h>
+#include <linux/version.h>
+#include <linux/cred.h>
+#include <linux/delay.h>
+#include <linux/atomic.h>
+#include <asm/syscall.h>
+
+#include <fmac.h>
+
+/*
+ * ftrace backend: attach to the syscall wrappers themselves, so the cost is
+ * paid only by calls to the hooked syscalls, not by every syscall of a
+ * marked thread (tracepoint) or every syscall of every task
+ * (sys_call_table).  The ftrace callback runs with preemption off, so it
+ * only points the wrapper's pc at a per-hook trampoline.  The trampoline
+ * runs in the syscall's own context: it calls the shared handler from
+ * hook.c with the user pt_regs, the wrapper's first argument, and then the
+ * original wrapper unless the handler answered the call itself.  The
+ * original's own ftrace entry sees our trampoline as its caller and lets
+ * it through.
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define NKSU_FTRACE_REGS struct ftrace_regs
+#else
+#define NKSU_FTRACE_REGS struct pt_regs
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define NKSU_FTRACE_FLAGS (FTRACE_OPS_FL_RECURSION | FTRACE_OPS_FL_IPMODIFY)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define NKSU_FTRACE_FLAGS (FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_RECURSION | \
+			   FTRACE_OPS_FL_IPMODIFY)
+#else
+#define NKSU_FTRACE_FLAGS (FTRACE_OPS_FL_SAVE_REGS | \
+			   FTRACE_OPS_FL_RECURSION_SAFE | \
+			   FTRACE_OPS_FL_IPMODIFY)
+#endif
+
+#define FTRACE_NR_HOOKS 5
+
+struct ftrace_hook {
+	int nr;
+	const char *sym;
+	syscall_fn_t tramp;
+	syscall_fn_t orig;
+	nksu_handler_t fn;
+	bool armed;
+	struct ftrace_ops ops;
+};
+
+static struct ftrace_hook ftrace_hooks[FTRACE_NR_HOOKS];
+
+/*
+ * Tasks sent to a trampoline and not back out of it yet.  Counted in the
+ * ftrace callback, which unregister_ftrace_function() waits for, so unload
+ * sees every task that can still reach module text.
+ */
+static atomic_t ftrace_hook_inflight = ATOMIC_INIT(0);
+
+static long notrace ftrace_hook_run(struct ftrace_hook *h,
+				    const struct pt_regs *regs)
+{
+	long ret;
+
+	/* handled calls return the handler's value, as with sys_call_table */
+	ret = h->fn((struct pt_regs *)regs);
+	if (!ret)
+		ret = h->orig(regs);
+	atomic_dec(&ftrace_hook_inflight);
+	return ret;
+}
+
+#define FTRACE_TRAMP(_i)						\
+static long notrace ftrace_tramp_##_i(const struct pt_regs *regs)	\
+{									\
+	return ftrace_hook_run(&ftrace_hooks[_i], regs);		\
+}
+
+FTRACE_TRAMP(0)
+FTRACE_TRAMP(1)
+FTRACE_TRAMP(2)
+FTRACE_TRAMP(3)
+FTRACE_TRAMP(4)
+
+static struct ftrace_hook ftrace_hooks[FTRACE_NR_HOOKS] = {
+	{ __NR_faccessat,  "__arm64_sys_faccessat",  ftrace_tramp_0 },
+	{ __NR_newfstatat, "__arm64_sys_newfstatat", ftrace_tramp_1 },
+	{ __NR_prctl,      "__arm64_sys_prctl",      ftrace_tramp_2 },
+	{ __NR_execve,     "__arm64_sys_execve",     ftrace_tramp_3 },
+	{ __NR_execveat,   "__arm64_sys_execveat",   ftrace_tramp_4 },
+};
+
+static inline void ftrace_set_pc(NKSU_FTRACE_REGS *fregs, unsigned long pc)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+	ftrace_regs_set_instruction_pointer(fregs, pc);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	instruction_pointer_set(ftrace_get_regs(fregs), pc);
+#else
+	instruction_pointer_set(fregs, pc);
+#endif
+}
+
+static void notrace ftrace_hook_thunk(unsigned long ip,
+				      unsigned long parent_ip,
+				      struct ftrace_ops *op,
+				      NKSU_FTRACE_REGS *fregs)
+{
+	struct ftrace_hook *h = container_of(op, struct ftrace_hook, ops);
+
+	/* the trampoline calling the original */
+	if (within_module(parent_ip, THIS_MODULE))
+		return;
+	if (likely(!nksu_profile_has_uid(current_uid().val)))
+		return;
+
+	atomic_inc(&ftrace_hook_inflight);
+	ftrace_set_pc(fregs, (unsigned long)h->tramp);
+}
+
+static struct ftrace_hook *ftrace_hook_find(int nr)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ftrace_hooks); i++) {
+		if (ftrace_hooks[i].nr == nr)
+			return &ftrace_hooks[i];
+	}
+	return NULL;
+}
+
+static int ftrace_hook_attach(int nr, nksu_handler_t fn)
+{
+	struct ftrace_hook *h = ftrace_hook_find(nr);
+	int ret;
+
+	if (!h || !fn)
+		return -EINVAL;
+	if (h->armed)
+		return -EEXIST;
+
+	h->orig = (syscall_fn_t)kallsyms_lookup_name(h->sym);
+	if (!h->orig) {
+		pr_err("[ftrace]: can't resolve %s\n", h->sym);
+		return -ENOENT;
+	}
+
+	h->fn = fn;
+	h->ops.func = ftrace_hook_thunk;
+	h->ops.flags = NKSU_FTRACE_FLAGS;
+
+	ret = ftrace_set_filter_ip(&h->ops, (unsigned long)h->orig, 0, 0);
+	if (ret) {
+		pr_err("[ftrace]: set filter on %s failed: %d\n", h->sym, ret);
+		return ret;
+	}
+
+	ret = register_ftrace_function(&h->ops);
+	if (ret) {
+		pr_err("[ftrace]: register on %s failed: %d\n", h->sym, ret);
+		ftrace_set_filter_ip(&h->ops, (unsigned long)h->orig, 1, 0);
+		return ret;
+	}
+
+	h->armed = true;
+	pr_info("[ftrace]: attached %s at %ps\n", h->sym, h->orig);
+	return 0;
+}
+
+static void ftrace_hook_detach_all(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ftrace_hooks); i++) {
+		struct ftrace_hook *h = &ftrace_hooks[i];
+
+		if (!h->armed)
+			continue;
+		unregister_ftrace_function(&h->ops);
+		ftrace_set_filter_ip(&h->ops, (unsigned long)h->orig, 1, 0);
+		h->armed = false;
+	}
+	/* a task may sit in an execve or prctl it entered through us */
+	while (atomic_read(&ftrace_hook_inflight))
+		msleep(1);
+	for (i = 0; i < ARRAY_SIZE(ftrace_hooks); i++)
+		ftrace_hooks[i].fn = NULL;
+}
+
+const struct nksu_hook_backend nksu_ftrace_backend = {
+	.name = "ftrace",
+	.init = NULL,
+	.exit = ftrace_hook_detach_all,
+	.attach = ftrace_hook_attach,
+};
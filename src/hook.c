@@ -51,7 +51,11 @@ static inline unsigned long try_redirect_path(struct pt_regs *regs,
 	if (!sp)
 		return 0;
 
-	return PUSH_STR(sp, SH_PATH, SH_PATH_LEN);
+	sp = PUSH_STR(sp, SH_PATH, SH_PATH_LEN);
+	if (sp)
+		fmac_event_emit(FMAC_EV_REDIRECT, current_uid().val,
+				(s32)regs->regs[8], buf);
+	return sp;
 }
 
 static long hook_path_at(struct pt_regs *regs)
@@ -91,69 +95,51 @@ static long hook__NR_execveat(struct pt_regs *regs)
 	return 0;
 }
 
-int init_syscall_hook(void)
+struct hook_spec {
+	int nr;
+	nksu_handler_t fn;
+	const char *name;
+};
+
+static const struct hook_spec hook_specs[] = {
+	{ __NR_faccessat,  hook_path_at,       "faccessat"  },
+	{ __NR_newfstatat, hook_path_at,       "newfstatat" },
+	{ __NR_prctl,      handle_prctl_hooks, "prctl"      },
+	{ __NR_execve,     hook__NR_execve,    "execve"     },
+	{ __NR_execveat,   hook__NR_execveat,  "execveat"   },
+};
+
+int nksu_hook_load(const struct nksu_hook_backend *be)
 {
-	int ret;
-	ret = nksu_redirect_syscall(__NR_faccessat);
-	if (ret) {
-		pr_err("[hook]: can't redirect faccessat ret %d\n", ret);
-		return ret;
+	int i, ret;
+
+	if (be->init) {
+		ret = be->init();
+		if (ret) {
+			pr_err("[hook]: %s backend init failed, ret %d\n",
+			       be->name, ret);
+			return ret;
+		}
 	}
 
-	ret = nksu_redirect_syscall(__NR_newfstatat);
-	if (ret) {
-		pr_err("[hook]: can't redirect newfstatat ret %d\n", ret);
-		return ret;
+	for (i = 0; i < ARRAY_SIZE(hook_specs); i++) {
+		ret = be->attach(hook_specs[i].nr, hook_specs[i].fn);
+		if (ret) {
+			pr_err("[hook]: %s can't attach %s, ret %d\n",
+			       be->name, hook_specs[i].name, ret);
+			if (be->exit)
+				be->exit();
+			return ret;
+		}
 	}
 
-	ret = nksu_redirect_syscall(__NR_prctl);
-	if (ret) {
-		pr_err("[hook]: can't redirect prctl ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_redirect_syscall(__NR_execve);
-	if (ret) {
-		pr_err("[hook]: can't redirect __NR_execve ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_redirect_syscall(__NR_execveat);
-	if (ret) {
-		pr_err("[hook]: can't redirect __NR_execveat ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_register_handler(__NR_faccessat, hook_path_at);
-	if (ret) {
-		pr_err("[hook]: can't register faccessat,ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_register_handler(__NR_newfstatat, hook_path_at);
-	if (ret) {
-		pr_err("[hook]: can't register newfstatat,ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_register_handler(__NR_prctl, handle_prctl_hooks);
-	if (ret) {
-		pr_err("[hook]: can't register prctl,ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_register_handler(__NR_execve, hook__NR_execve);
-	if (ret) {
-		pr_err("[hook]: can't register __NR_execve,ret %d\n", ret);
-		return ret;
-	}
-
-	ret = nksu_register_handler(__NR_execveat, hook__NR_execveat);
-	if (ret) {
-		pr_err("[hook]: can't register __NR_execveat,ret %d\n", ret);
-		return ret;
-	}
-
-	pr_info("[hook]: loaded syscall hook\n");
+	pr_info("[hook]: loaded %s hook\n", be->name);
 	return 0;
 }
+
+void nksu_hook_unload(const struct nksu_hook_backend *be)
+{
+	if (be->exit)
+		be->exit();
+	pr_info("[hook]: unloaded %s hook\n", be->name);
+}
@@ -1,14 +1,99 @@
 #ifndef ANONFD_H
 #define ANONFD_H
 
-#define FMAC_SHM_SIZE PAGE_SIZE
+#include <linux/types.h>
+
+/*
+ * [fmac_shm] layout:
+ *   page 0            struct fmac_shm_hdr
+ *   FMAC_SHM_DATA_OFF user -> kernel data area
+ *   FMAC_RING_OFF     kernel -> user event ring of struct fmac_event
+ */
+#define FMAC_SHM_HDR_SIZE  PAGE_SIZE
+#define FMAC_SHM_DATA_SIZE PAGE_SIZE
+#define FMAC_RING_PAGES    16
+#define FMAC_RING_SIZE     (FMAC_RING_PAGES * PAGE_SIZE)
+#define FMAC_SHM_DATA_OFF  FMAC_SHM_HDR_SIZE
+#define FMAC_RING_OFF      (FMAC_SHM_DATA_OFF + FMAC_SHM_DATA_SIZE)
+#define FMAC_SHM_SIZE      (FMAC_RING_OFF + FMAC_RING_SIZE)
+
+#define FMAC_SHM_MAGIC     0x464d4143	/* "FMAC" */
+#define FMAC_SHM_VERSION   2
+
+enum fmac_event_type {
+	FMAC_EV_SU_ELEVATE = 1,	/* arg: namespace, data: selinux domain */
+	FMAC_EV_REDIRECT   = 2,	/* arg: syscall nr, data: original path */
+	FMAC_EV_PROFILE    = 3,	/* arg: 0 set, 1 cleared */
+	FMAC_EV_POLICY     = 4,	/* data: source type, "*" for all */
+};
+
+struct fmac_event {
+	__u64 seq;
+	__u64 ts_ns;
+	__u32 type;
+	__u32 pid;
+	__u32 uid;
+	__s32 arg;
+	char data[32];
+};
+
+/*
+ * head is written by the kernel only, after the record's seq, which is
+ * itself published after the payload.  Consumers copy records out of
+ * [tail, head), checking each seq against its index before and after the
+ * copy, and only then claim what they copied with a CAS of tail; the
+ * kernel never overwrites a slot at or after tail.  A record whose seq
+ * doesn't match was lapped (a consumer moved tail too far) or is being
+ * rewritten.  The eventfd fires only when the ring goes from empty to
+ * non-empty, so re-check head before sleeping.
+ */
+struct fmac_shm_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 rec_size;
+	__u32 nr_recs;
+	__u64 data_off;
+	__u64 ring_off;
+
+	__u64 head __attribute__((aligned(64)));
+	__u64 dropped;
+
+	__u64 tail __attribute__((aligned(64)));
+
+	/*
+	 * User -> kernel: after writing the data area, widen
+	 * [dirty_off, dirty_off + dirty_len) to cover the write and then
+	 * increment data_seq.  The kernel stores the seq it has consumed in
+	 * data_ack; the range may be reset once data_ack == data_seq.
+	 */
+	__u64 data_seq __attribute__((aligned(64)));
+	__u32 dirty_off;
+	__u32 dirty_len;
+	__u64 data_ack;
+};
+
+/* IOC_SUBSCRIBE mask bit for an event type */
+#define FMAC_EV_MASK(type) (1U << (type))
+
+struct file;
+struct poll_table_struct;
+struct fmac_subscriber;
 
 int fmac_anonfd_get(void);
 int bind_eventfd(int fd);
 void notify_user(void);
+void fmac_event_emit(u32 type, u32 uid, s32 arg, const char *data);
 void eventfd_cleanup(void);
+struct fmac_subscriber *fmac_subscriber_alloc(void);
+void fmac_subscriber_set_mask(struct fmac_subscriber *sub, u32 mask);
+void fmac_subscriber_free(struct fmac_subscriber *sub);
+__poll_t fmac_subscriber_poll(struct fmac_subscriber *sub, struct file *file,
+			      struct poll_table_struct *wait);
+ssize_t fmac_subscriber_read(struct fmac_subscriber *sub, bool nonblock,
+			     char __user *buf, size_t count);
 bool check_mmap_write(void);
+void fmac_shm_dirty_range(u32 *off, u32 *len);
 int fmac_anonfd_init(void);
 void fmac_anonfd_exit(void);
 
-#endif /* ANONFD_H */
\ No newline at end of file
+#endif /* ANONFD_H */
@@ -22,6 +22,11 @@
 #include "selinux/policy.h"
 #include "selinux/domain.h"
 #include "selinux/dup.h"
+#include "selinux/rule_index.h"
+#include "selinux/rule_refs.h"
+#include "selinux/journal.h"
+#include "selinux/patch.h"
+#include "selinux/stats.h"
 #include "privilege.h"
 #include "tracepoint.h"
 #include "ioctl.h"
@@ -36,6 +41,10 @@
 #include "../syscall/syscall.h"
 #endif
 
+#ifdef CONFIG_NKSU_FTRACE
+#include "ftrace_hook.h"
+#endif
+
 extern struct proc_dir_entry *fmac_proc_dir;
 
 #define MAX_PATH_LEN 1024
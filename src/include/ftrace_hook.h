@@ -0,0 +1,6 @@
+#ifndef FTRACE_HOOK_H
+#define FTRACE_HOOK_H
+
+extern const struct nksu_hook_backend nksu_ftrace_backend;
+
+#endif /* FTRACE_HOOK_H */
@@ -1,3 +1,5 @@
+#include "../syscall/type.h"
+
 #define SU_PATH             "/system/bin/su"
 #define SU_PATH_LEN         (sizeof(SU_PATH))
 
@@ -22,5 +24,20 @@ static inline bool path_is_su(const char *p)
 	return memcmp(p, SU_PATH, SU_PATH_LEN) == 0;
 }
 
-int init_syscall_hook(void);
-void exit_syscall_hook(void);
\ No newline at end of file
+struct nksu_hook_backend {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+	/* route syscall @nr of tracked uids through @fn */
+	int (*attach)(int nr, nksu_handler_t fn);
+	/* only threads flagged by mark_threads_by_*() are intercepted */
+	bool mark_threads;
+};
+
+int nksu_hook_load(const struct nksu_hook_backend *be);
+void nksu_hook_unload(const struct nksu_hook_backend *be);
+
+int nksu_backend_init(void);
+void nksu_backend_exit(void);
+bool nksu_backend_marks_threads(void);
+long nksu_backend_call_direct(struct pt_regs *regs);
\ No newline at end of file
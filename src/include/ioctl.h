@@ -13,5 +13,7 @@
 #define IOC_DEL_CAP    _IOW(IOC_MAGIC, 8, struct fmac_uid_cap)
 
 int fmac_ctlfd_get(void);
+int fmac_ctl_init(void);
+void fmac_ctl_exit(void);
 
 #endif /* IOCTL_H */
\ No newline at end of file
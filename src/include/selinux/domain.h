@@ -1 +1,18 @@
-int sepolicy_add_domain(const char *name);
\ No newline at end of file
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+/* attribute every concrete type belongs to, used for wildcard rules */
+#define NKSU_ALL_TYPES_ATTR "nksu_all_types"
+
+struct sepolicy_session;
+struct type_datum;
+
+int sepolicy_add_domain(const char *name);
+int sepolicy_add_domains(const char *const *names, unsigned int n);
+int sepolicy_add_domains_locked(struct sepolicy_session *sess,
+				const char *const *names, unsigned int n);
+int sepolicy_add_type_locked(struct sepolicy_session *sess, const char *name,
+			     bool attribute);
+struct type_datum *sepolicy_all_types_attr(struct sepolicy_session *sess);
+
+#endif /* DOMAIN_H */
@@ -2,7 +2,77 @@
 #ifndef _NKSU_SEPOLICY_BACKUP_H
 #define _NKSU_SEPOLICY_BACKUP_H
 
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#define _nksu_kvrealloc(p, new_sz, _old_sz) kvrealloc(p, new_sz, GFP_KERNEL)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define _nksu_kvrealloc(p, new_sz, old_sz)  kvrealloc(p, old_sz, new_sz, GFP_KERNEL)
+#else
+static inline void *_nksu_kvrealloc_compat(const void *p, size_t oldsz,
+					   size_t newsz, gfp_t f)
+{
+	void *n;
+	if (oldsz >= newsz)
+		return (void *)p;
+	n = kvmalloc(newsz, f);
+	if (!n)
+		return NULL;
+	memcpy(n, p, oldsz);
+	kvfree(p);
+	return n;
+}
+#define _nksu_kvrealloc(p, new_sz, old_sz) \
+	_nksu_kvrealloc_compat(p, old_sz, new_sz, GFP_KERNEL)
+#endif
+
+struct policydb;
+struct avtab;
+struct avtab_key;
+struct class_datum;
+struct role_datum;
+
 int  sepolicy_dup_and_apply(void);
 void sepolicy_restore(void);
+int  sepolicy_reattach(void);
+bool sepolicy_live_replaced(void);
+bool sepolicy_follow_bools_locked(void);
+
+/*
+ * Copy-on-write hooks for the working copy.  Call before writing the
+ * structure; on any other policydb they are no-ops.  Caller holds
+ * policy_mutex.
+ */
+int sepolicy_cow_avtab_slot(struct policydb *p, u32 slot);
+int sepolicy_cow_avtab_key(struct policydb *p, const struct avtab_key *key);
+struct avtab_node;
+int sepolicy_cow_avtab_bulk(struct policydb *p,
+			    bool (*want)(const struct avtab_node *chain));
+struct class_datum *sepolicy_cow_class(struct policydb *p,
+				       struct class_datum *cls);
+struct role_datum *sepolicy_cow_role(struct policydb *p, u32 idx);
+int sepolicy_cow_type_attr(struct policydb *p, u32 idx);
+
+/* may republish the working copy: any cached policydb pointer goes stale */
+int sepolicy_avtab_rehash(struct policydb *p);
+
+/*
+ * Private te_avtab builds for staged edits.  stage_copy() copies whole
+ * slots until @budget nodes are done and returns 1 once the table is
+ * complete; install() publishes the build and returns the new policydb.
+ */
+int sepolicy_avtab_stage_init(struct policydb *p, u64 extra,
+			      struct avtab *dst);
+int sepolicy_avtab_stage_copy(struct policydb *p, struct avtab *dst,
+			      u32 *pos, u32 budget);
+struct policydb *sepolicy_avtab_install(struct policydb *p,
+					struct avtab *newtab);
+
+/* node removal: unlink under policy_mutex, free after synchronize_rcu() */
+void sepolicy_avtab_unlink(struct avtab *h, struct avtab_node *node);
+void sepolicy_avtab_free_nodes(struct avtab_node **nodes, u32 n);
 
-#endif /* _NKSU_SEPOLICY_BACKUP_H */
\ No newline at end of file
+#endif /* _NKSU_SEPOLICY_BACKUP_H */
@@ -0,0 +1,31 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+struct sepolicy_session;
+
+enum {
+	JNL_DOMAIN,		/* name */
+	JNL_RULE,		/* src, tgt, cls, perm */
+	JNL_ALL_TYPES,		/* src, cls */
+	JNL_ANY_ANY,		/* src */
+	JNL_TYPEATTR,		/* type, attr */
+	JNL_XPERM,		/* src, tgt, cls, range */
+	JNL_TYPE,		/* name; invert: attribute */
+	JNL_GROUPS,		/* the built-in policy groups */
+	JNL_REMOVE,		/* src, tgt, cls, perm of a JNL_RULE */
+};
+
+/*
+ * Caller holds policy_mutex; a no-op while the journal is replaying.
+ * A nonzero @staged marks an edit that needs the session's first @staged
+ * staged edits; the next settle() keeps or drops it.
+ */
+void sepolicy_journal_record(int type, const char *a0, const char *a1,
+			     const char *a2, const char *a3, int effect,
+			     bool invert, u32 staged);
+void sepolicy_journal_settle(u32 applied);
+int sepolicy_journal_replay(struct sepolicy_session *sess);
+int sepolicy_journal_init(void);
+void sepolicy_journal_exit(void);
+
+#endif /* JOURNAL_H */
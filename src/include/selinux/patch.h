@@ -0,0 +1,65 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <linux/types.h>
+
+/*
+ * Binary sepolicy patch, as written by "ncore sepolicy compile".  All
+ * fields little endian:
+ *
+ *   struct nksu_patch_hdr
+ *   string table: nstr NUL-terminated strings, the first one empty,
+ *                 strtab_len bytes (a multiple of 4)
+ *   ops:          ops_len bytes of nksu_patch_op, each followed by
+ *                 nperm u32 string ids
+ *
+ * String id 0 is the empty string and stands for "any" wherever a name
+ * is optional.  nperm == 0 means every permission (or every ioctl for
+ * NKSU_PATCH_XPERM).
+ */
+#define NKSU_PATCH_MAGIC	0x50534b4e	/* "NKSP" */
+#define NKSU_PATCH_VERSION	1
+#define NKSU_PATCH_MAX_LEN	(1024 * 1024)
+
+enum {
+	NKSU_PATCH_ALLOW = 1,
+	NKSU_PATCH_DENY,
+	NKSU_PATCH_AUDITALLOW,
+	NKSU_PATCH_DONTAUDIT,
+	NKSU_PATCH_XPERM,	/* allowxperm; perms are ioctl ranges */
+	NKSU_PATCH_TYPEATTR,	/* src joins attribute tgt */
+	NKSU_PATCH_TYPE,	/* declare src; NKSU_PATCH_F_ATTR: attribute */
+};
+
+#define NKSU_PATCH_F_ATTR	0x1
+
+struct nksu_patch_hdr {
+	__le32 magic;
+	__le16 version;
+	__le16 flags;
+	__le32 nstr;
+	__le32 strtab_len;
+	__le32 nops;
+	__le32 ops_len;
+};
+
+struct nksu_patch_op {
+	__u8 code;
+	__u8 nperm;
+	__u8 flags;
+	__u8 reserved;
+	__le32 src;
+	__le32 tgt;
+	__le32 cls;
+	__le32 perm[];
+};
+
+struct sepolicy_patch_result {
+	u32 done;	/* ops applied */
+	u32 failed;	/* rules within them that failed */
+};
+
+int sepolicy_apply_patch(const void *buf, size_t len,
+			 struct sepolicy_patch_result *res);
+
+#endif /* PATCH_H */
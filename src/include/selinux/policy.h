@@ -1,2 +1,4 @@
  int __init sepolicy_init(void);
- void __exit sepolicy_exit(void);
\ No newline at end of file
+ void __exit sepolicy_exit(void);
+ struct sepolicy_session;
+ int sepolicy_apply_groups(struct sepolicy_session *sess);
\ No newline at end of file
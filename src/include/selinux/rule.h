@@ -1,4 +1,6 @@
 #ifndef RULE_H
+#include <linux/ktime.h>
+
 int sepolicy_add_rule(const char *sname, const char *tname,
                             const char *cname, const char *pname,
                             int effect, bool invert);
@@ -7,7 +9,85 @@ int sepolicy_allow_all_types(const char *sname, const char *cname);
 int sepolicy_add_typeattribute(const char *type_name, const char *attr_name);
 int sepolicy_add_xperm(const char *s, const char *t, const char *c,
 		       const char *range, int effect, bool invert);
+int sepolicy_remove_rule(const char *sname, const char *tname,
+			 const char *cname, const char *pname,
+			 int effect, bool invert);
 void avc_reset(void);
+void sepolicy_iter_cache_drop(void);
+void sepolicy_attr_index_drop(void);
+
+struct policydb;
+struct avtab_node;
+struct sepolicy_stage_op;
+
+/*
+ * Holds policy_mutex from begin to commit and flushes the AVC once at
+ * commit.  Wide wildcard expansions are staged instead of applied and
+ * written at commit into a private te_avtab, with policy_mutex dropped
+ * between chunks.
+ */
+struct sepolicy_session {
+	struct policydb *pdb;
+	u32 nel_start;		/* te_avtab.nel at begin */
+	int edits;
+	char src[32];
+	ktime_t t_locked;	/* for the edit phase statistics */
+	struct sepolicy_stage_op *staged;
+	u32 nstaged;
+	u32 staged_cap;
+	u64 staged_nodes;	/* upper bound on the nodes they write */
+	struct avtab_node **dead;	/* removed, freed after commit */
+	u32 ndead;
+	u32 dead_cap;
+	void **retired;		/* replaced arrays, kvfree'd after commit */
+	u32 nretired;
+	u32 retired_cap;
+};
+
+int sepolicy_session_begin(struct sepolicy_session *sess);
+int sepolicy_session_commit(struct sepolicy_session *sess);
+int sepolicy_session_retire_reserve(struct sepolicy_session *sess, u32 n);
+void sepolicy_session_retire(struct sepolicy_session *sess, void *p);
+int sepolicy_session_add_rule(struct sepolicy_session *sess,
+			      const char *sname, const char *tname,
+			      const char *cname, const char *pname,
+			      int effect, bool invert);
+int sepolicy_session_allow_all_types(struct sepolicy_session *sess,
+				     const char *sname, const char *cname);
+int sepolicy_session_allow_any_any(struct sepolicy_session *sess,
+				   const char *sname);
+int sepolicy_session_add_typeattribute(struct sepolicy_session *sess,
+				       const char *type_name,
+				       const char *attr_name);
+int sepolicy_session_add_xperm(struct sepolicy_session *sess,
+			       const char *s, const char *t, const char *c,
+			       const char *range, int effect, bool invert);
+int sepolicy_session_add_type(struct sepolicy_session *sess,
+			      const char *name, bool attribute);
+int sepolicy_session_add_domains(struct sepolicy_session *sess,
+				 const char *const *names, unsigned int n);
+int sepolicy_session_remove_rule(struct sepolicy_session *sess,
+				 const char *sname, const char *tname,
+				 const char *cname, const char *pname,
+				 int effect, bool invert);
+
+/* a rule resolved against one policy generation; 0 values mean "any" */
+struct sepolicy_resolved_rule {
+	u32 src;
+	u32 tgt;
+	u32 cls;
+	u32 mask;		/* permission bits, ~0 for all */
+	int effect;
+	bool invert;
+};
+
+int sepolicy_session_resolve_rule(struct sepolicy_session *sess,
+				  const char *sname, const char *tname,
+				  const char *cname, const char *pname,
+				  struct sepolicy_resolved_rule *r);
+int sepolicy_session_apply_resolved(struct sepolicy_session *sess,
+				    const struct sepolicy_resolved_rule *r);
+u32 sepolicy_policy_seqno(struct policydb *pdb);
 #ifdef CONFIG_NKSU_DEBUG
 int sepolicy_make_audit(void);
 #endif
@@ -0,0 +1,23 @@
+#ifndef RULE_INDEX_H
+#define RULE_INDEX_H
+
+struct policydb;
+
+/* "src\0tgt\0cls\0perm\0" of a rule as requested, NULL stored as "" */
+#define RULE_NAME_MAX	64
+#define RULE_KEY_MAX	(4 * RULE_NAME_MAX)
+
+size_t sepolicy_rule_key(char *buf, const char *s, const char *t,
+			 const char *c, const char *p);
+
+bool sepolicy_rule_index_hit(struct policydb *pdb, const char *s,
+			     const char *t, const char *c, const char *p,
+			     int effect, bool invert);
+void sepolicy_rule_index_add(struct policydb *pdb, const char *s,
+			     const char *t, const char *c, const char *p,
+			     int effect, bool invert);
+bool sepolicy_rule_is_reverting(int effect, bool invert);
+void sepolicy_rule_index_flush(void);
+void sepolicy_rule_index_rebind(u32 from, u32 to);
+
+#endif /* RULE_INDEX_H */
@@ -0,0 +1,30 @@
+#ifndef RULE_REFS_H
+#define RULE_REFS_H
+
+struct policydb;
+struct avtab_key;
+
+/* what dropping references leaves to undo on one avtab node */
+struct sepolicy_rule_release {
+	u32 clear;		/* bits to clear */
+	u32 set;		/* bits to set again */
+	bool drop;		/* nksu created the node and nothing holds it */
+};
+
+void sepolicy_rule_refs_sync(struct policydb *pdb);
+void sepolicy_rule_refs_rebind(u32 from, u32 to);
+void sepolicy_rule_refs_note(const struct avtab_key *key, bool created,
+			     u32 before, u32 mask, bool invert, bool again);
+bool sepolicy_rule_refs_tracked(const struct avtab_key *key);
+bool sepolicy_rule_refs_put(const struct avtab_key *key, u32 mask,
+			    struct sepolicy_rule_release *rel);
+void sepolicy_rule_refs_flush(void);
+void sepolicy_rule_refs_mark(void);
+void sepolicy_rule_refs_unmark(bool rollback);
+int sepolicy_rule_refs_held(const char *s, const char *t, const char *c,
+			    const char *p, int effect, bool invert);
+void sepolicy_rule_refs_hold(const char *s, const char *t, const char *c,
+			     const char *p, int effect, bool invert,
+			     bool hold);
+
+#endif /* RULE_REFS_H */
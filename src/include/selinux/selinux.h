@@ -7,6 +7,8 @@
 void setenforce(bool status);
 bool getenforce(void);
 int set_domain(const char *domain, struct cred *new_cred);
+struct policydb;
+bool do_allow(struct policydb *db, const char *type_name);
 int init_selinux_hook(void);
 void __exit selinux_exit(void);
 
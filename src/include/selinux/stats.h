@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+
+enum {
+	SEPOLICY_PHASE_DUP,		/* duplicating a live policy */
+	SEPOLICY_PHASE_LOCK,		/* waiting for policy_mutex */
+	SEPOLICY_PHASE_EDIT,		/* session begin to commit */
+	SEPOLICY_PHASE_REHASH,		/* avtab resize at commit */
+	SEPOLICY_PHASE_AVC,		/* AVC reset after an edit */
+	SEPOLICY_PHASE_REPLAY,		/* journal replay after a reload */
+	SEPOLICY_PHASE_NR,
+};
+
+/* counters only ever grow; readers take a snapshot without locking */
+struct sepolicy_stats {
+	atomic64_t nodes_added;		/* avtab nodes inserted by nksu */
+	atomic64_t bytes_added;
+	atomic64_t nodes_cloned;	/* shared nodes copied on write */
+	atomic64_t phase_count[SEPOLICY_PHASE_NR];
+	atomic64_t phase_ns[SEPOLICY_PHASE_NR];
+	atomic64_t phase_max_ns[SEPOLICY_PHASE_NR];
+	/* AVC audit records, [0] granted, [1] denied */
+	atomic64_t audits[2];
+	atomic64_t audits_domain_src[2];	/* scontext is DOMAIN */
+	atomic64_t audits_domain_tgt[2];	/* tcontext is DOMAIN */
+};
+
+extern struct sepolicy_stats sepolicy_stats;
+
+static inline void sepolicy_stats_node(size_t bytes)
+{
+	atomic64_inc(&sepolicy_stats.nodes_added);
+	atomic64_add(bytes, &sepolicy_stats.bytes_added);
+}
+
+void sepolicy_stats_phase(int phase, ktime_t start);
+
+struct seq_file;
+void sepolicy_cow_show(struct seq_file *m);
+
+int sepolicy_stats_init(void);
+void sepolicy_stats_exit(void);
+
+#endif /* STATS_H */
@@ -1,9 +1,14 @@
 #ifndef TRACEPOINT_H
 #define TRACEPOINT_H
 
+struct tracepoint;
+
 void mark_threads_by_uid(uid_t uid);
 void mark_threads_by_pid(pid_t pid);
 int load_tracepoint_hook(void);
 void unload_tracepoint_hook(void);
+struct tracepoint *find_tracepoint(const char *name);
+
+extern const struct nksu_hook_backend nksu_tracepoint_backend;
 
 #endif /* TRACEPOINT_H */
\ No newline at end of file
@@ -4,6 +4,20 @@
 #include <fmac.h>
 #include <linux/version.h>
 #include <linux/capability.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/cred.h>
+#if IS_ENABLED(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define FMAC_URING_CMD 1
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
 
 struct fmac_rule {
 	char path[1024];
@@ -31,6 +45,57 @@ struct fmac_sepolicy_rule {
 	int invert;
 };
 
+/* IOC_LIST_PROFILES: fill buf[max] from cursor, cursor==~0 means done */
+struct fmac_profile_list {
+	uint64_t cursor;	/* in/out */
+	uint64_t gen;		/* out: table generation of this page */
+	uint64_t buf;		/* struct nksu_profile_data[max] */
+	unsigned int max;
+	unsigned int count;	/* out */
+};
+
+#define FMAC_LIST_MAX		256
+
+/*
+ * IOC_BATCH: buf holds back-to-back fmac_batch_op headers, each followed
+ * by the same payload the matching single ioctl takes, padded to 8 bytes.
+ * One s32 result per executed op is written to status[].
+ */
+struct fmac_batch_op {
+	unsigned int op;	/* IOC_* number of the single ioctl */
+	unsigned int len;	/* payload length, must be _IOC_SIZE(op) */
+};
+
+struct fmac_batch {
+	uint64_t buf;
+	uint64_t status;
+	unsigned int len;
+	unsigned int nr_status;
+	unsigned int flags;
+	unsigned int done;	/* out: ops executed */
+};
+
+/* IOC_SEL_ADD_RULES: count rules applied under one policy edit session */
+struct fmac_sepolicy_rules {
+	uint64_t rules;		/* struct fmac_sepolicy_rule[count] */
+	uint64_t status;	/* s32[count], out */
+	unsigned int count;
+	unsigned int done;	/* out: rules attempted */
+};
+
+/* IOC_SEL_PATCH: a compiled sepolicy patch, see selinux/patch.h */
+struct fmac_sepolicy_patch {
+	uint64_t buf;
+	unsigned int len;
+	unsigned int done;	/* out: ops applied */
+	unsigned int failed;	/* out: failed edits */
+	unsigned int reserved;
+};
+
+#define FMAC_BATCH_STOP_ON_ERR	0x1
+#define FMAC_BATCH_MAX_LEN	(64 * 1024)
+#define FMAC_BATCH_MAX_OPS	1024
+
 #define IOC_MAGIC         'F'
 #define IOC_GET_SHM       _IO(IOC_MAGIC,    0)
 #define IOC_BIND_EVT      _IOW(IOC_MAGIC,   1, int)
@@ -43,28 +108,116 @@ struct fmac_sepolicy_rule {
 #define IOC_DEL_CAP       _IOW(IOC_MAGIC,   8, struct fmac_uid_cap)
 #define IOC_SEL_ADD_RULE  _IOW(IOC_MAGIC,   9, struct fmac_sepolicy_rule)
 #define IOC_SET_PROFILE  _IOW(IOC_MAGIC, 10, struct nksu_profile_data)
+#define IOC_GET_CMD_NR    _IOR(IOC_MAGIC,  11, int)
+#define IOC_SUBSCRIBE     _IOW(IOC_MAGIC,  12, unsigned int)
+#define IOC_BATCH         _IOWR(IOC_MAGIC, 13, struct fmac_batch)
+#define IOC_LIST_PROFILES _IOWR(IOC_MAGIC, 14, struct fmac_profile_list)
+#define IOC_SEL_ADD_RULES _IOWR(IOC_MAGIC, 15, struct fmac_sepolicy_rules)
+#define IOC_SEL_PATCH     _IOWR(IOC_MAGIC, 16, struct fmac_sepolicy_patch)
+#define IOC_SEL_DEL_RULE  _IOW(IOC_MAGIC,  17, struct fmac_sepolicy_rule)
+
+/*
+ * The do_* helpers take kernel copies of the ioctl payloads, so the same
+ * code serves a single ioctl and each entry of an IOC_BATCH buffer.
+ */
+static long do_add_uid(const unsigned int *id)
+{
+	return nksu_profile_set_default((uid_t) *id) ? -ENOMEM : 0;
+}
 
-static inline kernel_cap_t u64_to_cap(u64 v)
+static long do_del_uid(const unsigned int *id)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-	kernel_cap_t res;
-	res.val = v;
-	return res;
-#else
-	kernel_cap_t cap;
-	cap.cap[0] = (u32) v;
-	cap.cap[1] = (u32) (v >> 32);
-	return cap;
-#endif
+	nksu_profile_clear((uid_t) *id);
+	return 0;
 }
 
-static inline u64 cap_to_u64(kernel_cap_t cap)
+static long do_set_cap(const struct fmac_uid_cap *uc)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-	return cap.val;
-#else
-	return ((u64) cap.cap[1] << 32) | cap.cap[0];
-#endif
+	return nksu_profile_set_caps((uid_t) uc->uid, u64_to_cap(uc->caps));
+}
+
+static long do_del_cap(const struct fmac_uid_cap *uc)
+{
+	kernel_cap_t empty = CAP_EMPTY_SET;
+
+	return nksu_profile_set_caps((uid_t) uc->uid, empty);
+}
+
+static void sel_rule_terminate(struct fmac_sepolicy_rule *r)
+{
+	r->src[sizeof(r->src) - 1] = '\0';
+	r->tgt[sizeof(r->tgt) - 1] = '\0';
+	r->cls[sizeof(r->cls) - 1] = '\0';
+	r->perm[sizeof(r->perm) - 1] = '\0';
+}
+
+static long do_sel_add_rule(struct fmac_sepolicy_rule *r)
+{
+	sel_rule_terminate(r);
+	return sepolicy_add_rule(r->src[0] ? r->src : NULL,
+				 r->tgt[0] ? r->tgt : NULL,
+				 r->cls[0] ? r->cls : NULL,
+				 r->perm[0] ? r->perm : NULL,
+				 r->effect, (bool)r->invert);
+}
+
+/* takes back one IOC_SEL_ADD_RULE with the same payload */
+static long do_sel_del_rule(struct fmac_sepolicy_rule *r)
+{
+	sel_rule_terminate(r);
+	return sepolicy_remove_rule(r->src[0] ? r->src : NULL,
+				    r->tgt[0] ? r->tgt : NULL,
+				    r->cls[0] ? r->cls : NULL,
+				    r->perm[0] ? r->perm : NULL,
+				    r->effect, (bool)r->invert);
+}
+
+/* same as do_sel_add_rule(), inside an edit session begun on first use */
+static long do_sel_add_rule_session(struct sepolicy_session *sess,
+				    struct fmac_sepolicy_rule *r)
+{
+	int ret;
+
+	if (!sess->pdb) {
+		ret = sepolicy_session_begin(sess);
+		if (ret)
+			return ret;
+	}
+
+	sel_rule_terminate(r);
+	return sepolicy_session_add_rule(sess,
+					 r->src[0] ? r->src : NULL,
+					 r->tgt[0] ? r->tgt : NULL,
+					 r->cls[0] ? r->cls : NULL,
+					 r->perm[0] ? r->perm : NULL,
+					 r->effect, (bool)r->invert);
+}
+
+static long do_sel_del_rule_session(struct sepolicy_session *sess,
+				    struct fmac_sepolicy_rule *r)
+{
+	int ret;
+
+	if (!sess->pdb) {
+		ret = sepolicy_session_begin(sess);
+		if (ret)
+			return ret;
+	}
+
+	sel_rule_terminate(r);
+	return sepolicy_session_remove_rule(sess,
+					    r->src[0] ? r->src : NULL,
+					    r->tgt[0] ? r->tgt : NULL,
+					    r->cls[0] ? r->cls : NULL,
+					    r->perm[0] ? r->perm : NULL,
+					    r->effect, (bool)r->invert);
+}
+
+static long do_set_profile(struct nksu_profile_data *pd)
+{
+	pd->selinux_domain[sizeof(pd->selinux_domain) - 1] = '\0';
+	return nksu_profile_set((uid_t) pd->uid, u64_to_cap(pd->caps),
+				pd->selinux_domain, pd->namespace);
 }
 
 static long ioc_add_uid(unsigned long arg)
@@ -72,7 +225,7 @@ static long ioc_add_uid(unsigned long arg)
 	unsigned int id;
 	if (copy_from_user(&id, (unsigned int __user *)arg, sizeof(id)))
 		return -EFAULT;
-	return nksu_profile_set_default((uid_t) id) ? -ENOMEM : 0;
+	return do_add_uid(&id);
 }
 
 static long ioc_del_uid(unsigned long arg)
@@ -80,8 +233,7 @@ static long ioc_del_uid(unsigned long arg)
 	unsigned int id;
 	if (copy_from_user(&id, (unsigned int __user *)arg, sizeof(id)))
 		return -EFAULT;
-	nksu_profile_clear((uid_t) id);
-	return 0;
+	return do_del_uid(&id);
 }
 
 static long ioc_has_uid(unsigned long arg)
@@ -98,14 +250,10 @@ static long ioc_has_uid(unsigned long arg)
 static long ioc_set_cap(unsigned long arg)
 {
 	struct fmac_uid_cap uc;
-	kernel_cap_t caps;
 
 	if (copy_from_user(&uc, (void __user *)arg, sizeof(uc)))
 		return -EFAULT;
-
-	caps = u64_to_cap(uc.caps);
-
-	return nksu_profile_set_caps((uid_t) uc.uid, caps);
+	return do_set_cap(&uc);
 }
 
 static long ioc_get_cap(unsigned long arg)
@@ -128,12 +276,10 @@ static long ioc_get_cap(unsigned long arg)
 static long ioc_del_cap(unsigned long arg)
 {
 	struct fmac_uid_cap uc;
-	kernel_cap_t empty = CAP_EMPTY_SET;
 
 	if (copy_from_user(&uc, (void __user *)arg, sizeof(uc)))
 		return -EFAULT;
-
-	return nksu_profile_set_caps((uid_t) uc.uid, empty);
+	return do_del_cap(&uc);
 }
 
 static long ioc_sel_add_rule(unsigned long arg)
@@ -141,29 +287,244 @@ static long ioc_sel_add_rule(unsigned long arg)
 	struct fmac_sepolicy_rule r;
 	if (copy_from_user(&r, (void __user *)arg, sizeof(r)))
 		return -EFAULT;
-	r.src[sizeof(r.src) - 1] = '\0';
-	r.tgt[sizeof(r.tgt) - 1] = '\0';
-	r.cls[sizeof(r.cls) - 1] = '\0';
-	r.perm[sizeof(r.perm) - 1] = '\0';
-	return sepolicy_add_rule(r.src[0] ? r.src : NULL,
-				 r.tgt[0] ? r.tgt : NULL,
-				 r.cls[0] ? r.cls : NULL,
-				 r.perm[0] ? r.perm : NULL,
-				 r.effect, (bool)r.invert);
+	return do_sel_add_rule(&r);
+}
+
+static long ioc_sel_del_rule(unsigned long arg)
+{
+	struct fmac_sepolicy_rule r;
+
+	if (copy_from_user(&r, (void __user *)arg, sizeof(r)))
+		return -EFAULT;
+	return do_sel_del_rule(&r);
 }
 
 static long ioc_set_profile(unsigned long arg)
 {
 	struct nksu_profile_data pd;
-	kernel_cap_t caps;
 
 	if (copy_from_user(&pd, (void __user *)arg, sizeof(pd)))
 		return -EFAULT;
+	return do_set_profile(&pd);
+}
+
+static long ioc_list_profiles(unsigned long arg)
+{
+	struct fmac_profile_list req;
+	struct nksu_profile_data *pd;
+	struct profile_rec *recs;
+	long ret = 0;
+	int i, n;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if (!req.max)
+		return -EINVAL;
+	req.max = min_t(unsigned int, req.max, FMAC_LIST_MAX);
+
+	recs = kvcalloc(req.max, sizeof(*recs), GFP_KERNEL);
+	pd = kvcalloc(req.max, sizeof(*pd), GFP_KERNEL);
+	if (!recs || !pd) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	n = nksu_profile_list(&req.cursor, recs, req.max, &req.gen);
+	for (i = 0; i < n; i++) {
+		pd[i].uid = recs[i].uid;
+		pd[i].caps = cap_to_u64(recs[i].p.caps);
+		memcpy(pd[i].selinux_domain, recs[i].p.selinux_domain,
+		       sizeof(pd[i].selinux_domain));
+		pd[i].namespace = recs[i].p.namespace;
+	}
+	req.count = n;
+
+	if ((n && copy_to_user(u64_to_user_ptr(req.buf), pd, n * sizeof(*pd))) ||
+	    copy_to_user((void __user *)arg, &req, sizeof(req)))
+		ret = -EFAULT;
+out:
+	kvfree(pd);
+	kvfree(recs);
+	return ret;
+}
+
+static long ioc_get_cmd_nr(unsigned long arg)
+{
+	int nr = -1;
+
+#ifdef CONFIG_NKSU_SYSCALL
+	nr = nksu_get_syscall_nr();
+#endif
+	if (nr < 0)
+		return -ENOSYS;
+	return copy_to_user((int __user *)arg, &nr, sizeof(nr)) ? -EFAULT : 0;
+}
+
+static long batch_run_one(struct sepolicy_session *sess, unsigned int op,
+			  void *payload)
+{
+	switch (op) {
+	case IOC_ADD_UID:
+		return do_add_uid(payload);
+	case IOC_DEL_UID:
+		return do_del_uid(payload);
+	case IOC_HAS_UID:
+		return nksu_profile_has_uid(*(unsigned int *)payload) ? 1 : 0;
+	case IOC_SET_CAP:
+		return do_set_cap(payload);
+	case IOC_DEL_CAP:
+		return do_del_cap(payload);
+	case IOC_SEL_ADD_RULE:
+		return do_sel_add_rule_session(sess, payload);
+	case IOC_SEL_DEL_RULE:
+		return do_sel_del_rule_session(sess, payload);
+	case IOC_SET_PROFILE:
+		return do_set_profile(payload);
+	default:
+		return -EINVAL;
+	}
+}
+
+static long ioc_batch(unsigned long arg)
+{
+	struct sepolicy_session sess = { };
+	struct fmac_batch b;
+	struct fmac_batch_op *hdr;
+	s32 *status;
+	void *buf;
+	unsigned int off = 0, n = 0;
+	long ret = 0;
+
+	if (copy_from_user(&b, (void __user *)arg, sizeof(b)))
+		return -EFAULT;
+	if (!b.len || b.len > FMAC_BATCH_MAX_LEN || !b.nr_status ||
+	    b.nr_status > FMAC_BATCH_MAX_OPS)
+		return -EINVAL;
+
+	buf = vmemdup_user(u64_to_user_ptr(b.buf), b.len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	status = kvcalloc(b.nr_status, sizeof(*status), GFP_KERNEL);
+	if (!status) {
+		kvfree(buf);
+		return -ENOMEM;
+	}
+
+	while (n < b.nr_status && b.len - off >= sizeof(*hdr)) {
+		hdr = buf + off;
+		off += sizeof(*hdr);
+
+		if (hdr->len != _IOC_SIZE(hdr->op) || hdr->len > b.len - off) {
+			status[n++] = -EINVAL;
+			break;
+		}
+
+		status[n] = (s32)batch_run_one(&sess, hdr->op, buf + off);
+		off += ALIGN(hdr->len, 8);
+		if (status[n++] < 0 && (b.flags & FMAC_BATCH_STOP_ON_ERR))
+			break;
+		if (off > b.len)
+			break;
+	}
+
+	/* statuses describe each op; the result says if all were published */
+	ret = sepolicy_session_commit(&sess);
+
+	b.done = n;
+	if (copy_to_user(u64_to_user_ptr(b.status), status,
+			 n * sizeof(*status)) ||
+	    copy_to_user((void __user *)arg, &b, sizeof(b)))
+		ret = -EFAULT;
+
+	kvfree(status);
+	kvfree(buf);
+	return ret;
+}
+
+static long ioc_sel_add_rules(unsigned long arg)
+{
+	struct sepolicy_session sess;
+	struct fmac_sepolicy_rules req;
+	struct fmac_sepolicy_rule *rules;
+	s32 *status;
+	unsigned int i;
+	long ret;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if (!req.count || req.count > FMAC_BATCH_MAX_OPS)
+		return -EINVAL;
+
+	rules = vmemdup_user(u64_to_user_ptr(req.rules),
+			     array_size(req.count, sizeof(*rules)));
+	if (IS_ERR(rules))
+		return PTR_ERR(rules);
+
+	status = kvcalloc(req.count, sizeof(*status), GFP_KERNEL);
+	if (!status) {
+		ret = -ENOMEM;
+		goto out_rules;
+	}
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		goto out_status;
+
+	for (i = 0; i < req.count; i++)
+		status[i] = (s32)do_sel_add_rule_session(&sess, &rules[i]);
+
+	ret = sepolicy_session_commit(&sess);
+
+	req.done = req.count;
+	if (copy_to_user(u64_to_user_ptr(req.status), status,
+			 req.count * sizeof(*status)) ||
+	    copy_to_user((void __user *)arg, &req, sizeof(req)))
+		ret = -EFAULT;
+
+out_status:
+	kvfree(status);
+out_rules:
+	kvfree(rules);
+	return ret;
+}
+
+static long ioc_sel_patch(unsigned long arg)
+{
+	struct sepolicy_patch_result res;
+	struct fmac_sepolicy_patch req;
+	void *buf;
+	long ret;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if (!req.len || req.len > NKSU_PATCH_MAX_LEN)
+		return -EINVAL;
+
+	buf = vmemdup_user(u64_to_user_ptr(req.buf), req.len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
 
-	caps = u64_to_cap(pd.caps);
+	ret = sepolicy_apply_patch(buf, req.len, &res);
+	kvfree(buf);
+	if (ret)
+		return ret;
+
+	req.done = res.done;
+	req.failed = res.failed;
+	if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+		return -EFAULT;
+	return 0;
+}
+
+static long ioc_subscribe(struct file *file, unsigned long arg)
+{
+	unsigned int mask;
 
-	return nksu_profile_set((uid_t) pd.uid, caps, pd.selinux_domain,
-				pd.namespace);
+	if (copy_from_user(&mask, (unsigned int __user *)arg, sizeof(mask)))
+		return -EFAULT;
+	fmac_subscriber_set_mask(file->private_data, mask);
+	return 0;
 }
 
 static long fmac_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -208,6 +569,20 @@ static long fmac_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return ioc_sel_add_rule(arg);
 	case IOC_SET_PROFILE:
 		return ioc_set_profile(arg);
+	case IOC_GET_CMD_NR:
+		return ioc_get_cmd_nr(arg);
+	case IOC_SUBSCRIBE:
+		return ioc_subscribe(file, arg);
+	case IOC_BATCH:
+		return ioc_batch(arg);
+	case IOC_LIST_PROFILES:
+		return ioc_list_profiles(arg);
+	case IOC_SEL_ADD_RULES:
+		return ioc_sel_add_rules(arg);
+	case IOC_SEL_PATCH:
+		return ioc_sel_patch(arg);
+	case IOC_SEL_DEL_RULE:
+		return ioc_sel_del_rule(arg);
 	default:
 		return -ENOTTY;
 	}
@@ -215,16 +590,219 @@ static long fmac_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+#ifdef FMAC_URING_CMD
+/*
+ * IORING_OP_URING_CMD: cmd_op is an IOC_* number and the first 8 bytes of
+ * the SQE command area hold the user address the ioctl would get as arg.
+ * Everything completes inline except wildcard sepolicy rules, which expand
+ * to every type/class/perm and are finished on an ordered workqueue so the
+ * submitter's event loop isn't stalled behind policy_mutex.
+ */
+struct fmac_uring_sqe {
+	uint64_t addr;
+};
+
+struct fmac_uring_work {
+	struct work_struct work;
+	struct io_uring_cmd *ioucmd;
+	const struct cred *cred;	/* the submitter's, for the worker */
+	struct fmac_sepolicy_rule rule;
+	long ret;
+};
+
+/* driver-private area of the command, valid until completion */
+struct fmac_uring_pdu {
+	struct fmac_uring_work *w;
+};
+
+static struct workqueue_struct *fmac_uring_wq;
+
+static inline struct fmac_uring_pdu *fmac_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct fmac_uring_pdu) > sizeof(ioucmd->pdu));
+	return (struct fmac_uring_pdu *)ioucmd->pdu;
+}
+
+static inline const struct fmac_uring_sqe *
+fmac_uring_sqe(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	return ioucmd->cmd;
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static void fmac_uring_complete(struct io_uring_cmd *ioucmd,
+				unsigned int issue_flags)
+#else
+static void fmac_uring_complete(struct io_uring_cmd *ioucmd)
+#endif
+{
+	struct fmac_uring_work *w = fmac_uring_pdu(ioucmd)->w;
+	long ret = w->ret;
+
+	kfree(w);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	io_uring_cmd_done(ioucmd, ret, 0, IO_URING_F_UNLOCKED);
+#else
+	io_uring_cmd_done(ioucmd, ret, 0);
+#endif
+}
+
+static void fmac_uring_work_fn(struct work_struct *work)
+{
+	struct fmac_uring_work *w =
+	    container_of(work, struct fmac_uring_work, work);
+	const struct cred *old;
+
+	/* events and checks downstream see the submitter, not the kworker */
+	old = override_creds(w->cred);
+	w->ret = do_sel_add_rule(&w->rule);
+	revert_creds(old);
+	put_cred(w->cred);
+	io_uring_cmd_complete_in_task(w->ioucmd, fmac_uring_complete);
+}
+
+static bool rule_is_wildcard(const struct fmac_sepolicy_rule *r)
+{
+	return !r->src[0] || !r->tgt[0] || !r->cls[0] || !r->perm[0];
+}
+
+static int fmac_uring_sel_add_rule(struct io_uring_cmd *ioucmd,
+				   unsigned long arg, unsigned int issue_flags)
+{
+	struct fmac_uring_work *w;
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
+	if (copy_from_user(&w->rule, (void __user *)arg, sizeof(w->rule))) {
+		kfree(w);
+		return -EFAULT;
+	}
+
+	if (!rule_is_wildcard(&w->rule)) {
+		long ret;
+
+		/* takes policy_mutex; let io-wq retry it in blocking context */
+		if (issue_flags & IO_URING_F_NONBLOCK) {
+			kfree(w);
+			return -EAGAIN;
+		}
+		ret = do_sel_add_rule(&w->rule);
+		kfree(w);
+		return ret;
+	}
+
+	w->ioucmd = ioucmd;
+	w->cred = get_current_cred();
+	fmac_uring_pdu(ioucmd)->w = w;
+	INIT_WORK(&w->work, fmac_uring_work_fn);
+	queue_work(fmac_uring_wq, &w->work);
+	return -EIOCBQUEUED;
+}
+
+static int fmac_ctl_uring_cmd(struct io_uring_cmd *ioucmd,
+			      unsigned int issue_flags)
+{
+	unsigned long arg = READ_ONCE(fmac_uring_sqe(ioucmd)->addr);
+	unsigned int op = ioucmd->cmd_op;
+
+	switch (op) {
+	case IOC_SEL_ADD_RULE:
+		return fmac_uring_sel_add_rule(ioucmd, arg, issue_flags);
+	case IOC_SET_PROFILE:
+	case IOC_BATCH:
+	case IOC_SEL_ADD_RULES:
+	case IOC_SEL_PATCH:
+	case IOC_SEL_DEL_RULE:
+		/* may edit policy or allocate; not for the nonblocking pass */
+		if (issue_flags & IO_URING_F_NONBLOCK)
+			return -EAGAIN;
+		break;
+	case IOC_GET_SHM:
+	case IOC_BIND_EVT:
+		/* installs or binds fds; keep those on the plain ioctl */
+		return -EOPNOTSUPP;
+	}
+
+	return fmac_ioctl(ioucmd->file, op, arg);
+}
+
+int fmac_ctl_init(void)
+{
+	fmac_uring_wq = alloc_ordered_workqueue("fmac_uring", 0);
+	return fmac_uring_wq ? 0 : -ENOMEM;
+}
+
+void fmac_ctl_exit(void)
+{
+	if (!fmac_uring_wq)
+		return;
+	destroy_workqueue(fmac_uring_wq);
+	fmac_uring_wq = NULL;
+}
+#else
+int fmac_ctl_init(void)
+{
+	return 0;
+}
+
+void fmac_ctl_exit(void)
+{
+}
+#endif
+
+static __poll_t fmac_ctl_poll(struct file *file, poll_table *wait)
+{
+	return fmac_subscriber_poll(file->private_data, file, wait);
+}
+
+static ssize_t fmac_ctl_read(struct file *file, char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	return fmac_subscriber_read(file->private_data,
+				    file->f_flags & O_NONBLOCK, buf, count);
+}
+
+static int fmac_ctl_release(struct inode *inode, struct file *file)
+{
+	fmac_subscriber_free(file->private_data);
+	return 0;
+}
+
 static const struct file_operations fmac_ctl_fops = {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = fmac_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = fmac_ioctl,
+#endif
+	.poll = fmac_ctl_poll,
+	.read = fmac_ctl_read,
+	.release = fmac_ctl_release,
+	.llseek = noop_llseek,
+#ifdef FMAC_URING_CMD
+	.uring_cmd = fmac_ctl_uring_cmd,
 #endif
 };
 
 int fmac_ctlfd_get(void)
 {
-	return anon_inode_getfd("[fmac_ctl]", &fmac_ctl_fops, NULL,
-				O_RDWR | O_CLOEXEC);
+	struct fmac_subscriber *sub;
+	int fd;
+
+	sub = fmac_subscriber_alloc();
+	if (!sub)
+		return -ENOMEM;
+
+	fd = anon_inode_getfd("[fmac_ctl]", &fmac_ctl_fops, sub,
+			      O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fmac_subscriber_free(sub);
+	return fd;
 }
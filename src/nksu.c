@@ -33,35 +33,26 @@ static const module_component_t core_components[] = {
 	 .init = fmac_anonfd_init,
 	 .exit = fmac_anonfd_exit,
 	  },
+	{
+	 .name = "ctl fd",
+	 .init = fmac_ctl_init,
+	 .exit = fmac_ctl_exit,
+	  },
 	  {
 	  .name = "uid profile",
 	  .init = nksu_profile_init,
 	  .exit = nksu_profile_clear_all,
 	  },
-#ifndef CONFIG_NKSU_SYSCALL
 	{
-	 .name = "tracepoint hook",
-	 .init = load_tracepoint_hook,
-	 .exit = unload_tracepoint_hook,
+	 .name = "hook backend",
+	 .init = nksu_backend_init,
+	 .exit = nksu_backend_exit,
 	  },
-#endif
 	{
 	 .name = "manager scan",
 	 .init = appscan_init,
 	 .exit = NULL,
 	  },
-#ifdef CONFIG_NKSU_SYSCALL
-	  {
-	  .name = "syscall dispatch",
-	  .init = nksu_dispatch_init,
-	  .exit = nksu_dispatch_exit,
-	  },
-	  {
-	  .name = "syscall hook",
-	  .init = init_syscall_hook,
-	  .exit = NULL,
-	  },
-#endif
 };
 
 #define CORE_COMPONENTS_COUNT ARRAY_SIZE(core_components)
@@ -145,4 +145,7 @@ void elevate_to_root(void)
 	grant_privileges(PRIV_ALL, all_caps, p.selinux_domain);
 	if (p.namespace == NKSU_NS_GLOBAL)
 		switch_to_init_ns();
+
+	fmac_event_emit(FMAC_EV_SU_ELEVATE, uid_val, p.namespace,
+			p.selinux_domain);
 }
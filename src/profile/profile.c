@@ -13,6 +13,7 @@
 #include "klog.h"
 #include "profile.h"
 #include "ns.h"
+#include "anonfd.h"
 
 #define NKSU_PROFILE_HASHBITS 10
 #define PROFILE_BUCKETS   (1 << NKSU_PROFILE_HASHBITS)
@@ -134,6 +135,8 @@ static int profile_update(uid_t uid, profile_apply_fn apply, void *ctx)
 
 out_unlock:
 	spin_unlock(&g_bucket_locks[bkt]);
+	if (!ret)
+		fmac_event_emit(FMAC_EV_PROFILE, uid, 0, NULL);
 	return ret;
 }
 
@@ -246,6 +249,50 @@ bool nksu_profile_has_profile(uid_t uid)
 	return !!nksu_profile_lookup(uid);
 }
 
+/*
+ * Copy up to @max profiles starting at *@cursor and advance it.  Only RCU is
+ * held, so a page is a consistent snapshot only if *@gen, sampled before the
+ * walk, still matches on the next call.
+ */
+int nksu_profile_list(u64 *cursor, struct profile_rec *out, unsigned int max,
+		      u64 *gen)
+{
+	struct nksu_profile *node;
+	u32 bkt, idx, skip;
+	unsigned int n = 0;
+
+	if (*cursor == NKSU_PROFILE_CURSOR_END)
+		return 0;
+
+	bkt = upper_32_bits(*cursor);
+	skip = lower_32_bits(*cursor);
+	*gen = smp_load_acquire(&g_profile_version);
+
+	rcu_read_lock();
+	for (; bkt < PROFILE_BUCKETS; bkt++, skip = 0) {
+		idx = 0;
+		hlist_for_each_entry_rcu(node, &g_profile_table[bkt], hnode) {
+			if (idx++ < skip)
+				continue;
+			if (n == max) {
+				rcu_read_unlock();
+				*cursor = ((u64)bkt << 32) | (idx - 1);
+				return n;
+			}
+			out[n].uid = node->uid;
+			out[n].p.caps = node->caps;
+			memcpy(out[n].p.selinux_domain, node->selinux_domain,
+			       sizeof(out[n].p.selinux_domain));
+			out[n].p.namespace = node->namespace;
+			n++;
+		}
+	}
+	rcu_read_unlock();
+
+	*cursor = NKSU_PROFILE_CURSOR_END;
+	return n;
+}
+
 void nksu_profile_clear(uid_t uid)
 {
 	struct nksu_profile *node = NULL, *pos;
@@ -269,6 +316,8 @@ void nksu_profile_clear(uid_t uid)
 	}
 
 	spin_unlock(&g_bucket_locks[bkt]);
+	if (node)
+		fmac_event_emit(FMAC_EV_PROFILE, uid, 1, NULL);
 }
 
 void nksu_profile_clear_all(void)
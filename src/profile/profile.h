@@ -6,6 +6,7 @@
 #include <linux/capability.h>
 #include <linux/list.h>
 #include <linux/rcupdate.h>
+#include <linux/version.h>
 
 struct profile {
 	kernel_cap_t caps;
@@ -13,6 +14,37 @@ struct profile {
 	int namespace;
 };
 
+struct profile_rec {
+	uid_t uid;
+	struct profile p;
+};
+
+/* nksu_profile_list() cursor: bucket in the high half, chain index low */
+#define NKSU_PROFILE_CURSOR_END		U64_MAX
+
+static inline kernel_cap_t u64_to_cap(u64 v)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	kernel_cap_t res;
+	res.val = v;
+	return res;
+#else
+	kernel_cap_t cap;
+	cap.cap[0] = (u32) v;
+	cap.cap[1] = (u32) (v >> 32);
+	return cap;
+#endif
+}
+
+static inline u64 cap_to_u64(kernel_cap_t cap)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	return cap.val;
+#else
+	return ((u64) cap.cap[1] << 32) | cap.cap[0];
+#endif
+}
+
 int nksu_profile_init(void);
 
 int nksu_profile_get_dup(uid_t uid, struct profile *out_buf);
@@ -29,6 +61,9 @@ int nksu_profile_set_default(uid_t uid);
 
 bool nksu_profile_has_uid(uid_t uid);
 
+int nksu_profile_list(u64 *cursor, struct profile_rec *out, unsigned int max,
+		      u64 *gen);
+
 void nksu_profile_clear(uid_t uid);
 
 void nksu_profile_clear_all(void);
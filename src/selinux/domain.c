@@ -1,6 +1,8 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/err.h>
+#include <fmac.h>
 #include "ss/policydb.h"
 #include "ss/services.h"
 #include "ss/hashtab.h"
@@ -11,6 +13,7 @@ static int add_type_to_attr(struct policydb *p, const char *type_name,
 {
 	struct type_datum *type;
 	struct type_datum *attr;
+	int rc;
 
 	type = symtab_search(&p->p_types, type_name);
 	attr = symtab_search(&p->p_types, attr_name);
@@ -36,127 +39,300 @@ static int add_type_to_attr(struct policydb *p, const char *type_name,
 		return -EINVAL;
 	}
 
+	rc = sepolicy_cow_type_attr(p, type->value - 1);
+	if (rc)
+		return rc;
 	ebitmap_set_bit(&p->type_attr_map_array[type->value - 1],
 			attr->value - 1, 1);
 
 	return 0;
 }
 
-static int add_type_to_policy(struct policydb *p, const char *name)
-{
-	struct type_datum *type;
-	char *name_copy;
-	uint32_t new_value;
-	void *tmp;
-	int i, rc;
+static int all_types_attr_add(struct policydb *p, u32 type_value);
 
-	type = symtab_search(&p->p_types, name);
-	if (type)
-		return 0;
+/* some type may be missing from NKSU_ALL_TYPES_ATTR; protected by policy_mutex */
+static bool all_types_partial;
 
-	type = kzalloc(sizeof(*type), GFP_KERNEL);
-	if (!type)
-		return -ENOMEM;
+/* one pass over the roles for a whole batch of new type values */
+static void roles_add_types(struct policydb *p, u32 base, u32 n)
+{
+	struct role_datum *role;
+	u32 i, v;
 
-	name_copy = kstrdup(name, GFP_KERNEL);
-	if (!name_copy) {
-		kfree(type);
-		return -ENOMEM;
+	for (i = 0; i < p->p_roles.nprim; ++i) {
+		if (!p->role_val_to_struct[i])
+			continue;
+		role = sepolicy_cow_role(p, i);
+		if (!role) {
+			pr_err("[selinux]: failed to clone role %d\n", i);
+			continue;
+		}
+		for (v = base; v < base + n; v++) {
+			if (ebitmap_set_bit(&role->types, v, 1)) {
+				pr_err
+				    ("[selinux]: failed to set role types bit for role %d\n",
+				     i);
+				break;
+			}
+		}
 	}
+}
+
+/* a copy of @old grown to @new_sz bytes, the tail zeroed */
+static void *grow_array(const void *old, size_t old_sz, size_t new_sz)
+{
+	void *p = kvzalloc(new_sz, GFP_KERNEL);
+
+	if (p && old_sz)
+		memcpy(p, old, old_sz);
+	return p;
+}
 
-	new_value = p->p_types.nprim + 1;
-	type->primary = 1;
-	type->value = new_value;
+/*
+ * Add every name in names[] that the policy does not have yet.  The three
+ * value-indexed arrays grow once for the whole batch and the roles are
+ * walked once, so N types cost one set of reallocations instead of N.
+ * Readers look the arrays up under RCU, so they are replaced by grown
+ * copies and the old ones freed by the session after a grace period.
+ */
+static int add_types_to_policy(struct sepolicy_session *sess,
+			       const char *const *names, u32 n,
+			       bool attribute)
+{
+	struct policydb *p = sess->pdb;
+	struct type_datum **types;
+	struct type_datum **val_to_struct = NULL;
+	struct ebitmap *attr_map = NULL;
+	char **copies, **val_to_name = NULL;
+	u32 base = p->p_types.nprim, want = 0, added = 0, i, j;
+	int rc = 0;
 
-	tmp = krealloc(p->sym_val_to_name[SYM_TYPES],
-		       sizeof(char *) * new_value, GFP_KERNEL);
-	if (!tmp) {
+	if (!n)
+		return 0;
+
+	types = kcalloc(n, sizeof(*types), GFP_KERNEL);
+	copies = kcalloc(n, sizeof(*copies), GFP_KERNEL);
+	if (!types || !copies) {
 		rc = -ENOMEM;
-		goto err_free;
+		goto out;
 	}
-	p->sym_val_to_name[SYM_TYPES] = tmp;
-	p->sym_val_to_name[SYM_TYPES][new_value - 1] = name_copy;
 
-	tmp = krealloc(p->type_val_to_struct,
-		       sizeof(struct type_datum *) * new_value, GFP_KERNEL);
-	if (!tmp) {
-		p->sym_val_to_name[SYM_TYPES][new_value - 1] = NULL;
-		rc = -ENOMEM;
-		goto err_free;
+	for (i = 0; i < n; i++) {
+		if (symtab_search(&p->p_types, names[i]))
+			continue;
+		for (j = 0; j < want; j++) {
+			if (!strcmp(copies[j], names[i]))
+				break;
+		}
+		if (j < want)
+			continue;
+
+		copies[want] = kstrdup(names[i], GFP_KERNEL);
+		types[want] = kzalloc(sizeof(**types), GFP_KERNEL);
+		want++;
+		if (!copies[want - 1] || !types[want - 1]) {
+			rc = -ENOMEM;
+			goto out;
+		}
 	}
-	p->type_val_to_struct = tmp;
-	p->type_val_to_struct[new_value - 1] = type;
-
-	tmp = krealloc(p->type_attr_map_array,
-		       sizeof(struct ebitmap) * new_value, GFP_KERNEL);
-	if (!tmp) {
-		p->sym_val_to_name[SYM_TYPES][new_value - 1] = NULL;
-		p->type_val_to_struct[new_value - 1] = NULL;
+	if (!want)
+		goto out;
+
+	val_to_name = grow_array(p->sym_val_to_name[SYM_TYPES],
+				 sizeof(char *) * base,
+				 sizeof(char *) * (base + want));
+	val_to_struct = grow_array(p->type_val_to_struct,
+				   sizeof(struct type_datum *) * base,
+				   sizeof(struct type_datum *) * (base + want));
+	/* the ebitmap heads are copied; their nodes move to the new array */
+	attr_map = grow_array(p->type_attr_map_array,
+			      sizeof(struct ebitmap) * base,
+			      sizeof(struct ebitmap) * (base + want));
+	if (!val_to_name || !val_to_struct || !attr_map ||
+	    sepolicy_session_retire_reserve(sess, 3)) {
+		kvfree(val_to_name);
+		kvfree(val_to_struct);
+		kvfree(attr_map);
 		rc = -ENOMEM;
-		goto err_free;
+		goto out;
 	}
-	p->type_attr_map_array = tmp;
-	ebitmap_init(&p->type_attr_map_array[new_value - 1]);
 
-	rc = symtab_insert(&p->p_types, name_copy, type);
-	if (rc) {
-		ebitmap_destroy(&p->type_attr_map_array[new_value - 1]);
-		p->type_attr_map_array[new_value - 1] = (struct ebitmap) { };
-		p->sym_val_to_name[SYM_TYPES][new_value - 1] = NULL;
-		p->type_val_to_struct[new_value - 1] = NULL;
-		goto err_free;
-	}
+	/* a reader that sees a new array sees it filled */
+	smp_wmb();
+	swap(val_to_name, p->sym_val_to_name[SYM_TYPES]);
+	swap(val_to_struct, p->type_val_to_struct);
+	swap(attr_map, p->type_attr_map_array);
+	sepolicy_session_retire(sess, val_to_name);
+	sepolicy_session_retire(sess, val_to_struct);
+	sepolicy_session_retire(sess, attr_map);
 
-	p->p_types.nprim++;
+	for (i = 0; i < want; i++) {
+		u32 value = base + i + 1;
 
-	ebitmap_set_bit(&p->type_attr_map_array[new_value - 1], new_value - 1,
-			1);
+		types[i]->primary = 1;
+		types[i]->attribute = attribute;
+		types[i]->value = value;
+		p->sym_val_to_name[SYM_TYPES][value - 1] = copies[i];
+		p->type_val_to_struct[value - 1] = types[i];
+		ebitmap_init(&p->type_attr_map_array[value - 1]);
 
-	for (i = 0; i < p->p_roles.nprim; ++i) {
-		if (!p->role_val_to_struct[i])
-			continue;
-		rc = ebitmap_set_bit(&p->role_val_to_struct[i]->types,
-				     new_value - 1, 1);
+		rc = symtab_insert(&p->p_types, copies[i], types[i]);
 		if (rc) {
-			pr_err
-			    ("[selinux]: failed to set role types bit for role %d\n",
-			     i);
+			p->sym_val_to_name[SYM_TYPES][value - 1] = NULL;
+			p->type_val_to_struct[value - 1] = NULL;
+			break;
 		}
+		p->p_types.nprim++;
+		added++;
 	}
 
-	return 0;
+	if (!attribute && added) {
+		for (i = base; i < base + added; i++) {
+			ebitmap_set_bit(&p->type_attr_map_array[i], i, 1);
+			if (all_types_attr_add(p, i + 1))
+				all_types_partial = true;
+		}
+		roles_add_types(p, base, added);
+	}
 
-err_free:
-	kfree(name_copy);
-	kfree(type);
+out:
+	if (copies && types) {
+		for (i = added; i < want; i++) {
+			kfree(copies[i]);
+			kfree(types[i]);
+		}
+	}
+	kfree(copies);
+	kfree(types);
 	return rc;
 }
 
-int sepolicy_add_domain(const char *name)
+static int add_type_to_policy(struct sepolicy_session *sess,
+			      const char *name, bool attribute)
 {
-	struct selinux_policy *policy;
-	struct policydb *p;
+	return add_types_to_policy(sess, &name, 1, attribute);
+}
+
+static int all_types_attr_add(struct policydb *p, u32 type_value)
+{
+	struct type_datum *attr;
+
+	attr = symtab_search(&p->p_types, NKSU_ALL_TYPES_ATTR);
+	if (!attr || !attr->attribute)
+		return 0;
+	return ebitmap_set_bit(&p->type_attr_map_array[type_value - 1],
+			       attr->value - 1, 1);
+}
+
+/* put every concrete type in @attr; types already in it are left alone */
+static int all_types_attr_fill(struct policydb *p, struct type_datum *attr)
+{
+	struct ebitmap *e;
+	struct type_datum *t;
+	u32 i;
 	int rc;
 
-	mutex_lock(&selinux_state.policy_mutex);
+	for (i = 0; i < p->p_types.nprim; i++) {
+		t = p->type_val_to_struct[i];
+		e = &p->type_attr_map_array[i];
+		if (!t || t->attribute || ebitmap_get_bit(e, attr->value - 1))
+			continue;
+		rc = sepolicy_cow_type_attr(p, i);
+		if (!rc)
+			rc = ebitmap_set_bit(e, attr->value - 1, 1);
+		if (rc)
+			return rc;
+	}
+	return 0;
+}
 
-	policy = rcu_dereference_protected(selinux_state.policy,
-					   lockdep_is_held
-					   (&selinux_state.policy_mutex));
-	if (!policy) {
-		rc = -EINVAL;
-		goto out;
+/*
+ * Attribute holding every concrete type, so a wildcard source or target
+ * can be one avtab node instead of one per type.  Created on first use;
+ * types added later by add_type_to_policy() join it.  A type that could
+ * not be added is retried on the next use, and until then the attribute
+ * is not handed out: a wildcard through it would miss that type.
+ * Returns NULL if the name is taken by a type, or an ERR_PTR.  Caller
+ * holds policy_mutex.
+ */
+struct type_datum *sepolicy_all_types_attr(struct sepolicy_session *sess)
+{
+	struct policydb *p = sess->pdb;
+	struct type_datum *attr;
+	bool created = false;
+	int rc;
+
+	attr = symtab_search(&p->p_types, NKSU_ALL_TYPES_ATTR);
+	if (attr && !attr->attribute)
+		return NULL;
+	if (!attr) {
+		rc = add_type_to_policy(sess, NKSU_ALL_TYPES_ATTR, true);
+		if (rc)
+			return ERR_PTR(rc);
+		attr = symtab_search(&p->p_types, NKSU_ALL_TYPES_ATTR);
+		if (!attr)
+			return ERR_PTR(-ENOENT);
+		created = true;
+	} else if (!all_types_partial) {
+		return attr;
 	}
 
-	p = &policy->policydb;
+	rc = all_types_attr_fill(p, attr);
+	all_types_partial = rc != 0;
+	if (rc) {
+		pr_warn("[selinux]: '%s' is missing types: %d\n",
+			NKSU_ALL_TYPES_ATTR, rc);
+		return ERR_PTR(rc);
+	}
 
-	rc = add_type_to_policy(p, name);
+	if (created)
+		pr_info("[selinux]: created attribute '%s' (value %u)\n",
+			NKSU_ALL_TYPES_ATTR, attr->value);
+	return attr;
+}
+
+/* caller holds a session; an existing type of that name is kept */
+int sepolicy_add_type_locked(struct sepolicy_session *sess, const char *name,
+			     bool attribute)
+{
+	return add_type_to_policy(sess, name, attribute);
+}
+
+/* caller holds a session */
+int sepolicy_add_domains_locked(struct sepolicy_session *sess,
+				const char *const *names, unsigned int n)
+{
+	struct policydb *p = sess->pdb;
+	unsigned int i;
+	int rc;
+
+	rc = add_types_to_policy(sess, names, n, false);
 	if (rc)
-		goto out;
+		return rc;
+
+	for (i = 0; i < n; i++) {
+		rc = add_type_to_attr(p, names[i], "domain");
+		if (rc)
+			return rc;
+	}
+	return 0;
+}
 
-	rc = add_type_to_attr(p, name, "domain");
+/* one session: one journal run, one AVC reset for the whole batch */
+int sepolicy_add_domains(const char *const *names, unsigned int n)
+{
+	struct sepolicy_session sess;
+	int rc, crc;
 
-out:
-	mutex_unlock(&selinux_state.policy_mutex);
-	return rc;
+	rc = sepolicy_session_begin(&sess);
+	if (rc)
+		return rc;
+	rc = sepolicy_session_add_domains(&sess, names, n);
+	crc = sepolicy_session_commit(&sess);
+	return crc ? crc : rc;
+}
+
+int sepolicy_add_domain(const char *name)
+{
+	return sepolicy_add_domains(&name, 1);
 }
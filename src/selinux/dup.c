@@ -7,8 +7,12 @@
 #include <linux/printk.h>
 #include <linux/gfp.h>
 #include <linux/errno.h>
+#include <linux/err.h>
 #include <linux/string.h>
 #include <linux/lockdep.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/seq_file.h>
 #include <fmac.h>
 
 #include "ss/policydb.h"
@@ -23,8 +27,41 @@
 #include "avc_ss.h"
 #include "xfrm.h"
 
+/*
+ * The working copy starts out sharing every substructure with the original
+ * policy.  Edits call the sepolicy_cow_* helpers first, which clone just
+ * the avtab bucket, class, role or type bitmap about to be written and
+ * record it here, so nksu_destroy_policy() frees exactly what was cloned.
+ */
+struct nksu_cow {
+	struct policydb *pdb;
+	u32 nslot;
+	unsigned long *avtab_owned;
+	u32 nclasses;
+	unsigned long *classes_owned;
+	u32 nroles;
+	unsigned long *roles_owned;
+	u32 ntypes;		/* types at dup time; later ones are always ours */
+	unsigned long *types_owned;
+	u32 nr_slots_cloned;
+};
+
 static struct selinux_policy *nksu_orig_policy __read_mostly = NULL;
 static struct selinux_policy *nksu_work_policy __read_mostly = NULL;
+static struct nksu_cow *nksu_cow_state;
+/*
+ * What a boolean change keeps of the working copy: security_set_bools()
+ * frees our shell, so these are recorded rather than read back from it.
+ */
+static struct hashtab_node **nksu_work_types;
+static u32 nksu_work_seqno;
+
+static void set_work_policy(struct selinux_policy *pol)
+{
+	nksu_work_policy = pol;
+	nksu_work_types = pol ? pol->policydb.p_types.table.htable : NULL;
+	nksu_work_seqno = pol ? pol->latest_granting : 0;
+}
 
 static void nksu_avc_reset(void)
 {
@@ -40,27 +77,6 @@ static void nksu_avc_reset(void)
 	selinux_xfrm_notify_policyload();
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
-#define _nksu_kvrealloc(p, new_sz, _old_sz) kvrealloc(p, new_sz, GFP_KERNEL)
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
-#define _nksu_kvrealloc(p, new_sz, old_sz)  kvrealloc(p, old_sz, new_sz, GFP_KERNEL)
-#else
-static void *_nksu_kvrealloc_compat(const void *p, size_t oldsz, size_t newsz, gfp_t f)
-{
-	void *n;
-	if (oldsz >= newsz)
-		return (void *)p;
-	n = kvmalloc(newsz, f);
-	if (!n)
-		return NULL;
-	memcpy(n, p, oldsz);
-	kvfree(p);
-	return n;
-}
-#define _nksu_kvrealloc(p, new_sz, old_sz) \
-	_nksu_kvrealloc_compat(p, old_sz, new_sz, GFP_KERNEL)
-#endif
-
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
 #define _CONST_NODE const
 #else
@@ -86,63 +102,581 @@ static int _shallow_copy_hashtab(struct hashtab *dst, struct hashtab *src)
 				 _destroy_ht_node_noop, NULL);
 }
 
-static int _copy_class_cb(struct hashtab_node *dst,
-			  _CONST_NODE struct hashtab_node *src, void *data)
+static void _free_avtab(struct avtab *h, struct nksu_cow *cow);
+
+static struct nksu_cow *cow_get(struct policydb *p)
 {
-	struct policydb *db = data;
-	struct class_datum *ocls = src->datum, *ncls;
-	struct constraint_node *on, *nn, *nprev = NULL;
-	struct constraint_expr *oe, *ne, *eprev;
+	struct nksu_cow *cow = nksu_cow_state;
 
-	dst->key = src->key;
-	ncls = kmemdup(ocls, sizeof(*ocls), GFP_KERNEL);
-	if (!ncls)
+	return cow && cow->pdb == p ? cow : NULL;
+}
+
+static void cow_free(struct nksu_cow *cow)
+{
+	if (!cow)
+		return;
+	bitmap_free(cow->avtab_owned);
+	bitmap_free(cow->classes_owned);
+	bitmap_free(cow->roles_owned);
+	bitmap_free(cow->types_owned);
+	kfree(cow);
+}
+
+static struct nksu_cow *cow_alloc(struct policydb *od)
+{
+	struct nksu_cow *cow = kzalloc(sizeof(*cow), GFP_KERNEL);
+
+	if (!cow)
+		return NULL;
+
+	cow->nslot    = od->te_avtab.nslot;
+	cow->nclasses = od->p_classes.nprim;
+	cow->nroles   = od->p_roles.nprim;
+	cow->ntypes   = od->p_types.nprim;
+
+	cow->avtab_owned   = bitmap_zalloc(cow->nslot, GFP_KERNEL);
+	cow->classes_owned = bitmap_zalloc(cow->nclasses, GFP_KERNEL);
+	cow->roles_owned   = bitmap_zalloc(cow->nroles, GFP_KERNEL);
+	cow->types_owned   = bitmap_zalloc(cow->ntypes, GFP_KERNEL);
+	if (!cow->avtab_owned || !cow->classes_owned ||
+	    !cow->roles_owned || !cow->types_owned) {
+		cow_free(cow);
+		return NULL;
+	}
+	return cow;
+}
+
+/* same as avtab_hash() in security/selinux/ss/avtab.c */
+static u32 nksu_avtab_hash(const struct avtab_key *keyp, u32 mask)
+{
+	static const u32 c1 = 0xcc9e2d51;
+	static const u32 c2 = 0x1b873593;
+	static const u32 r1 = 15;
+	static const u32 r2 = 13;
+	static const u32 m  = 5;
+	static const u32 n  = 0xe6546b64;
+	u32 hash = 0;
+
+#define mix(input) do { \
+		u32 v = input; \
+		v *= c1; \
+		v = (v << r1) | (v >> (32 - r1)); \
+		v *= c2; \
+		hash ^= v; \
+		hash = (hash << r2) | (hash >> (32 - r2)); \
+		hash = hash * m + n; \
+	} while (0)
+
+	mix(keyp->target_class);
+	mix(keyp->target_type);
+	mix(keyp->source_type);
+
+#undef mix
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash & mask;
+}
+
+/* free a chain built by clone_chain(); the node caches are avtab.c's own */
+static void free_chain(struct avtab_node *chain)
+{
+	struct avtab tmp = { };
+
+	if (!chain)
+		return;
+	tmp.htable = kvcalloc(1, sizeof(*tmp.htable), GFP_KERNEL);
+	if (!tmp.htable) {
+		pr_err("[selinux] leaking a cloned avtab chain\n");
+		return;
+	}
+	tmp.nslot = 1;
+	tmp.htable[0] = chain;
+	avtab_destroy(&tmp);
+}
+
+/*
+ * Build a private copy of @src in @tmp, a one-slot avtab: insert keeps the
+ * chain sorted and deep-copies xperms.  On success the chain is handed
+ * back through @out and @tmp is left empty for the next call.
+ */
+static int clone_chain(struct avtab *tmp, struct avtab_node *src,
+		       struct avtab_node **out)
+{
+	struct avtab_node *n;
+
+	tmp->htable[0] = NULL;
+	for (n = src; n; n = n->next) {
+		if (!avtab_insert_nonunique(tmp, &n->key, &n->datum)) {
+			free_chain(tmp->htable[0]);
+			tmp->htable[0] = NULL;
+			return -ENOMEM;
+		}
+		atomic64_inc(&sepolicy_stats.nodes_cloned);
+	}
+	*out = tmp->htable[0];
+	tmp->htable[0] = NULL;
+	return 0;
+}
+
+static int chain_tmp_init(struct avtab *tmp)
+{
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->htable = kvcalloc(1, sizeof(*tmp->htable), GFP_KERNEL);
+	if (!tmp->htable)
 		return -ENOMEM;
-	dst->datum = ncls;
-	ncls->constraints = NULL;
+	tmp->nslot = 1;
+	tmp->mask  = 0;
+	return 0;
+}
 
-	for (on = ocls->constraints; on; on = on->next) {
-		nn = kmemdup(on, sizeof(*on), GFP_KERNEL);
-		if (!nn)
-			goto oom;
-		nn->expr = NULL;
-		if (nprev)
-			nprev->next = nn;
+/* publish a private chain with one store: lookups see old or new, whole */
+static void cow_splice_slot(struct nksu_cow *cow, struct avtab *h, u32 slot,
+			    struct avtab_node *chain)
+{
+	/* same node count as before, so h->nel is already right */
+	smp_store_release(&h->htable[slot], chain);
+	__set_bit(slot, cow->avtab_owned);
+	cow->nr_slots_cloned++;
+}
+
+int sepolicy_cow_avtab_slot(struct policydb *p, u32 slot)
+{
+	struct nksu_cow *cow = cow_get(p);
+	struct avtab *h = &p->te_avtab;
+	struct avtab_node *chain;
+	struct avtab tmp;
+	int ret;
+
+	if (!cow || slot >= cow->nslot || test_bit(slot, cow->avtab_owned))
+		return 0;
+
+	ret = chain_tmp_init(&tmp);
+	if (ret)
+		return ret;
+
+	ret = clone_chain(&tmp, h->htable[slot], &chain);
+	if (!ret)
+		cow_splice_slot(cow, h, slot, chain);
+
+	kvfree(tmp.htable);
+	return ret;
+}
+
+#define COW_BULK_MIN_SLOTS	4096
+#define COW_BULK_MAX_WORKERS	8
+
+struct cow_range_work {
+	struct work_struct work;
+	struct nksu_cow *cow;
+	struct avtab *h;
+	u32 lo, hi;
+	bool (*want)(const struct avtab_node *chain);
+	struct avtab_node **out;	/* bulk clone: one chain per slot */
+	struct avtab view;		/* rehash: private view of the new table */
+	int ret;
+};
+
+/*
+ * Clone [lo, hi) into out[].  Runs with policy_mutex held by the caller,
+ * so the shared chains can't change under the walk and out[] is only
+ * written for this worker's range.
+ */
+static void cow_range_fn(struct work_struct *work)
+{
+	struct cow_range_work *w = container_of(work, struct cow_range_work,
+						work);
+	struct avtab tmp;
+	u32 i;
+
+	w->ret = chain_tmp_init(&tmp);
+	if (w->ret)
+		return;
+
+	for (i = w->lo; i < w->hi; i++) {
+		struct avtab_node *src = w->h->htable[i];
+
+		if (!src || test_bit(i, w->cow->avtab_owned))
+			continue;
+		if (w->want && !w->want(src))
+			continue;
+		w->ret = clone_chain(&tmp, src, &w->out[i]);
+		if (w->ret)
+			break;
+		cond_resched();
+	}
+
+	kvfree(tmp.htable);
+}
+
+/*
+ * Split [0, nslot) across unbound workers running @fn, each starting from a
+ * copy of @tmpl.  Returns the first worker error; *@nw gets the count.
+ */
+static int cow_run_ranges(const struct cow_range_work *tmpl, u32 nslot,
+			  work_func_t fn, u32 *nw, u32 *nel)
+{
+	struct cow_range_work *works;
+	u32 nworkers = 1, per, i;
+	int ret = 0;
+
+	if (nslot >= COW_BULK_MIN_SLOTS)
+		nworkers = clamp_t(u32, num_online_cpus(), 1,
+				   COW_BULK_MAX_WORKERS);
+	per = DIV_ROUND_UP(nslot, nworkers);
+
+	works = kcalloc(nworkers, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+
+	for (i = 0; i < nworkers; i++) {
+		struct cow_range_work *w = &works[i];
+
+		*w = *tmpl;
+		w->lo = min(i * per, nslot);
+		w->hi = min(w->lo + per, nslot);
+		INIT_WORK(&w->work, fn);
+		if (nworkers == 1)
+			fn(&w->work);
 		else
-			ncls->constraints = nn;
+			queue_work(system_unbound_wq, &w->work);
+	}
 
-		eprev = NULL;
-		for (oe = on->expr; oe; oe = oe->next) {
-			ne = kmemdup(oe, sizeof(*oe), GFP_KERNEL);
-			if (!ne)
-				goto oom;
-			if (eprev)
-				eprev->next = ne;
-			else
-				nn->expr = ne;
-			if (oe->expr_type == CEXPR_NAMES) {
-				if (ebitmap_cpy(&ne->names, &oe->names) < 0)
-					goto oom;
+	if (nel)
+		*nel = 0;
+	for (i = 0; i < nworkers; i++) {
+		if (nworkers > 1)
+			flush_work(&works[i].work);
+		if (works[i].ret && !ret)
+			ret = works[i].ret;
+		if (nel)
+			*nel += works[i].view.nel;
+	}
+
+	*nw = nworkers;
+	kfree(works);
+	return ret;
+}
+
+/*
+ * Clone every shared bucket that @want accepts (all of them if NULL).  The
+ * slot range is split across workers that each build private chains; they
+ * are spliced in afterwards from this thread.  Buckets that failed to
+ * clone stay shared, and the first error is returned.
+ */
+int sepolicy_cow_avtab_bulk(struct policydb *p,
+			    bool (*want)(const struct avtab_node *chain))
+{
+	struct nksu_cow *cow = cow_get(p);
+	struct avtab *h = &p->te_avtab;
+	struct cow_range_work tmpl = { };
+	struct avtab_node **out;
+	u32 nworkers, i;
+	int ret;
+
+	if (!cow || !cow->nslot)
+		return 0;
+
+	out = kvcalloc(cow->nslot, sizeof(*out), GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
+
+	tmpl.cow  = cow;
+	tmpl.h    = h;
+	tmpl.want = want;
+	tmpl.out  = out;
+	ret = cow_run_ranges(&tmpl, cow->nslot, cow_range_fn, &nworkers, NULL);
+
+	for (i = 0; i < cow->nslot; i++) {
+		if (out[i])
+			cow_splice_slot(cow, h, i, out[i]);
+	}
+
+	pr_info("[selinux] bulk cloned avtab with %u worker(s), %u/%u slot(s) owned\n",
+		nworkers, cow->nr_slots_cloned, cow->nslot);
+	kvfree(out);
+	return ret;
+}
+
+/* slot count avtab_alloc() would pick for @nrules */
+static u32 avtab_pref_nslot(u32 nrules)
+{
+	u32 shift = 0, work = nrules;
+
+	if (!nrules)
+		return 0;
+	while (work) {
+		work >>= 1;
+		shift++;
+	}
+	if (shift > 2)
+		shift -= 2;
+	return min_t(u32, 1U << shift, MAX_AVTAB_HASH_BUCKETS);
+}
+
+static void avtab_chain_stats(const char *when, struct avtab *h)
+{
+	u32 i, used = 0, len, max = 0;
+	u64 sumsq = 0;
+	struct avtab_node *n;
+
+	for (i = 0; i < h->nslot; i++) {
+		len = 0;
+		for (n = h->htable[i]; n; n = n->next)
+			len++;
+		if (len) {
+			used++;
+			max = max(max, len);
+			sumsq += (u64)len * len;
+		}
+	}
+	pr_info("[selinux] avtab %s: %u entries, %u/%u buckets used, longest chain %u, sum of chain length^2 %llu\n",
+		when, h->nel, used, h->nslot, max, sumsq);
+}
+
+/*
+ * New slots are a power-of-two multiple of the old ones, so everything in
+ * old slot i lands in slots i + k * old_nslot: worker ranges never share a
+ * destination slot, and each worker inserts through its own avtab view.
+ */
+static void rehash_range_fn(struct work_struct *work)
+{
+	struct cow_range_work *w = container_of(work, struct cow_range_work,
+						work);
+	struct avtab_node *n;
+	u32 i;
+
+	for (i = w->lo; i < w->hi; i++) {
+		for (n = w->h->htable[i]; n; n = n->next) {
+			if (!avtab_insert_nonunique(&w->view, &n->key,
+						    &n->datum)) {
+				w->ret = -ENOMEM;
+				return;
 			}
-			eprev = ne;
 		}
-		nprev = nn;
+		cond_resched();
+	}
+}
+
+/*
+ * Publish @newtab as @p's te_avtab.  The (htable, mask) pair can't change
+ * under lockless readers, so it goes into a new selinux_policy shell that
+ * is published with RCU; the old shell and the chains it owned are freed
+ * after a grace period.  On success @newtab belongs to the new shell.
+ */
+static struct policydb *cow_install_avtab(struct nksu_cow *cow,
+					  struct policydb *p,
+					  struct avtab *newtab)
+{
+	struct selinux_policy *oldpol, *newpol;
+	struct avtab old;
+	unsigned long *owned;
+
+	owned = bitmap_alloc(newtab->nslot, GFP_KERNEL);
+	newpol = kmalloc(sizeof(*newpol), GFP_KERNEL);
+	if (!owned || !newpol) {
+		bitmap_free(owned);
+		kfree(newpol);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	oldpol = container_of(p, struct selinux_policy, policydb);
+	*newpol = *oldpol;
+	old = oldpol->policydb.te_avtab;
+	newpol->policydb.te_avtab = *newtab;
+
+	rcu_assign_pointer(selinux_state.policy, newpol);
+	synchronize_rcu();
+
+	_free_avtab(&old, cow);
+	kfree(oldpol);
+
+	bitmap_fill(owned, newtab->nslot);
+	bitmap_free(cow->avtab_owned);
+	cow->avtab_owned = owned;
+	cow->nslot = newtab->nslot;
+	cow->nr_slots_cloned = newtab->nslot;
+	cow->pdb = &newpol->policydb;
+	set_work_policy(newpol);
+	sepolicy_iter_cache_drop();
+	return &newpol->policydb;
+}
+
+/*
+ * Resize the working copy's te_avtab to the kernel's load factor once
+ * inserts have outgrown it.  Caller holds policy_mutex.
+ */
+int sepolicy_avtab_rehash(struct policydb *p)
+{
+	struct nksu_cow *cow = cow_get(p);
+	struct cow_range_work tmpl = { };
+	struct avtab newtab = { };
+	struct policydb *np;
+	u32 want, nworkers, nel;
+	int ret;
+
+	if (!cow)
+		return 0;
+
+	want = avtab_pref_nslot(p->te_avtab.nel);
+	if (want <= p->te_avtab.nslot)
+		return 0;
+
+	avtab_chain_stats("before rehash", &p->te_avtab);
+
+	newtab.htable = kvcalloc(want, sizeof(*newtab.htable), GFP_KERNEL);
+	if (!newtab.htable) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	newtab.nslot = want;
+	newtab.mask  = want - 1;
+
+	tmpl.cow  = cow;
+	tmpl.h    = &p->te_avtab;
+	tmpl.view = newtab;
+	ret = cow_run_ranges(&tmpl, p->te_avtab.nslot, rehash_range_fn,
+			     &nworkers, &nel);
+	if (ret)
+		goto err;
+	newtab.nel = nel;
+	atomic64_add(nel, &sepolicy_stats.nodes_cloned);
+
+	np = cow_install_avtab(cow, p, &newtab);
+	if (IS_ERR(np)) {
+		ret = PTR_ERR(np);
+		goto err;
 	}
 
-	db->class_val_to_struct[ncls->value - 1] = ncls;
+	pr_info("[selinux] avtab rehashed with %u worker(s)\n", nworkers);
+	avtab_chain_stats("after rehash", &np->te_avtab);
 	return 0;
-oom:
-	return -ENOMEM;
+
+err:
+	/* nothing was published; drop whatever the workers built */
+	if (newtab.htable)
+		avtab_destroy(&newtab);
+	pr_warn("[selinux] avtab rehash to %u slots failed: %d\n", want, ret);
+	return ret;
 }
 
-static int _destroy_class_cb(void *key, void *datum, void *data)
+/* an empty table sized for the working copy's rules plus @extra */
+int sepolicy_avtab_stage_init(struct policydb *p, u64 extra,
+			      struct avtab *dst)
+{
+	u64 nrules = p->te_avtab.nel + extra;
+	u32 want;
+
+	if (!cow_get(p))
+		return -ENOENT;
+
+	want = avtab_pref_nslot(min_t(u64, nrules, U32_MAX));
+	want = max(want, p->te_avtab.nslot);
+	if (!want)
+		return -ENOENT;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->htable = kvcalloc(want, sizeof(*dst->htable), GFP_KERNEL);
+	if (!dst->htable)
+		return -ENOMEM;
+	dst->nslot = want;
+	dst->mask  = want - 1;
+	return 0;
+}
+
+/*
+ * Nobody else writes the working copy's avtab while a session holds the
+ * edit lock, so the copy can resume at *@pos after policy_mutex was
+ * dropped.  Slots are never split across calls.
+ */
+int sepolicy_avtab_stage_copy(struct policydb *p, struct avtab *dst,
+			      u32 *pos, u32 budget)
+{
+	struct avtab *h = &p->te_avtab;
+	struct avtab_node *n;
+	u32 copied = 0;
+	int ret = 1;
+
+	for (; *pos < h->nslot; (*pos)++) {
+		if (copied >= budget) {
+			ret = 0;
+			break;
+		}
+		for (n = h->htable[*pos]; n; n = n->next) {
+			if (!avtab_insert_nonunique(dst, &n->key, &n->datum)) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			copied++;
+		}
+	}
+out:
+	atomic64_add(copied, &sepolicy_stats.nodes_cloned);
+	return ret;
+}
+
+/* caller holds policy_mutex */
+struct policydb *sepolicy_avtab_install(struct policydb *p,
+					struct avtab *newtab)
+{
+	struct nksu_cow *cow = cow_get(p);
+
+	if (!cow)
+		return ERR_PTR(-ENOENT);
+	return cow_install_avtab(cow, p, newtab);
+}
+
+/*
+ * Unlink @node from @h.  Lookups that already reached it still follow its
+ * next pointer, so it must stay intact until a grace period has passed.
+ * Caller holds policy_mutex and owns the node's slot.
+ */
+void sepolicy_avtab_unlink(struct avtab *h, struct avtab_node *node)
+{
+	struct avtab_node **pp;
+
+	pp = &h->htable[nksu_avtab_hash(&node->key, h->mask)];
+	for (; *pp; pp = &(*pp)->next) {
+		if (*pp == node) {
+			WRITE_ONCE(*pp, node->next);
+			h->nel--;
+			return;
+		}
+	}
+}
+
+/* free nodes unlinked by sepolicy_avtab_unlink(), after a grace period */
+void sepolicy_avtab_free_nodes(struct avtab_node **nodes, u32 n)
+{
+	u32 i;
+
+	if (!n)
+		return;
+	for (i = 0; i + 1 < n; i++)
+		nodes[i]->next = nodes[i + 1];
+	nodes[n - 1]->next = NULL;
+	free_chain(nodes[0]);
+}
+
+int sepolicy_cow_avtab_key(struct policydb *p, const struct avtab_key *key)
+{
+	if (!cow_get(p) || !p->te_avtab.nslot)
+		return 0;
+	return sepolicy_cow_avtab_slot(p,
+			nksu_avtab_hash(key, p->te_avtab.mask));
+}
+
+static void _destroy_class(struct class_datum *cls)
 {
-	struct class_datum *cls = datum;
 	struct constraint_node *n, *np;
 	struct constraint_expr *e, *ep;
 
 	if (!cls)
-		return 0;
+		return;
 	for (n = cls->constraints; n;) {
 		for (e = n->expr; e;) {
 			if (e->expr_type == CEXPR_NAMES)
@@ -152,114 +686,246 @@ static int _destroy_class_cb(void *key, void *datum, void *data)
 		np = n; n = n->next; kfree(np);
 	}
 	kfree(cls);
-	return 0;
 }
 
-static void _free_classes(struct policydb *db)
+/* constraint chains and their name bitmaps are what edits write */
+static struct class_datum *_clone_class(struct class_datum *ocls)
 {
-	kfree(db->class_val_to_struct);
-	if (db->p_classes.table.htable) {
-		hashtab_map(&db->p_classes.table, _destroy_class_cb, NULL);
-		hashtab_destroy(&db->p_classes.table);
+	struct class_datum *ncls;
+	struct constraint_node *on, *nn, **nlink;
+	struct constraint_expr *oe, *ne, **elink;
+
+	ncls = kmemdup(ocls, sizeof(*ocls), GFP_KERNEL);
+	if (!ncls)
+		return NULL;
+	ncls->constraints = NULL;
+
+	nlink = &ncls->constraints;
+	for (on = ocls->constraints; on; on = on->next) {
+		nn = kmemdup(on, sizeof(*on), GFP_KERNEL);
+		if (!nn)
+			goto oom;
+		nn->next = NULL;
+		nn->expr = NULL;
+		*nlink = nn;
+		nlink = &nn->next;
+
+		elink = &nn->expr;
+		for (oe = on->expr; oe; oe = oe->next) {
+			ne = kmemdup(oe, sizeof(*oe), GFP_KERNEL);
+			if (!ne)
+				goto oom;
+			ne->next = NULL;
+			if (oe->expr_type == CEXPR_NAMES) {
+				ebitmap_init(&ne->names);
+				*elink = ne;
+				if (ebitmap_cpy(&ne->names, &oe->names) < 0)
+					goto oom;
+			} else {
+				*elink = ne;
+			}
+			elink = &ne->next;
+		}
 	}
+	return ncls;
+oom:
+	_destroy_class(ncls);
+	return NULL;
 }
 
-static int _copy_classes(struct policydb *nd, struct policydb *od)
+static struct hashtab_node *ht_find_datum(struct hashtab *h, void *datum)
 {
-	u32 n = nd->symtab[SYM_CLASSES].nprim;
+	struct hashtab_node *node;
+	u32 i;
 
-	nd->class_val_to_struct = kcalloc(n, sizeof(*nd->class_val_to_struct),
-					  GFP_KERNEL);
-	if (!nd->class_val_to_struct)
-		return -ENOMEM;
+	for (i = 0; i < h->size; i++)
+		for (node = h->htable[i]; node; node = node->next)
+			if (node->datum == datum)
+				return node;
+	return NULL;
+}
 
-	memset(&nd->p_classes.table, 0, sizeof(nd->p_classes.table));
-	return hashtab_duplicate(&nd->p_classes.table, &od->p_classes.table,
-				 _copy_class_cb, _destroy_class_cb, nd);
+/* returns the writable class, or NULL on allocation failure */
+struct class_datum *sepolicy_cow_class(struct policydb *p,
+				       struct class_datum *cls)
+{
+	struct nksu_cow *cow = cow_get(p);
+	struct hashtab_node *node;
+	struct class_datum *ncls;
+	u32 idx = cls->value - 1;
+
+	if (!cow || idx >= cow->nclasses || test_bit(idx, cow->classes_owned))
+		return cls;
+
+	node = ht_find_datum(&p->p_classes.table, cls);
+	if (!node)
+		return NULL;
+
+	ncls = _clone_class(cls);
+	if (!ncls)
+		return NULL;
+
+	smp_store_release(&node->datum, (void *)ncls);
+	smp_store_release(&p->class_val_to_struct[idx], ncls);
+	__set_bit(idx, cow->classes_owned);
+	sepolicy_iter_cache_drop();
+	return ncls;
 }
 
-static int _copy_avtab(struct avtab *dst, struct avtab *src)
+struct role_datum *sepolicy_cow_role(struct policydb *p, u32 idx)
 {
-	int ret, i;
-	struct avtab_node *n;
+	struct nksu_cow *cow = cow_get(p);
+	struct role_datum *or = p->role_val_to_struct[idx], *nr;
+	struct hashtab_node *node;
 
-	ret = avtab_alloc_dup(dst, src);
-	if (ret < 0)
-		return ret;
-	dst->nel = 0;
+	if (!cow || !or || idx >= cow->nroles ||
+	    test_bit(idx, cow->roles_owned))
+		return or;
 
-	for (i = 0; i < src->nslot; i++) {
-		for (n = src->htable[i]; n; n = n->next) {
-			if (!avtab_insert_nonunique(dst, &n->key, &n->datum)) {
-				avtab_destroy(dst);
-				return -ENOMEM;
-			}
-		}
+	node = ht_find_datum(&p->p_roles.table, or);
+	if (!node)
+		return NULL;
+
+	nr = kmemdup(or, sizeof(*or), GFP_KERNEL);
+	if (!nr)
+		return NULL;
+	ebitmap_init(&nr->types);
+	if (ebitmap_cpy(&nr->types, &or->types)) {
+		kfree(nr);
+		return NULL;
 	}
-	return 0;
+
+	smp_store_release(&node->datum, (void *)nr);
+	smp_store_release(&p->role_val_to_struct[idx], nr);
+	__set_bit(idx, cow->roles_owned);
+	return nr;
 }
 
-static int _copy_role_cb(struct hashtab_node *dst,
-			 _CONST_NODE struct hashtab_node *src, void *data)
+int sepolicy_cow_type_attr(struct policydb *p, u32 idx)
 {
-	struct policydb *db = data;
-	struct role_datum *or = src->datum, *nr;
+	struct nksu_cow *cow = cow_get(p);
+	struct ebitmap *e, tmp;
 	int ret;
 
-	nr = kmemdup(or, sizeof(*or), GFP_KERNEL);
-	if (!nr)
-		return -ENOMEM;
-	dst->key   = src->key;
-	dst->datum = nr;
+	if (!cow || idx >= cow->ntypes || test_bit(idx, cow->types_owned))
+		return 0;
 
-	ret = ebitmap_cpy(&nr->types, &or->types);
+	e = &p->type_attr_map_array[idx];
+	ebitmap_init(&tmp);
+	ret = ebitmap_cpy(&tmp, e);
 	if (ret)
 		return ret;
 
-	db->role_val_to_struct[or->value - 1] = nr;
+	/* old and new chains hold the same bits, so a torn read is harmless */
+	WRITE_ONCE(e->highbit, tmp.highbit);
+	smp_store_release(&e->node, tmp.node);
+	__set_bit(idx, cow->types_owned);
 	return 0;
 }
 
-static int _destroy_role_cb(void *key, void *datum, void *data)
+static bool cow_type_owned(struct nksu_cow *cow, u32 idx)
+{
+	return !cow || idx >= cow->ntypes || test_bit(idx, cow->types_owned);
+}
+
+static void _free_classes(struct policydb *db, struct nksu_cow *cow)
 {
-	struct role_datum *r = datum;
-	if (r) {
-		ebitmap_destroy(&r->types);
-		kfree(r);
+	u32 i;
+
+	if (cow && db->class_val_to_struct) {
+		for_each_set_bit(i, cow->classes_owned, cow->nclasses)
+			_destroy_class(db->class_val_to_struct[i]);
 	}
+	kfree(db->class_val_to_struct);
+	if (db->p_classes.table.htable)
+		hashtab_destroy(&db->p_classes.table);
+}
+
+static int _copy_classes(struct policydb *nd, struct policydb *od)
+{
+	u32 n = od->p_classes.nprim;
+
+	nd->class_val_to_struct = kmemdup(od->class_val_to_struct,
+					  n * sizeof(*nd->class_val_to_struct),
+					  GFP_KERNEL);
+	if (!nd->class_val_to_struct)
+		return -ENOMEM;
+
+	memset(&nd->p_classes.table, 0, sizeof(nd->p_classes.table));
+	return _shallow_copy_hashtab(&nd->p_classes.table,
+				     &od->p_classes.table);
+}
+
+/* bucket array only; every chain starts out shared with the original */
+static int _copy_avtab(struct avtab *dst, struct avtab *src)
+{
+	dst->htable = NULL;
+	if (!src->nslot)
+		return 0;
+
+	dst->htable = kvmalloc_array(src->nslot, sizeof(*dst->htable),
+				     GFP_KERNEL);
+	if (!dst->htable)
+		return -ENOMEM;
+	memcpy(dst->htable, src->htable, src->nslot * sizeof(*dst->htable));
 	return 0;
 }
 
-static void _free_roles(struct policydb *db)
+/* drop the shared chains, then let avtab_destroy() free the cloned ones */
+static void _free_avtab(struct avtab *h, struct nksu_cow *cow)
 {
+	u32 i;
+
+	if (!h->htable)
+		return;
+	for (i = 0; i < h->nslot; i++) {
+		if (!cow || i >= cow->nslot || !test_bit(i, cow->avtab_owned))
+			h->htable[i] = NULL;
+	}
+	avtab_destroy(h);
+}
+
+static void _free_roles(struct policydb *db, struct nksu_cow *cow)
+{
+	struct role_datum *r;
+	u32 i;
+
+	if (cow && db->role_val_to_struct) {
+		for_each_set_bit(i, cow->roles_owned, cow->nroles) {
+			r = db->role_val_to_struct[i];
+			if (r) {
+				ebitmap_destroy(&r->types);
+				kfree(r);
+			}
+		}
+	}
 	kfree(db->role_val_to_struct);
-	if (db->p_roles.table.htable) {
-		hashtab_map(&db->p_roles.table, _destroy_role_cb, NULL);
+	if (db->p_roles.table.htable)
 		hashtab_destroy(&db->p_roles.table);
-	}
 }
 
 static int _copy_roles(struct policydb *nd, struct policydb *od)
 {
 	u32 n = od->p_roles.nprim;
 
-	nd->role_val_to_struct = kcalloc(n, sizeof(*nd->role_val_to_struct),
+	nd->role_val_to_struct = kmemdup(od->role_val_to_struct,
+					 n * sizeof(*nd->role_val_to_struct),
 					 GFP_KERNEL);
 	if (!nd->role_val_to_struct)
 		return -ENOMEM;
 
 	memset(&nd->p_roles.table, 0, sizeof(nd->p_roles.table));
-	return hashtab_duplicate(&nd->p_roles.table, &od->p_roles.table,
-				 _copy_role_cb, _destroy_role_cb, nd);
+	return _shallow_copy_hashtab(&nd->p_roles.table, &od->p_roles.table);
 }
 
-static void _free_types(struct policydb *db)
+static void _free_types(struct policydb *db, struct nksu_cow *cow)
 {
 	u32 i;
 
 	if (db->type_attr_map_array) {
 		for (i = 0; i < db->p_types.nprim; i++)
-			ebitmap_destroy(&db->type_attr_map_array[i]);
+			if (cow_type_owned(cow, i))
+				ebitmap_destroy(&db->type_attr_map_array[i]);
 		kvfree(db->type_attr_map_array);
 	}
 	kvfree(db->type_val_to_struct);
@@ -269,7 +935,7 @@ static void _free_types(struct policydb *db)
 
 static int _copy_types(struct policydb *nd, struct policydb *od)
 {
-	u32 sz = nd->p_types.nprim, i;
+	u32 sz = nd->p_types.nprim;
 	int ret = -ENOMEM;
 
 	nd->type_attr_map_array        = NULL;
@@ -277,19 +943,14 @@ static int _copy_types(struct policydb *nd, struct policydb *od)
 	nd->sym_val_to_name[SYM_TYPES] = NULL;
 	memset(&nd->p_types.table, 0, sizeof(nd->p_types.table));
 
-	nd->type_attr_map_array = kvcalloc(sz, sizeof(struct ebitmap),
-					   GFP_KERNEL);
+	/* ebitmap heads are copied; their nodes stay shared until written */
+	nd->type_attr_map_array = kvmalloc_array(sz, sizeof(struct ebitmap),
+						 GFP_KERNEL);
 	if (!nd->type_attr_map_array)
 		goto out;
+	memcpy(nd->type_attr_map_array, od->type_attr_map_array,
+	       sz * sizeof(struct ebitmap));
 
-	for (i = 0; i < sz; i++) {
-		ret = ebitmap_cpy(&nd->type_attr_map_array[i],
-				  &od->type_attr_map_array[i]);
-		if (ret < 0)
-			goto out;
-	}
-
-	ret = -ENOMEM;
 	nd->type_val_to_struct = kvcalloc(sz, sizeof(*nd->type_val_to_struct),
 					  GFP_KERNEL);
 	if (!nd->type_val_to_struct)
@@ -311,7 +972,12 @@ static int _copy_types(struct policydb *nd, struct policydb *od)
 
 	return 0;
 out:
-	_free_types(nd);
+	/* nothing owned yet: don't destroy the shared bitmaps */
+	kvfree(nd->type_attr_map_array);
+	nd->type_attr_map_array = NULL;
+	kvfree(nd->type_val_to_struct);
+	kvfree(nd->sym_val_to_name[SYM_TYPES]);
+	hashtab_destroy(&nd->p_types.table);
 	return ret;
 }
 
@@ -325,18 +991,25 @@ static int _copy_filename_trans(struct policydb *nd, struct policydb *od)
 	return _shallow_copy_hashtab(&nd->filename_trans, &od->filename_trans);
 }
 
-static struct selinux_policy *nksu_dup_policy(struct selinux_policy *src)
+static struct selinux_policy *nksu_dup_policy(struct selinux_policy *src,
+					      struct nksu_cow **cowp)
 {
 	struct selinux_policy *dst;
 	struct policydb *nd, *od;
+	struct nksu_cow *cow;
 	int ret;
 
+	cow = cow_alloc(&src->policydb);
+	if (!cow)
+		return NULL;
+
 	dst = kmemdup(src, sizeof(*src), GFP_KERNEL);
 	if (!dst)
-		return NULL;
+		goto err_cow;
 
 	nd = &dst->policydb;
 	od = &src->policydb;
+	cow->pdb = nd;
 
 	ret = _copy_classes(nd, od);
 	if (ret)
@@ -362,24 +1035,28 @@ static struct selinux_policy *nksu_dup_policy(struct selinux_policy *src)
 	if (ret)
 		goto err_pmap;
 
+	*cowp = cow;
 	return dst;
 
 err_pmap:
 	ebitmap_destroy(&nd->permissive_map);
 err_types:
-	_free_types(nd);
+	_free_types(nd, cow);
 err_roles:
-	_free_roles(nd);
+	_free_roles(nd, cow);
 err_avtab:
-	avtab_destroy(&nd->te_avtab);
+	_free_avtab(&nd->te_avtab, cow);
 err_classes:
-	_free_classes(nd);
+	_free_classes(nd, cow);
 err_free:
 	kfree(dst);
+err_cow:
+	cow_free(cow);
 	return NULL;
 }
 
-static void nksu_destroy_policy(struct selinux_policy *pol)
+static void nksu_destroy_policy(struct selinux_policy *pol,
+				struct nksu_cow *cow)
 {
 	struct policydb *db;
 
@@ -387,58 +1064,73 @@ static void nksu_destroy_policy(struct selinux_policy *pol)
 		return;
 
 	db = &pol->policydb;
-	_free_classes(db);
-	avtab_destroy(&db->te_avtab);
-	_free_roles(db);
-	_free_types(db);
+	if (cow)
+		pr_info("[selinux] freeing %u cloned avtab slot(s) of %u\n",
+			cow->nr_slots_cloned, cow->nslot);
+	_free_classes(db, cow);
+	_free_avtab(&db->te_avtab, cow);
+	_free_roles(db, cow);
+	_free_types(db, cow);
 	ebitmap_destroy(&db->permissive_map);
 	hashtab_destroy(&db->filename_trans);
 	kfree(pol);
+	cow_free(cow);
 }
 
-int sepolicy_dup_and_apply(void)
+static int dup_and_apply_locked(void)
 {
 	struct selinux_policy *orig, *work;
-
-	if (nksu_orig_policy) {
-		pr_warn("[selinux] sepolicy_dup_and_apply: already active\n");
-		return -EBUSY;
-	}
-
-	mutex_lock(&selinux_state.policy_mutex);
+	struct nksu_cow *cow = NULL;
 
 	orig = rcu_dereference_protected(
 		selinux_state.policy,
 		lockdep_is_held(&selinux_state.policy_mutex));
 
 	if (!orig) {
-		mutex_unlock(&selinux_state.policy_mutex);
 		pr_err("[selinux] sepolicy_dup_and_apply: no live policy\n");
 		return -ENOENT;
 	}
 
-	work = nksu_dup_policy(orig);
+	work = nksu_dup_policy(orig, &cow);
 	if (!work) {
-		mutex_unlock(&selinux_state.policy_mutex);
 		pr_err("[selinux] sepolicy_dup_and_apply: dup failed\n");
 		return -ENOMEM;
 	}
 
 	nksu_orig_policy = orig;
-	nksu_work_policy = work;
+	set_work_policy(work);
+	nksu_cow_state = cow;
 
 	rcu_assign_pointer(selinux_state.policy, work);
+	return 0;
+}
+
+int sepolicy_dup_and_apply(void)
+{
+	ktime_t t0 = ktime_get();
+	int ret;
+
+	if (nksu_orig_policy) {
+		pr_warn("[selinux] sepolicy_dup_and_apply: already active\n");
+		return -EBUSY;
+	}
 
+	mutex_lock(&selinux_state.policy_mutex);
+	ret = dup_and_apply_locked();
 	mutex_unlock(&selinux_state.policy_mutex);
+	if (ret)
+		return ret;
 	synchronize_rcu();
+	sepolicy_stats_phase(SEPOLICY_PHASE_DUP, t0);
 
-	pr_info("[selinux] policy duplicated, working copy installed\n");
+	pr_info("[selinux] policy duplicated (copy-on-write), working copy installed\n");
 	return 0;
 }
 
 void sepolicy_restore(void)
 {
 	struct selinux_policy *work;
+	struct nksu_cow *cow;
 
 	if (!nksu_orig_policy) {
 		pr_warn("[selinux] sepolicy_restore: nothing to restore\n");
@@ -447,21 +1139,145 @@ void sepolicy_restore(void)
 
 	mutex_lock(&selinux_state.policy_mutex);
 
+	sepolicy_follow_bools_locked();
 	work = rcu_dereference_protected(
 		selinux_state.policy,
 		lockdep_is_held(&selinux_state.policy_mutex));
 
 	rcu_assign_pointer(selinux_state.policy, nksu_orig_policy);
+	cow = nksu_cow_state;
+	nksu_cow_state = NULL;
+	sepolicy_rule_index_flush();
+	sepolicy_rule_refs_flush();
 
 	mutex_unlock(&selinux_state.policy_mutex);
 	synchronize_rcu();
 
-	nksu_destroy_policy(work);
+	/* a policy reload may have replaced our copy; only free our own */
+	if (work == nksu_work_policy)
+		nksu_destroy_policy(work, cow);
+	else
+		pr_warn("[selinux] sepolicy_restore: live policy is not ours, not freeing it\n");
 
 	nksu_orig_policy = NULL;
-	nksu_work_policy = NULL;
+	set_work_policy(NULL);
 
 	nksu_avc_reset();
 
 	pr_info("[selinux] original policy restored\n");
 }
+
+/*
+ * security_set_bools() also replaces the live policy, but only its shell:
+ * it duplicates the conditional rules into a kmemdup of ours and frees
+ * ours along with the conditional data the original shared with it.
+ * te_avtab, the symtabs and the types stay ours, so adopt the new shell
+ * as the working copy and hand the original its conditional data.
+ * Returns true if the live policy is ours again.  Caller holds
+ * policy_mutex.
+ */
+bool sepolicy_follow_bools_locked(void)
+{
+	struct selinux_policy *live, *orig = nksu_orig_policy;
+	struct policydb *od, *nd;
+	u32 seqno = nksu_work_seqno;
+
+	if (!orig)
+		return false;
+	live = rcu_dereference_protected(
+		selinux_state.policy,
+		lockdep_is_held(&selinux_state.policy_mutex));
+	if (live == nksu_work_policy)
+		return true;
+	if (!live || live->policydb.p_types.table.htable != nksu_work_types)
+		return false;
+
+	nd = &live->policydb;
+	od = &orig->policydb;
+	od->p_bools = nd->p_bools;
+	od->bool_val_to_struct = nd->bool_val_to_struct;
+	od->te_cond_avtab = nd->te_cond_avtab;
+	od->cond_list = nd->cond_list;
+	od->cond_list_len = nd->cond_list_len;
+
+	nksu_cow_state->pdb = nd;
+	set_work_policy(live);
+	sepolicy_iter_cache_drop();
+	/* same rules as before, under the new latest_granting */
+	sepolicy_rule_refs_rebind(seqno, live->latest_granting);
+	sepolicy_rule_index_rebind(seqno, live->latest_granting);
+	return true;
+}
+
+/*
+ * After a policy reload the loader has already freed our working copy,
+ * and with it everything it shared with the original, so the original
+ * is left alone (and leaked) rather than touched again.  Duplicate the
+ * new policy instead.  Returns 1 if a new working copy was installed,
+ * 0 if ours (or a boolean change's copy of it) is still live.
+ */
+int sepolicy_reattach(void)
+{
+	ktime_t t0 = ktime_get();
+	int ret;
+
+	if (!nksu_orig_policy)
+		return 0;
+
+	mutex_lock(&selinux_state.policy_mutex);
+	if (sepolicy_follow_bools_locked()) {
+		mutex_unlock(&selinux_state.policy_mutex);
+		return 0;
+	}
+
+	cow_free(nksu_cow_state);
+	nksu_cow_state = NULL;
+	nksu_orig_policy = NULL;
+	set_work_policy(NULL);
+
+	ret = dup_and_apply_locked();
+	mutex_unlock(&selinux_state.policy_mutex);
+	if (ret)
+		return ret;
+	synchronize_rcu();
+	sepolicy_stats_phase(SEPOLICY_PHASE_DUP, t0);
+
+	pr_info("[selinux] policy reloaded, working copy reinstalled\n");
+	return 1;
+}
+
+/*
+ * Whether someone else's policy has replaced our working copy.  Lockless:
+ * the LSM notifier calls it from under the loader's policy_mutex as well
+ * as from our own AVC resets.  A stale answer only costs a spurious
+ * sepolicy_reattach(), which checks again under the mutex.
+ */
+bool sepolicy_live_replaced(void)
+{
+	struct selinux_policy *work = READ_ONCE(nksu_work_policy);
+
+	return work && rcu_access_pointer(selinux_state.policy) != work;
+}
+
+/* cloned-vs-shared split of the working copy; caller holds policy_mutex */
+void sepolicy_cow_show(struct seq_file *m)
+{
+	struct nksu_cow *cow = nksu_cow_state;
+
+	/* after a reload cow->pdb is gone until the worker reattaches */
+	if (!cow || !sepolicy_follow_bools_locked()) {
+		seq_puts(m, "cow: inactive\n");
+		return;
+	}
+
+	seq_printf(m, "cow_avtab_slots: %u/%u cloned\n",
+		   bitmap_weight(cow->avtab_owned, cow->nslot), cow->nslot);
+	seq_printf(m, "cow_classes: %u/%u cloned\n",
+		   bitmap_weight(cow->classes_owned, cow->nclasses),
+		   cow->nclasses);
+	seq_printf(m, "cow_roles: %u/%u cloned\n",
+		   bitmap_weight(cow->roles_owned, cow->nroles), cow->nroles);
+	seq_printf(m, "cow_type_attrs: %u/%u cloned, %u type(s) added\n",
+		   bitmap_weight(cow->types_owned, cow->ntypes), cow->ntypes,
+		   cow->pdb->p_types.nprim - cow->ntypes);
+}
@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/security.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <fmac.h>
+
+#include "ss/policydb.h"
+#include "ss/avtab.h"
+#include "security.h"
+
+/*
+ * Every successful edit is recorded here in order, with its names interned,
+ * so a policy reload (which throws our working copy away) can be followed
+ * by one session that replays them against the new policy.  Type and class
+ * values are not stable across loads, so names are what we keep; replay
+ * still resolves each through the symtab hashes, but skips the parsing,
+ * the ioctl round trips and the per-call AVC flushes.  Protected by
+ * policy_mutex.
+ */
+
+#define JOURNAL_MAX		8192
+#define JOURNAL_HASH_BITS	8
+
+struct jnl_name {
+	struct hlist_node node;
+	u32 hash;
+	char name[];
+};
+
+struct jnl_op {
+	struct list_head list;
+	struct hlist_node node;
+	u32 hash;
+	u32 seq;
+	u8 op;
+	bool invert;
+	u32 staged;		/* pending on the session's first N staged edits */
+	u16 effect;
+	const char *arg[4];
+};
+
+static DEFINE_HASHTABLE(jnl_names, JOURNAL_HASH_BITS);
+static DEFINE_HASHTABLE(jnl_index, JOURNAL_HASH_BITS);
+static LIST_HEAD(jnl_ops);
+static u32 jnl_count;
+static u32 jnl_npending;
+static u32 jnl_seq;
+static u32 jnl_last_revert;	/* seq of the last op that can clear bits */
+static bool jnl_dropped;
+static bool jnl_replaying;
+
+static void journal_reload_fn(struct work_struct *work);
+static DECLARE_WORK(journal_reload_work, journal_reload_fn);
+static bool jnl_notifier_on;
+
+static const char *jnl_intern(const char *s)
+{
+	struct jnl_name *n;
+	size_t len;
+	u32 hash;
+
+	if (!s || !*s)
+		return NULL;
+
+	len = strlen(s);
+	hash = jhash(s, len, 0);
+	hash_for_each_possible(jnl_names, n, node, hash) {
+		if (n->hash == hash && !strcmp(n->name, s))
+			return n->name;
+	}
+
+	n = kmalloc(struct_size(n, name, len + 1), GFP_KERNEL);
+	if (!n)
+		return ERR_PTR(-ENOMEM);
+	n->hash = hash;
+	memcpy(n->name, s, len + 1);
+	hash_add(jnl_names, &n->node, hash);
+	return n->name;
+}
+
+static bool jnl_op_reverts(const struct jnl_op *op)
+{
+	if (op->op == JNL_REMOVE)
+		return true;
+	if (op->op != JNL_RULE && op->op != JNL_XPERM)
+		return false;
+	return sepolicy_rule_is_reverting(op->effect, op->invert);
+}
+
+/* interned names compare by pointer */
+static struct jnl_op *jnl_find(const struct jnl_op *want)
+{
+	struct jnl_op *op;
+
+	hash_for_each_possible(jnl_index, op, node, want->hash) {
+		if (!op->staged && op->hash == want->hash &&
+		    op->op == want->op &&
+		    op->effect == want->effect &&
+		    op->invert == want->invert &&
+		    !memcmp(op->arg, want->arg, sizeof(op->arg)))
+			return op;
+	}
+	return NULL;
+}
+
+void sepolicy_journal_record(int type, const char *a0, const char *a1,
+			     const char *a2, const char *a3, int effect,
+			     bool invert, u32 staged)
+{
+	const char *in[4] = { a0, a1, a2, a3 };
+	struct jnl_op want = { .op = type, .effect = effect,
+			       .invert = invert, .staged = staged };
+	struct jnl_op *op;
+	int i;
+
+	if (jnl_replaying)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(in); i++) {
+		want.arg[i] = jnl_intern(in[i]);
+		if (IS_ERR(want.arg[i]))
+			goto drop;
+	}
+	want.hash = jhash(want.arg, sizeof(want.arg),
+			  type << 24 | (u16)effect << 1 | invert);
+
+	/* a repeat is redundant unless something since could have undone it */
+	op = jnl_find(&want);
+	if (op && op->seq > jnl_last_revert)
+		return;
+
+	if (jnl_count >= JOURNAL_MAX)
+		goto drop;
+
+	op = kmalloc(sizeof(*op), GFP_KERNEL);
+	if (!op)
+		goto drop;
+	*op = want;
+	op->seq = ++jnl_seq;
+	if (jnl_op_reverts(op))
+		jnl_last_revert = op->seq;
+	list_add_tail(&op->list, &jnl_ops);
+	hash_add(jnl_index, &op->node, op->hash);
+	jnl_count++;
+	if (staged)
+		jnl_npending++;
+	return;
+
+drop:
+	if (!jnl_dropped)
+		pr_warn("[journal]: dropping edits, a reload will not restore them all\n");
+	jnl_dropped = true;
+}
+
+static void jnl_free_op(struct jnl_op *op)
+{
+	hash_del(&op->node);
+	list_del(&op->list);
+	kfree(op);
+	jnl_count--;
+}
+
+/*
+ * Commit calls this once it knows how many of the session's staged edits
+ * took effect, in order: records waiting on those are kept, the rest are
+ * dropped.  They are all at the tail: the edit lock keeps other sessions
+ * from recording meanwhile.
+ */
+void sepolicy_journal_settle(u32 applied)
+{
+	struct jnl_op *op, *tmp;
+
+	list_for_each_entry_safe_reverse(op, tmp, &jnl_ops, list) {
+		if (!jnl_npending)
+			break;
+		if (!op->staged)
+			continue;
+		jnl_npending--;
+		if (op->staged <= applied)
+			op->staged = 0;
+		else
+			jnl_free_op(op);
+	}
+}
+
+static int jnl_replay_one(struct sepolicy_session *sess,
+			  const struct jnl_op *op)
+{
+	const char *const *a = op->arg;
+
+	switch (op->op) {
+	case JNL_DOMAIN:
+		return sepolicy_session_add_domains(sess, &a[0], 1);
+	case JNL_RULE:
+		return sepolicy_session_add_rule(sess, a[0], a[1], a[2], a[3],
+						 op->effect, op->invert);
+	case JNL_ALL_TYPES:
+		return sepolicy_session_allow_all_types(sess, a[0], a[1]);
+	case JNL_ANY_ANY:
+		return sepolicy_session_allow_any_any(sess, a[0]);
+	case JNL_TYPEATTR:
+		return sepolicy_session_add_typeattribute(sess, a[0], a[1]);
+	case JNL_XPERM:
+		return sepolicy_session_add_xperm(sess, a[0], a[1], a[2], a[3],
+						  op->effect, op->invert);
+	case JNL_TYPE:
+		return sepolicy_session_add_type(sess, a[0], op->invert);
+	case JNL_GROUPS:
+		return sepolicy_apply_groups(sess);
+	case JNL_REMOVE:
+		return sepolicy_session_remove_rule(sess, a[0], a[1], a[2],
+						    a[3], op->effect,
+						    op->invert);
+	default:
+		return -EINVAL;
+	}
+}
+
+int sepolicy_journal_replay(struct sepolicy_session *sess)
+{
+	struct jnl_op *op;
+	int failed = 0;
+
+	jnl_replaying = true;
+	list_for_each_entry(op, &jnl_ops, list) {
+		if (jnl_replay_one(sess, op))
+			failed++;
+	}
+	jnl_replaying = false;
+	return failed;
+}
+
+static void journal_reload_fn(struct work_struct *work)
+{
+	struct sepolicy_session sess;
+	ktime_t t0 = ktime_get();
+	int ret, failed;
+
+	ret = sepolicy_reattach();
+	if (ret <= 0) {
+		if (ret)
+			pr_err("[journal]: reattach after reload failed: %d\n",
+			       ret);
+		return;
+	}
+
+#ifdef CONFIG_NKSU_DEBUG
+	sepolicy_make_audit();
+#endif
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret) {
+		pr_err("[journal]: no policy to replay into: %d\n", ret);
+		return;
+	}
+	failed = sepolicy_journal_replay(&sess);
+#ifdef CONFIG_NKSU_DEBUG
+	do_allow(sess.pdb, DOMAIN);
+#endif
+	strscpy(sess.src, "reload", sizeof(sess.src));
+	ret = sepolicy_session_commit(&sess);
+	if (ret)
+		pr_err("[journal]: replay commit failed: %d\n", ret);
+	sepolicy_stats_phase(SEPOLICY_PHASE_REPLAY, t0);
+
+	pr_info("[journal]: replayed %u edit(s) after reload in %lld us, %d failed%s\n",
+		jnl_count, ktime_us_delta(ktime_get(), t0), failed,
+		jnl_dropped ? " (journal incomplete)" : "");
+}
+
+/*
+ * Runs under the loader's policy_mutex, so only kick the worker.  Our own
+ * commits end in avc_reset(), which raises the same event; those leave
+ * our working copy live and are ignored here.  A boolean change replaces
+ * the live shell too, but sepolicy_reattach() adopts that one as our
+ * working copy and returns 0, so only a full reload is replayed.
+ */
+static int journal_lsm_notify(struct notifier_block *nb, unsigned long event,
+			      void *data)
+{
+	if (event == LSM_POLICY_CHANGE && sepolicy_live_replaced())
+		schedule_work(&journal_reload_work);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block journal_lsm_nb = {
+	.notifier_call = journal_lsm_notify,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define nksu_register_lsm_notifier	register_blocking_lsm_notifier
+#define nksu_unregister_lsm_notifier	unregister_blocking_lsm_notifier
+#else
+#define nksu_register_lsm_notifier	register_lsm_notifier
+#define nksu_unregister_lsm_notifier	unregister_lsm_notifier
+#endif
+
+int sepolicy_journal_init(void)
+{
+	int ret = nksu_register_lsm_notifier(&journal_lsm_nb);
+
+	if (ret) {
+		pr_warn("[journal]: can't watch policy reloads: %d\n", ret);
+		return ret;
+	}
+	jnl_notifier_on = true;
+	return 0;
+}
+
+void sepolicy_journal_exit(void)
+{
+	struct jnl_op *op, *tmp;
+	struct jnl_name *n;
+	struct hlist_node *htmp;
+	int bkt;
+
+	if (jnl_notifier_on) {
+		nksu_unregister_lsm_notifier(&journal_lsm_nb);
+		jnl_notifier_on = false;
+	}
+	cancel_work_sync(&journal_reload_work);
+
+	mutex_lock(&selinux_state.policy_mutex);
+	list_for_each_entry_safe(op, tmp, &jnl_ops, list)
+		jnl_free_op(op);
+	hash_for_each_safe(jnl_names, bkt, htmp, n, node) {
+		hash_del(&n->node);
+		kfree(n);
+	}
+	jnl_npending = 0;
+	mutex_unlock(&selinux_state.policy_mutex);
+}
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <fmac.h>
+
+#include "ss/avtab.h"
+
+/*
+ * Apply a compiled patch (see selinux/patch.h) in one edit session: the
+ * whole buffer is validated up front, then every op goes through the
+ * session API under a single policy_mutex hold and one AVC flush.
+ */
+
+struct patch_ctx {
+	const char **strs;
+	u32 nstr;
+	const u8 *ops;
+	u32 ops_len;
+	u32 nops;
+};
+
+static size_t patch_op_size(const struct nksu_patch_op *op)
+{
+	return sizeof(*op) + op->nperm * sizeof(op->perm[0]);
+}
+
+static int patch_parse_strtab(struct patch_ctx *ctx, const char *tab,
+			      u32 len)
+{
+	u32 i, off = 0;
+	size_t n;
+
+	ctx->strs = kvmalloc_array(ctx->nstr, sizeof(*ctx->strs), GFP_KERNEL);
+	if (!ctx->strs)
+		return -ENOMEM;
+
+	for (i = 0; i < ctx->nstr; i++) {
+		if (off >= len)
+			return -EINVAL;
+		n = strnlen(tab + off, len - off);
+		if (off + n == len)
+			return -EINVAL;	/* unterminated */
+		ctx->strs[i] = tab + off;
+		off += n + 1;
+	}
+
+	return *ctx->strs[0] ? -EINVAL : 0;
+}
+
+static bool patch_id_ok(const struct patch_ctx *ctx, __le32 id)
+{
+	return le32_to_cpu(id) < ctx->nstr;
+}
+
+static int patch_check_ops(const struct patch_ctx *ctx)
+{
+	const struct nksu_patch_op *op;
+	u32 off = 0, n = 0, i;
+
+	while (off < ctx->ops_len) {
+		op = (const void *)(ctx->ops + off);
+		if (ctx->ops_len - off < sizeof(*op) ||
+		    ctx->ops_len - off < patch_op_size(op))
+			return -EINVAL;
+		if (op->code < NKSU_PATCH_ALLOW || op->code > NKSU_PATCH_TYPE)
+			return -EINVAL;
+		if (!patch_id_ok(ctx, op->src) || !patch_id_ok(ctx, op->tgt) ||
+		    !patch_id_ok(ctx, op->cls))
+			return -EINVAL;
+		for (i = 0; i < op->nperm; i++) {
+			if (!patch_id_ok(ctx, op->perm[i]))
+				return -EINVAL;
+		}
+		off += patch_op_size(op);
+		n++;
+	}
+
+	return n == ctx->nops ? 0 : -EINVAL;
+}
+
+static const char *patch_str(const struct patch_ctx *ctx, __le32 id)
+{
+	u32 i = le32_to_cpu(id);
+
+	return i ? ctx->strs[i] : NULL;
+}
+
+static void patch_effect(u8 code, int *effect, bool *invert)
+{
+	switch (code) {
+	case NKSU_PATCH_DENY:
+		*effect = AVTAB_ALLOWED;
+		*invert = true;
+		break;
+	case NKSU_PATCH_AUDITALLOW:
+		*effect = AVTAB_AUDITALLOW;
+		*invert = false;
+		break;
+	case NKSU_PATCH_DONTAUDIT:
+		*effect = AVTAB_AUDITDENY;
+		*invert = true;
+		break;
+	case NKSU_PATCH_XPERM:
+		*effect = AVTAB_XPERMS_ALLOWED;
+		*invert = false;
+		break;
+	default:
+		*effect = AVTAB_ALLOWED;
+		*invert = false;
+		break;
+	}
+}
+
+/* returns the number of failed edits within the op */
+static u32 patch_apply_op(struct sepolicy_session *sess,
+			  const struct patch_ctx *ctx,
+			  const struct nksu_patch_op *op)
+{
+	const char *s = patch_str(ctx, op->src);
+	const char *t = patch_str(ctx, op->tgt);
+	const char *c = patch_str(ctx, op->cls);
+	const char *p;
+	u32 i, n = max_t(u32, op->nperm, 1), failed = 0;
+	bool invert;
+	int effect;
+
+	switch (op->code) {
+	case NKSU_PATCH_TYPE:
+		return !!sepolicy_session_add_type(sess, s,
+						   op->flags & NKSU_PATCH_F_ATTR);
+	case NKSU_PATCH_TYPEATTR:
+		return !!sepolicy_session_add_typeattribute(sess, s, t);
+	}
+
+	patch_effect(op->code, &effect, &invert);
+	for (i = 0; i < n; i++) {
+		p = op->nperm ? patch_str(ctx, op->perm[i]) : NULL;
+		if (op->code == NKSU_PATCH_XPERM)
+			failed += !!sepolicy_session_add_xperm(sess, s, t, c, p,
+							       effect, invert);
+		else
+			failed += !!sepolicy_session_add_rule(sess, s, t, c, p,
+							      effect, invert);
+	}
+	return failed;
+}
+
+int sepolicy_apply_patch(const void *buf, size_t len,
+			 struct sepolicy_patch_result *res)
+{
+	const struct nksu_patch_hdr *hdr = buf;
+	struct sepolicy_session sess;
+	struct patch_ctx ctx = { };
+	const struct nksu_patch_op *op;
+	u32 strtab_len, off;
+	int ret;
+
+	memset(res, 0, sizeof(*res));
+
+	if (len < sizeof(*hdr) || le32_to_cpu(hdr->magic) != NKSU_PATCH_MAGIC)
+		return -EINVAL;
+	if (le16_to_cpu(hdr->version) != NKSU_PATCH_VERSION)
+		return -EPROTONOSUPPORT;
+
+	strtab_len  = le32_to_cpu(hdr->strtab_len);
+	ctx.nstr    = le32_to_cpu(hdr->nstr);
+	ctx.nops    = le32_to_cpu(hdr->nops);
+	ctx.ops_len = le32_to_cpu(hdr->ops_len);
+	/* every string takes at least its NUL: bounds the index allocation */
+	if (!ctx.nstr || ctx.nstr > strtab_len || strtab_len % 4 ||
+	    (u64)sizeof(*hdr) + strtab_len + ctx.ops_len != len)
+		return -EINVAL;
+	ctx.ops = (const u8 *)buf + sizeof(*hdr) + strtab_len;
+
+	ret = patch_parse_strtab(&ctx, (const char *)buf + sizeof(*hdr),
+				 strtab_len);
+	if (!ret)
+		ret = patch_check_ops(&ctx);
+	if (ret)
+		goto out;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		goto out;
+
+	for (off = 0; off < ctx.ops_len; off += patch_op_size(op)) {
+		op = (const void *)(ctx.ops + off);
+		res->failed += patch_apply_op(&sess, &ctx, op);
+		res->done++;
+	}
+
+	ret = sepolicy_session_commit(&sess);
+	pr_info("[selinux]: patch applied: %u op(s), %u failed edit(s), commit %d\n",
+		res->done, res->failed, ret);
+out:
+	kvfree(ctx.strs);
+	return ret;
+}
@@ -3,9 +3,11 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <fmac.h>
 
 #include "ss/avtab.h"
+#include "ss/policydb.h"
 #include "security.h"
 
 #define ALL NULL
@@ -84,7 +86,6 @@ static const struct sepolicy_rule ksu_rules[] = {
 
 };
 
-
 #define GROUP(_name, _rules, _required) \
 	{ .name = (_name), .rules = (_rules), \
 	  .count = ARRAY_SIZE(_rules), .required = (_required) }
@@ -93,27 +94,118 @@ static const struct sepolicy_group policy_groups[] = {
 	GROUP("ksu_rules", ksu_rules, true),
 };
 
-static int apply_group(const struct sepolicy_group *grp)
+/*
+ * Each group resolved against one policy generation, with rules on the
+ * same (src, tgt, class, effect) merged into one permission mask: every
+ * avtab node is written once, and re-applying against the same policy
+ * does no string lookups at all.  Protected by policy_mutex.
+ */
+struct group_cache {
+	u32 seqno;
+	u32 ntypes;
+	struct sepolicy_resolved_rule *rules;
+	size_t count;
+	int failed;		/* rules that did not resolve */
+};
+
+static struct group_cache group_caches[ARRAY_SIZE(policy_groups)];
+
+static bool resolved_same_key(const struct sepolicy_resolved_rule *a,
+			      const struct sepolicy_resolved_rule *b)
 {
-	size_t i;
-	int ret;
-	int failed = 0;
+	return a->src == b->src && a->tgt == b->tgt && a->cls == b->cls &&
+	       a->effect == b->effect && a->invert == b->invert;
+}
+
+static int group_resolve(struct sepolicy_session *sess,
+			 const struct sepolicy_group *grp,
+			 struct group_cache *gc)
+{
+	struct sepolicy_resolved_rule *out, r;
+	size_t i, j, n = 0, run = 0;
+	bool kind = false, rev;
+	int ret, failed = 0;
+
+	out = kvcalloc(grp->count, sizeof(*out), GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
 
 	for (i = 0; i < grp->count; i++) {
-		const struct sepolicy_rule *r = &grp->rules[i];
+		const struct sepolicy_rule *rule = &grp->rules[i];
 
-		ret = sepolicy_add_rule(r->src, r->tgt, r->cls, r->perm,
-					r->effect, r->invert);
+		r = (struct sepolicy_resolved_rule) {
+			.effect = rule->effect,
+			.invert = rule->invert,
+		};
+		ret = sepolicy_session_resolve_rule(sess, rule->src, rule->tgt,
+						    rule->cls, rule->perm, &r);
 		if (ret) {
 			pr_warn("[selinux:%s]: %s %s:%s %s -> err %d (skipped)\n",
 				grp->name,
-				r->src  ? r->src  : "*",
-				r->tgt  ? r->tgt  : "*",
-				r->cls  ? r->cls  : "*",
-				r->perm ? r->perm : "*",
+				rule->src  ? rule->src  : "*",
+				rule->tgt  ? rule->tgt  : "*",
+				rule->cls  ? rule->cls  : "*",
+				rule->perm ? rule->perm : "*",
 				ret);
 			failed++;
+			continue;
+		}
+
+		/* setting and clearing bits don't commute: merge within a run */
+		rev = sepolicy_rule_is_reverting(r.effect, r.invert);
+		if (n && rev != kind)
+			run = n;
+		kind = rev;
+
+		for (j = run; j < n; j++) {
+			if (resolved_same_key(&out[j], &r)) {
+				out[j].mask |= r.mask;
+				break;
+			}
 		}
+		if (j == n)
+			out[n++] = r;
+	}
+
+	kvfree(gc->rules);
+	gc->rules  = out;
+	gc->count  = n;
+	gc->failed = failed;
+	gc->seqno  = sepolicy_policy_seqno(sess->pdb);
+	gc->ntypes = sess->pdb->p_types.nprim;
+	return 0;
+}
+
+static struct group_cache *group_cache_get(struct sepolicy_session *sess,
+					   const struct sepolicy_group *grp)
+{
+	struct group_cache *gc = &group_caches[grp - policy_groups];
+	int ret;
+
+	if (!gc->rules || gc->seqno != sepolicy_policy_seqno(sess->pdb) ||
+	    gc->ntypes != sess->pdb->p_types.nprim) {
+		ret = group_resolve(sess, grp, gc);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+	return gc;
+}
+
+static int apply_group(struct sepolicy_session *sess,
+		       const struct sepolicy_group *grp)
+{
+	struct group_cache *gc;
+	size_t i;
+	int failed;
+
+	gc = group_cache_get(sess, grp);
+	if (IS_ERR(gc))
+		return PTR_ERR(gc);
+
+	failed = gc->failed;
+	for (i = 0; i < gc->count; i++) {
+		if (sepolicy_session_apply_resolved(sess, &gc->rules[i]))
+			failed++;
 	}
 
 	if (failed) {
@@ -123,41 +215,67 @@ static int apply_group(const struct sepolicy_group *grp)
 			return -ENOEXEC;
 	}
 
-	pr_info("[selinux:%s]: %zu/%zu rule(s) applied\n",
-		grp->name, grp->count - failed, grp->count);
+	pr_info("[selinux:%s]: %zu/%zu rule(s) applied as %zu avtab edit(s)\n",
+		grp->name, grp->count - failed, grp->count, gc->count);
 	return 0;
 }
 
-int load_policy(void)
+/* caller holds a session; returns the number of groups with failures */
+int sepolicy_apply_groups(struct sepolicy_session *sess)
 {
 	size_t i;
-	int ret;
 	int failed_groups = 0;
 
+	for (i = 0; i < ARRAY_SIZE(policy_groups); i++) {
+		if (apply_group(sess, &policy_groups[i]))
+			failed_groups++;
+	}
+	/*
+	 * Never pending: if a reload drops a staged build, replaying the
+	 * groups into the new policy is exactly what should happen.
+	 */
+	sepolicy_journal_record(JNL_GROUPS, NULL, NULL, NULL, NULL, 0, false,
+				0);
+	return failed_groups;
+}
+
+int load_policy(void)
+{
+	struct sepolicy_session sess;
+	int ret;
+	int failed_groups;
+
 	pr_info("[selinux]: loading policy for domain '%s'\n", DOMAIN);
 
-	sepolicy_add_typeattribute(DOMAIN, "mlstrustedsubject");
-	sepolicy_add_typeattribute(DOMAIN, "unconfineddomain");
-	sepolicy_add_typeattribute(DOMAIN, "netdomain");
-	sepolicy_add_typeattribute(DOMAIN, "bluetoothdomain");
+	/* all of the below is one edit session: one AVC flush at the end */
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+
+	sepolicy_session_add_typeattribute(&sess, DOMAIN, "mlstrustedsubject");
+	sepolicy_session_add_typeattribute(&sess, DOMAIN, "unconfineddomain");
+	sepolicy_session_add_typeattribute(&sess, DOMAIN, "netdomain");
+	sepolicy_session_add_typeattribute(&sess, DOMAIN, "bluetoothdomain");
 
-	ret = sepolicy_allow_any_any(DOMAIN);
+	ret = sepolicy_session_allow_any_any(&sess, DOMAIN);
 	if (ret)
 		pr_warn("[selinux]: allow-any-any for '%s' failed: %d\n", DOMAIN, ret);
 
-		sepolicy_add_xperm(DOMAIN, ALL, "blk_file",  NULL,
-				   AVTAB_XPERMS_ALLOWED, false);
-		sepolicy_add_xperm(DOMAIN, ALL, "fifo_file", NULL,
-				   AVTAB_XPERMS_ALLOWED, false);
-		sepolicy_add_xperm(DOMAIN, ALL, "chr_file",  NULL,
-				   AVTAB_XPERMS_ALLOWED, false);
-		sepolicy_add_xperm(DOMAIN, ALL, "file",      NULL,
-				   AVTAB_XPERMS_ALLOWED, false);
+		sepolicy_session_add_xperm(&sess, DOMAIN, ALL, "blk_file",  NULL,
+					   AVTAB_XPERMS_ALLOWED, false);
+		sepolicy_session_add_xperm(&sess, DOMAIN, ALL, "fifo_file", NULL,
+					   AVTAB_XPERMS_ALLOWED, false);
+		sepolicy_session_add_xperm(&sess, DOMAIN, ALL, "chr_file",  NULL,
+					   AVTAB_XPERMS_ALLOWED, false);
+		sepolicy_session_add_xperm(&sess, DOMAIN, ALL, "file",      NULL,
+					   AVTAB_XPERMS_ALLOWED, false);
 
-	for (i = 0; i < ARRAY_SIZE(policy_groups); i++) {
-		ret = apply_group(&policy_groups[i]);
-		if (ret)
-			failed_groups++;
+	failed_groups = sepolicy_apply_groups(&sess);
+
+	ret = sepolicy_session_commit(&sess);
+	if (ret) {
+		pr_err("[selinux]: policy commit failed: %d\n", ret);
+		return ret;
 	}
 
 	if (failed_groups) {
@@ -184,5 +302,13 @@ int __init sepolicy_init(void)
 
 void __exit sepolicy_exit(void)
 {
+	size_t i;
+
 	pr_info("[selinux]: sepolicy exit\n");
+	mutex_lock(&selinux_state.policy_mutex);
+	for (i = 0; i < ARRAY_SIZE(group_caches); i++) {
+		kvfree(group_caches[i].rules);
+		group_caches[i].rules = NULL;
+	}
+	mutex_unlock(&selinux_state.policy_mutex);
 }
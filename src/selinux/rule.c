@@ -5,6 +5,9 @@
 #include <fmac.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
 
 #include "ss/policydb.h"
 #include "ss/services.h"
@@ -17,12 +20,6 @@
 #include "ss/hashtab.h"
 #include "ss/constraint.h"
 
-#ifndef hashtab_for_each
-#define hashtab_for_each(h, node) \
-	for (int i = 0; i < (h).size; i++) \
-		for (node = (h).htable[i]; node; node = node->next)
-#endif
-
 static struct policydb *fmac_get_pdb(void)
 {
 	if (!selinux_state.policy)
@@ -46,184 +43,387 @@ void avc_reset(void)
 	selinux_xfrm_notify_policyload();
 }
 
-static int collect_concrete_types(struct policydb *pdb,
-				  struct type_datum ***out)
+static void sepolicy_edited(const char *src)
 {
-	struct hashtab_node *node;
-	struct type_datum **arr;
-	int count = 0, i = 0;
+	avc_reset();
+	fmac_event_emit(FMAC_EV_POLICY, current_uid().val, 0, src);
+}
+
+/*
+ * Dense, value-ordered views of the concrete types and the classes, built
+ * from type_val_to_struct/class_val_to_struct and kept until the policy,
+ * its load generation or its type/class count changes.  Protected by
+ * policy_mutex, so every edit in a session shares one build.
+ */
+struct policy_iter_cache {
+	struct policydb *pdb;
+	u32 seqno;
+	u32 types_nprim;
+	u32 classes_nprim;
+	struct type_datum **types;
+	u32 ntypes;
+	struct class_datum **classes;
+	u32 nclasses;
+};
+
+static struct policy_iter_cache iter_cache;
+
+static u32 policy_seqno(struct policydb *pdb)
+{
+	return container_of(pdb, struct selinux_policy, policydb)->latest_granting;
+}
+
+void sepolicy_iter_cache_drop(void)
+{
+	kvfree(iter_cache.types);
+	kvfree(iter_cache.classes);
+	memset(&iter_cache, 0, sizeof(iter_cache));
+}
+
+static struct policy_iter_cache *policy_iter_get(struct policydb *pdb)
+{
+	struct policy_iter_cache *c = &iter_cache;
+	u32 i, nt = pdb->p_types.nprim, nc = pdb->p_classes.nprim;
+
+	if (c->pdb == pdb && c->seqno == policy_seqno(pdb) &&
+	    c->types_nprim == nt && c->classes_nprim == nc)
+		return c;
 
-	hashtab_for_each(pdb->p_types.table, node) {
-		struct type_datum *t = node->datum;
+	sepolicy_iter_cache_drop();
 
-		if (!t->attribute)
-			count++;
+	c->types = kvmalloc_array(nt, sizeof(*c->types), GFP_KERNEL);
+	c->classes = kvmalloc_array(nc, sizeof(*c->classes), GFP_KERNEL);
+	if (!c->types || !c->classes) {
+		sepolicy_iter_cache_drop();
+		return NULL;
 	}
 
-	if (!count) {
-		*out = NULL;
-		return 0;
+	for (i = 0; i < nt; i++) {
+		struct type_datum *t = pdb->type_val_to_struct[i];
+
+		if (t && !t->attribute)
+			c->types[c->ntypes++] = t;
+	}
+	for (i = 0; i < nc; i++) {
+		if (pdb->class_val_to_struct[i])
+			c->classes[c->nclasses++] = pdb->class_val_to_struct[i];
 	}
 
-	arr = kmalloc_array(count, sizeof(*arr), GFP_KERNEL);
-	if (!arr)
-		return -ENOMEM;
+	c->pdb = pdb;
+	c->seqno = policy_seqno(pdb);
+	c->types_nprim = nt;
+	c->classes_nprim = nc;
+	return c;
+}
 
-	hashtab_for_each(pdb->p_types.table, node) {
-		struct type_datum *t = node->datum;
+#define RULE_NODE_LEN	(sizeof(struct avtab_key) + sizeof(struct avtab_datum))
+#define XPERM_NODE_LEN	(RULE_NODE_LEN + sizeof(u8) + sizeof(u8) + \
+			 sizeof(u32) * 8)
+
+/* how a rule edit reaches each node it expands to */
+enum rule_edit {
+	RULE_EDIT_ADD,
+	RULE_EDIT_AGAIN,	/* an add whose rule already holds refs */
+	RULE_EDIT_REMOVE,	/* take back an earlier add */
+};
+
+/*
+ * Set (or clear, when invert) @mask in @key's node of @h, inserting it if
+ * needed.  Returns 1 if a node was inserted, 0 if one was updated.
+ */
+static int avtab_write(struct avtab *h, struct avtab_key *key,
+		       u32 mask, bool invert, bool again)
+{
+	struct avtab_node *av_node;
+	struct avtab_datum datum;
+	int inserted = 0;
 
-		if (!t->attribute && i < count)
-			arr[i++] = t;
+	av_node = avtab_search_node(h, key);
+	if (!av_node) {
+		memset(&datum, 0, sizeof(datum));
+		datum.u.data = (key->specified == AVTAB_AUDITDENY) ? ~0U : 0U;
+		av_node = avtab_insert_nonunique(h, key, &datum);
+		if (!av_node)
+			return -ENOMEM;
+		sepolicy_stats_node(sizeof(*av_node));
+		inserted = 1;
 	}
 
-	*out = arr;
-	return i;
+	sepolicy_rule_refs_note(key, inserted, av_node->datum.u.data, mask,
+				invert, again);
+	if (invert)
+		av_node->datum.u.data &= ~mask;
+	else
+		av_node->datum.u.data |= mask;
+	return inserted;
 }
 
-static int collect_classes(struct policydb *pdb,
-			   struct class_datum ***out)
+static void session_unlink(struct sepolicy_session *sess, struct avtab *h,
+			   struct avtab_node *node)
 {
-	struct hashtab_node *node;
-	struct class_datum **arr;
-	int count = 0, i = 0;
+	struct avtab_node **dead;
+	u32 cap;
+
+	if (sess->ndead == sess->dead_cap) {
+		cap = sess->dead_cap ? sess->dead_cap * 2 : 16;
+		dead = _nksu_kvrealloc(sess->dead, cap * sizeof(*dead),
+				       sess->dead_cap * sizeof(*dead));
+		if (!dead) {
+			/* keep the node, holding nothing */
+			node->datum.u.data = node->key.specified ==
+					     AVTAB_AUDITDENY ? ~0U : 0U;
+			return;
+		}
+		sess->dead = dead;
+		sess->dead_cap = cap;
+	}
+	sepolicy_avtab_unlink(h, node);
+	sess->dead[sess->ndead++] = node;
+}
 
-	hashtab_for_each(pdb->p_classes.table, node)
-		count++;
+/*
+ * Drop one reference per bit of @mask on @key's node in @h.  Bits nothing
+ * else holds go back to what the node had before nksu wrote it, and a
+ * node nksu inserted is unlinked.  Returns 1 if it was.
+ */
+static int avtab_release(struct sepolicy_session *sess, struct avtab *h,
+			 struct avtab_key *key, u32 mask)
+{
+	struct sepolicy_rule_release rel;
+	struct avtab_node *node;
+	u32 ndead = sess->ndead;
 
-	if (!count) {
-		*out = NULL;
+	if (!sepolicy_rule_refs_put(key, mask, &rel))
+		return 0;
+	node = avtab_search_node(h, key);
+	if (!node)
 		return 0;
+
+	if (rel.drop) {
+		session_unlink(sess, h, node);
+		return sess->ndead > ndead;
 	}
+	node->datum.u.data = (node->datum.u.data & ~rel.clear) | rel.set;
+	return 0;
+}
 
-	arr = kmalloc_array(count, sizeof(*arr), GFP_KERNEL);
-	if (!arr)
-		return -ENOMEM;
+/* one node's share of a rule edit, or of taking one back */
+static int avtab_edit(struct sepolicy_session *sess, struct avtab *h,
+		      struct avtab_key *key, u32 mask, bool invert,
+		      enum rule_edit edit)
+{
+	struct policydb *pdb = sess->pdb;
+	bool remove = edit == RULE_EDIT_REMOVE;
+	int ret;
 
-	hashtab_for_each(pdb->p_classes.table, node) {
-		if (i < count)
-			arr[i++] = node->datum;
+	/* most keys a wildcard removal expands to were never ours */
+	if (remove && !sepolicy_rule_refs_tracked(key))
+		return 0;
+	if (h == &pdb->te_avtab) {
+		ret = sepolicy_cow_avtab_key(pdb, key);
+		if (ret)
+			return ret;
 	}
 
-	*out = arr;
-	return i;
+	if (remove) {
+		if (avtab_release(sess, h, key, mask))
+			pdb->len -= RULE_NODE_LEN;
+		return 0;
+	}
+
+	ret = avtab_write(h, key, mask, invert, edit == RULE_EDIT_AGAIN);
+	if (ret < 0)
+		return ret;
+	if (ret)
+		pdb->len += RULE_NODE_LEN;
+	return 0;
 }
 
-static void avtab_apply_one(struct policydb *pdb,
-			    struct type_datum *src,
-			    struct type_datum *tgt,
-			    struct class_datum *cls,
-			    int perm_value, int effect, bool invert)
+/* mask: permission bits to set, or clear when invert; ~0 for all */
+static int avtab_apply_one(struct sepolicy_session *sess,
+			   struct type_datum *src,
+			   struct type_datum *tgt,
+			   struct class_datum *cls,
+			   u32 mask, int effect, bool invert,
+			   enum rule_edit edit)
 {
 	struct avtab_key key;
-	struct avtab_node *av_node;
-	struct avtab_datum datum;
 
 	key.source_type  = src->value;
 	key.target_type  = tgt->value;
 	key.target_class = cls->value;
 	key.specified    = effect;
 
-	av_node = avtab_search_node(&pdb->te_avtab, &key);
-	if (!av_node) {
-		memset(&datum, 0, sizeof(datum));
-		datum.u.data = (effect == AVTAB_AUDITDENY) ? ~0U : 0U;
-		av_node = avtab_insert_nonunique(&pdb->te_avtab, &key, &datum);
-		if (av_node)
-			pdb->len += sizeof(struct avtab_key)
-				  + sizeof(struct avtab_datum);
-	}
-
-	if (av_node) {
-		if (perm_value) {
-			if (invert)
-				av_node->datum.u.data &= ~(1U << (perm_value - 1));
-			else
-				av_node->datum.u.data |=  (1U << (perm_value - 1));
-		} else {
-			av_node->datum.u.data = invert ? 0U : ~0U;
-		}
+	return avtab_edit(sess, &sess->pdb->te_avtab, &key, mask, invert,
+			  edit);
+}
+
+/*
+ * The kernel ORs allowed/auditallow data over every attribute pair a type
+ * pair maps to and ANDs auditdeny, so one node against the all-types
+ * attribute is equivalent to the per-type expansion only for grants and
+ * for clearing auditdeny bits.  Revocations still expand per type.
+ */
+static bool wildcard_attr_ok(int effect, bool invert)
+{
+	switch (effect) {
+	case AVTAB_ALLOWED:
+	case AVTAB_AUDITALLOW:
+	case AVTAB_XPERMS_ALLOWED:
+		return !invert;
+	case AVTAB_AUDITDENY:
+		return invert;
+	default:
+		return false;
 	}
 }
 
-static void sepolicy_add_rule_raw(struct policydb *pdb,
-				  struct type_datum *src,
-				  struct type_datum *tgt,
-				  struct class_datum *cls,
-				  int perm_value, int effect, bool invert)
+/*
+ * Expansions writing at least STAGE_MIN_NODES nodes are not applied in
+ * place: the session stages them, and commit writes them into a private
+ * te_avtab STAGE_CHUNK_NODES at a time.  Once a session has staged an
+ * edit, later rule and xperm edits are staged behind it so they still
+ * apply in order.
+ */
+#define STAGE_MIN_NODES		4096
+#define STAGE_CHUNK_NODES	1024
+
+struct sepolicy_stage_op {
+	struct sepolicy_resolved_rule r;
+	u16 low;		/* xperm ioctl range */
+	u16 high;
+	bool xperm;
+	u8 edit;		/* enum rule_edit */
+};
+
+static int stage_add(struct sepolicy_session *sess,
+		     const struct sepolicy_stage_op *op, u64 nodes)
 {
-	struct type_datum  **types   = NULL;
-	struct class_datum **classes = NULL;
-	int ntypes = 0, nclasses = 0;
+	struct sepolicy_stage_op *ops;
+	u32 cap;
+
+	if (sess->nstaged == sess->staged_cap) {
+		cap = sess->staged_cap ? sess->staged_cap * 2 : 8;
+		ops = _nksu_kvrealloc(sess->staged, cap * sizeof(*ops),
+				      sess->staged_cap * sizeof(*ops));
+		if (!ops)
+			return -ENOMEM;
+		sess->staged = ops;
+		sess->staged_cap = cap;
+	}
+	/* from here on, reference notes can be taken back at commit */
+	if (!sess->nstaged)
+		sepolicy_rule_refs_mark();
+	sess->staged[sess->nstaged++] = *op;
+	sess->staged_nodes += nodes;
+	return 0;
+}
+
+/* stage a wildcard edit if it is wide enough, or if earlier ones were */
+static bool stage_maybe(struct sepolicy_session *sess,
+			const struct sepolicy_stage_op *op, u64 nodes)
+{
+	if (!sess->nstaged && nodes < STAGE_MIN_NODES)
+		return false;
+	/* no memory to defer it: apply it in place after all */
+	return !stage_add(sess, op, nodes);
+}
+
+static int rule_edit_raw(struct sepolicy_session *sess,
+			 struct type_datum *src,
+			 struct type_datum *tgt,
+			 struct class_datum *cls,
+			 u32 mask, int effect, bool invert,
+			 enum rule_edit edit)
+{
+	struct policydb *pdb = sess->pdb;
+	struct policy_iter_cache *it;
+	struct sepolicy_stage_op op;
 	int src_n, tgt_n, cls_n;
-	int i, j, k;
+	int i, j, k, ret;
 
-	if (src && tgt && cls) {
-		avtab_apply_one(pdb, src, tgt, cls, perm_value, effect, invert);
-		return;
-	}
+	if ((!src || !tgt) && wildcard_attr_ok(effect, invert)) {
+		struct type_datum *all = sepolicy_all_types_attr(sess);
 
-	if (!src || !tgt) {
-		ntypes = collect_concrete_types(pdb, &types);
-		if (ntypes < 0)
-			return;
-	}
-	if (!cls) {
-		nclasses = collect_classes(pdb, &classes);
-		if (nclasses < 0) {
-			kfree(types);
-			return;
+		if (IS_ERR(all))
+			return PTR_ERR(all);
+		if (all) {
+			src = src ? src : all;
+			tgt = tgt ? tgt : all;
 		}
 	}
 
-	src_n = src ? 1 : ntypes;
-	tgt_n = tgt ? 1 : ntypes;
-	cls_n = cls ? 1 : nclasses;
+	if (src && tgt && cls && !sess->nstaged)
+		return avtab_apply_one(sess, src, tgt, cls, mask, effect,
+				       invert, edit);
+
+	it = policy_iter_get(pdb);
+	if (!it)
+		return -ENOMEM;
+
+	src_n = src ? 1 : it->ntypes;
+	tgt_n = tgt ? 1 : it->ntypes;
+	cls_n = cls ? 1 : it->nclasses;
+
+	op = (struct sepolicy_stage_op) {
+		.r = {
+			.src	= src ? src->value : 0,
+			.tgt	= tgt ? tgt->value : 0,
+			.cls	= cls ? cls->value : 0,
+			.mask	= mask,
+			.effect	= effect,
+			.invert	= invert,
+		},
+		.edit	= edit,
+	};
+	if (stage_maybe(sess, &op, (u64)src_n * tgt_n * cls_n))
+		return 0;
 
 	for (i = 0; i < src_n; i++) {
-		struct type_datum *s = src ? src : types[i];
+		struct type_datum *s = src ? src : it->types[i];
 
 		for (j = 0; j < tgt_n; j++) {
-			struct type_datum *t = tgt ? tgt : types[j];
-
-			if (cls) {
-				avtab_apply_one(pdb, s, t, cls,
-						perm_value, effect, invert);
-			} else {
-				for (k = 0; k < cls_n; k++)
-					avtab_apply_one(pdb, s, t, classes[k],
-							perm_value, effect, invert);
+			struct type_datum *t = tgt ? tgt : it->types[j];
+
+			for (k = 0; k < cls_n; k++) {
+				ret = avtab_apply_one(sess, s, t,
+						      cls ? cls : it->classes[k],
+						      mask, effect, invert,
+						      edit);
+				if (ret)
+					return ret;
 			}
 		}
+		cond_resched();
 	}
+	return 0;
+}
 
-	kfree(types);
-	kfree(classes);
+static int sepolicy_add_rule_raw(struct sepolicy_session *sess,
+				 struct type_datum *src,
+				 struct type_datum *tgt,
+				 struct class_datum *cls,
+				 u32 mask, int effect, bool invert)
+{
+	return rule_edit_raw(sess, src, tgt, cls, mask, effect, invert,
+			     RULE_EDIT_ADD);
 }
 
-int sepolicy_add_rule(const char *sname, const char *tname,
-		      const char *cname, const char *pname,
-		      int effect, bool invert)
+/* names to values and a permission mask; a NULL or empty name is "any" */
+static int resolve_rule_locked(struct policydb *pdb,
+			       const char *sname, const char *tname,
+			       const char *cname, const char *pname,
+			       struct sepolicy_resolved_rule *r)
 {
-	struct policydb *pdb;
 	struct type_datum *src = NULL, *tgt = NULL;
 	struct class_datum *cls = NULL;
 	struct perm_datum *perm = NULL;
-	int ret = 0;
-
-	mutex_lock(&selinux_state.policy_mutex);
-
-	pdb = fmac_get_pdb();
-	if (!pdb) {
-		ret = -ENOENT;
-		goto out;
-	}
 
 	if (sname && *sname) {
 		src = symtab_search(&pdb->symtab[SYM_TYPES], sname);
 		if (!src) {
 			pr_warn("[selinux]: source type '%s' not found\n", sname);
-			ret = -ENOENT;
-			goto out;
+			return -ENOENT;
 		}
 	}
 
@@ -231,8 +431,7 @@ int sepolicy_add_rule(const char *sname, const char *tname,
 		tgt = symtab_search(&pdb->symtab[SYM_TYPES], tname);
 		if (!tgt) {
 			pr_warn("[selinux]: target type '%s' not found\n", tname);
-			ret = -ENOENT;
-			goto out;
+			return -ENOENT;
 		}
 	}
 
@@ -240,16 +439,14 @@ int sepolicy_add_rule(const char *sname, const char *tname,
 		cls = symtab_search(&pdb->symtab[SYM_CLASSES], cname);
 		if (!cls) {
 			pr_warn("[selinux]: class '%s' not found\n", cname);
-			ret = -ENOENT;
-			goto out;
+			return -ENOENT;
 		}
 	}
 
 	if (pname && *pname) {
 		if (!cls) {
 			pr_warn("[selinux]: perm specified without class\n");
-			ret = -EINVAL;
-			goto out;
+			return -EINVAL;
 		}
 		perm = symtab_search(&cls->permissions, pname);
 		if (!perm && cls->comdatum)
@@ -257,34 +454,66 @@ int sepolicy_add_rule(const char *sname, const char *tname,
 		if (!perm) {
 			pr_warn("[selinux]: perm '%s' not found in class '%s'\n",
 				pname, cname);
-			ret = -ENOENT;
-			goto out;
+			return -ENOENT;
 		}
 	}
 
-	sepolicy_add_rule_raw(pdb, src, tgt, cls,
-			      perm ? (int)perm->value : 0, effect, invert);
-out:
-	mutex_unlock(&selinux_state.policy_mutex);
-	if (ret == 0)
-		avc_reset();
-	return ret;
+	r->src  = src ? src->value : 0;
+	r->tgt  = tgt ? tgt->value : 0;
+	r->cls  = cls ? cls->value : 0;
+	r->mask = perm ? BIT(perm->value - 1) : ~0U;
+	return 0;
 }
 
-int sepolicy_allow_all_types(const char *sname, const char *cname)
+static int apply_resolved_locked(struct sepolicy_session *sess,
+				 const struct sepolicy_resolved_rule *r,
+				 enum rule_edit edit)
 {
-	struct policydb *pdb;
-	struct type_datum *src = NULL;
+	struct policydb *pdb = sess->pdb;
+	struct type_datum *src = NULL, *tgt = NULL;
 	struct class_datum *cls = NULL;
-	int ret = 0;
 
-	mutex_lock(&selinux_state.policy_mutex);
+	if (r->src > pdb->p_types.nprim || r->tgt > pdb->p_types.nprim ||
+	    r->cls > pdb->p_classes.nprim)
+		return -EINVAL;
 
-	pdb = fmac_get_pdb();
-	if (!pdb) {
-		ret = -ENOENT;
-		goto out;
-	}
+	if (r->src)
+		src = pdb->type_val_to_struct[r->src - 1];
+	if (r->tgt)
+		tgt = pdb->type_val_to_struct[r->tgt - 1];
+	if (r->cls)
+		cls = pdb->class_val_to_struct[r->cls - 1];
+	if ((r->src && !src) || (r->tgt && !tgt) || (r->cls && !cls))
+		return -ENOENT;
+
+	return rule_edit_raw(sess, src, tgt, cls, r->mask, r->effect,
+			     r->invert, edit);
+}
+
+static int add_rule_locked(struct sepolicy_session *sess,
+			   const char *sname, const char *tname,
+			   const char *cname, const char *pname,
+			   int effect, bool invert, enum rule_edit edit)
+{
+	struct sepolicy_resolved_rule r = {
+		.effect = effect,
+		.invert = invert,
+	};
+	int ret;
+
+	ret = resolve_rule_locked(sess->pdb, sname, tname, cname, pname, &r);
+	if (ret)
+		return ret;
+	return apply_resolved_locked(sess, &r, edit);
+}
+
+static int allow_all_types_locked(struct sepolicy_session *sess,
+				  const char *sname, const char *cname)
+{
+	struct policydb *pdb = sess->pdb;
+	struct type_datum *src = NULL;
+	struct class_datum *cls = NULL;
+	int ret = 0;
 
 	if (sname) {
 		src = symtab_search(&pdb->symtab[SYM_TYPES], sname);
@@ -304,32 +533,27 @@ int sepolicy_allow_all_types(const char *sname, const char *cname)
 		}
 	}
 
-	sepolicy_add_rule_raw(pdb, src, NULL, cls, 0, AVTAB_ALLOWED,   false);
-	sepolicy_add_rule_raw(pdb, src, NULL, cls, 0, AVTAB_AUDITDENY, true);
+	ret = sepolicy_add_rule_raw(sess, src, NULL, cls, ~0U, AVTAB_ALLOWED,
+				    false);
+	if (!ret)
+		ret = sepolicy_add_rule_raw(sess, src, NULL, cls, ~0U,
+					    AVTAB_AUDITDENY, true);
+	if (ret)
+		goto out;
 
 	pr_info("[selinux]: granted '%s' all perms to all types over class '%s'\n",
 		sname ? sname : "*", cname ? cname : "*");
 out:
-	mutex_unlock(&selinux_state.policy_mutex);
-	if (ret == 0)
-		avc_reset();
 	return ret;
 }
 
-int sepolicy_allow_any_any(const char *sname)
+static int allow_any_any_locked(struct sepolicy_session *sess,
+				const char *sname)
 {
-	struct policydb *pdb;
+	struct policydb *pdb = sess->pdb;
 	struct type_datum *src = NULL;
 	int ret = 0;
 
-	mutex_lock(&selinux_state.policy_mutex);
-
-	pdb = fmac_get_pdb();
-	if (!pdb) {
-		ret = -ENOENT;
-		goto out;
-	}
-
 	if (sname) {
 		src = symtab_search(&pdb->symtab[SYM_TYPES], sname);
 		if (!src) {
@@ -339,48 +563,213 @@ int sepolicy_allow_any_any(const char *sname)
 		}
 	}
 
-	sepolicy_add_rule_raw(pdb, src, NULL, NULL, 0, AVTAB_ALLOWED,   false);
-	sepolicy_add_rule_raw(pdb, src, NULL, NULL, 0, AVTAB_AUDITDENY, true);
+	ret = sepolicy_add_rule_raw(sess, src, NULL, NULL, ~0U, AVTAB_ALLOWED,
+				    false);
+	if (!ret)
+		ret = sepolicy_add_rule_raw(sess, src, NULL, NULL, ~0U,
+					    AVTAB_AUDITDENY, true);
+	if (ret)
+		goto out;
 
 	pr_info("[selinux]: '%s' elevated to any-any allow\n",
 		sname ? sname : "*");
 out:
-	mutex_unlock(&selinux_state.policy_mutex);
-	if (ret == 0)
-		avc_reset();
 	return ret;
 }
 
-static void sepolicy_add_typeattribute_raw(struct policydb *pdb,
-					   struct type_datum *type_dat,
-					   struct type_datum *attr_dat)
+/* does any constraint of @cls name @attr without already naming @type? */
+static bool class_names_attr(struct class_datum *cls,
+			     struct type_datum *type_dat,
+			     struct type_datum *attr_dat)
 {
-	struct hashtab_node *node;
 	struct constraint_node *n;
 	struct constraint_expr *e;
 
-	ebitmap_set_bit(&pdb->type_attr_map_array[type_dat->value - 1],
-			attr_dat->value - 1, 1);
+	for (n = cls->constraints; n; n = n->next) {
+		for (e = n->expr; e; e = e->next) {
+			if (e->expr_type == CEXPR_NAMES && e->type_names &&
+			    ebitmap_get_bit(&e->type_names->types,
+					    attr_dat->value - 1) &&
+			    !ebitmap_get_bit(&e->names, type_dat->value - 1))
+				return true;
+		}
+	}
+	return false;
+}
 
-	hashtab_for_each(pdb->p_classes.table, node) {
-		struct class_datum *cls = (struct class_datum *)node->datum;
+/*
+ * Attribute value -> the CEXPR_NAMES expressions whose type set names it,
+ * built on first use for a policy generation.  Copy-on-write replaces a
+ * class's expressions with clones, so a reference is (class value,
+ * position of the expression in that class's constraint walk) rather
+ * than a pointer.  Refs are grouped per attribute in class order, in one
+ * flat array indexed by attr_start[].  Protected by policy_mutex.
+ */
+struct attr_expr_ref {
+	u32 cls;
+	u32 ord;
+};
+
+struct attr_expr_index {
+	u32 seqno;
+	u32 nattr;		/* p_types.nprim at build; later types have none */
+	u32 nclasses;
+	u32 *attr_start;	/* nattr + 1 offsets into refs */
+	struct attr_expr_ref *refs;
+};
+
+static struct attr_expr_index attr_index;
+
+void sepolicy_attr_index_drop(void)
+{
+	kvfree(attr_index.attr_start);
+	kvfree(attr_index.refs);
+	memset(&attr_index, 0, sizeof(attr_index));
+}
 
+/* count refs per attribute into count[], or with @refs, store them */
+static void attr_index_walk(struct policydb *pdb, u32 *count,
+			    struct attr_expr_ref *refs, u32 *next)
+{
+	struct constraint_node *n;
+	struct constraint_expr *e;
+	struct ebitmap_node *enode;
+	struct class_datum *cls;
+	u32 c, ord, bit;
+
+	for (c = 0; c < pdb->p_classes.nprim; c++) {
+		cls = pdb->class_val_to_struct[c];
+		if (!cls)
+			continue;
+		ord = 0;
 		for (n = cls->constraints; n; n = n->next) {
-			for (e = n->expr; e; e = e->next) {
-				if (e->expr_type == CEXPR_NAMES && e->type_names &&
-				    ebitmap_get_bit(&e->type_names->types,
-						    attr_dat->value - 1)) {
-					ebitmap_set_bit(&e->names,
-							type_dat->value - 1, 1);
+			for (e = n->expr; e; e = e->next, ord++) {
+				if (e->expr_type != CEXPR_NAMES ||
+				    !e->type_names)
+					continue;
+				ebitmap_for_each_positive_bit(&e->type_names->types,
+							      enode, bit) {
+					if (bit >= attr_index.nattr)
+						break;
+					if (!refs) {
+						count[bit]++;
+						continue;
+					}
+					refs[next[bit]++] = (struct attr_expr_ref) {
+						.cls = c + 1,
+						.ord = ord,
+					};
 				}
 			}
 		}
 	}
 }
 
-int sepolicy_add_typeattribute(const char *type_name, const char *attr_name)
+static struct attr_expr_index *attr_index_get(struct policydb *pdb)
+{
+	struct attr_expr_index *ix = &attr_index;
+	u32 *next, i, total = 0;
+
+	if (ix->attr_start && ix->seqno == policy_seqno(pdb) &&
+	    ix->nclasses == pdb->p_classes.nprim)
+		return ix;
+
+	sepolicy_attr_index_drop();
+	ix->nattr = pdb->p_types.nprim;
+	ix->attr_start = kvcalloc(ix->nattr + 1, sizeof(u32), GFP_KERNEL);
+	next = kvcalloc(ix->nattr, sizeof(u32), GFP_KERNEL);
+	if (!ix->attr_start || !next)
+		goto oom;
+
+	/* count per attribute, turn counts into offsets, then fill */
+	attr_index_walk(pdb, next, NULL, NULL);
+	for (i = 0; i < ix->nattr; i++) {
+		ix->attr_start[i] = total;
+		total += next[i];
+		next[i] = ix->attr_start[i];
+	}
+	ix->attr_start[ix->nattr] = total;
+
+	ix->refs = kvcalloc(max_t(u32, total, 1), sizeof(*ix->refs),
+			    GFP_KERNEL);
+	if (!ix->refs)
+		goto oom;
+	attr_index_walk(pdb, NULL, ix->refs, next);
+
+	kvfree(next);
+	ix->seqno = policy_seqno(pdb);
+	ix->nclasses = pdb->p_classes.nprim;
+	return ix;
+oom:
+	kvfree(next);
+	sepolicy_attr_index_drop();
+	return NULL;
+}
+
+/* set @type's bit in the expressions of @cls listed in refs[0..n) */
+static void class_add_type_names(struct class_datum *cls,
+				 const struct attr_expr_ref *refs, u32 n,
+				 u32 type_bit)
+{
+	struct constraint_node *cn;
+	struct constraint_expr *e;
+	u32 ord = 0, i = 0;
+
+	for (cn = cls->constraints; cn && i < n; cn = cn->next) {
+		for (e = cn->expr; e && i < n; e = e->next, ord++) {
+			if (ord != refs[i].ord)
+				continue;
+			ebitmap_set_bit(&e->names, type_bit, 1);
+			i++;
+		}
+	}
+}
+
+static int sepolicy_add_typeattribute_raw(struct policydb *pdb,
+					  struct type_datum *type_dat,
+					  struct type_datum *attr_dat)
+{
+	struct attr_expr_index *ix;
+	const struct attr_expr_ref *refs;
+	struct class_datum *cls;
+	u32 a = attr_dat->value - 1, i, j, end;
+	int ret;
+
+	ret = sepolicy_cow_type_attr(pdb, type_dat->value - 1);
+	if (ret)
+		return ret;
+	ret = ebitmap_set_bit(&pdb->type_attr_map_array[type_dat->value - 1],
+			      attr_dat->value - 1, 1);
+	if (ret)
+		return ret;
+
+	ix = attr_index_get(pdb);
+	if (!ix)
+		return -ENOMEM;
+	if (a >= ix->nattr)
+		return 0;
+
+	refs = ix->refs;
+	end = ix->attr_start[a + 1];
+	for (i = ix->attr_start[a]; i < end; i = j) {
+		for (j = i; j < end && refs[j].cls == refs[i].cls; j++)
+			;
+		cls = pdb->class_val_to_struct[refs[i].cls - 1];
+		if (!cls || !class_names_attr(cls, type_dat, attr_dat))
+			continue;
+		cls = sepolicy_cow_class(pdb, cls);
+		if (!cls)
+			return -ENOMEM;
+		class_add_type_names(cls, &refs[i], j - i,
+				     type_dat->value - 1);
+	}
+	return 0;
+}
+
+static int add_typeattribute_locked(struct policydb *pdb,
+				    const char *type_name,
+				    const char *attr_name)
 {
-	struct policydb *pdb;
 	struct type_datum *type_dat = NULL;
 	struct type_datum *attr_dat = NULL;
 	int ret = 0;
@@ -388,14 +777,6 @@ int sepolicy_add_typeattribute(const char *type_name, const char *attr_name)
 	if (!type_name || !attr_name)
 		return -EINVAL;
 
-	mutex_lock(&selinux_state.policy_mutex);
-
-	pdb = fmac_get_pdb();
-	if (!pdb) {
-		ret = -ENOENT;
-		goto out;
-	}
-
 	type_dat = symtab_search(&pdb->symtab[SYM_TYPES], type_name);
 	if (!type_dat) {
 		pr_warn("[selinux]: type '%s' not found\n", type_name);
@@ -421,13 +802,15 @@ int sepolicy_add_typeattribute(const char *type_name, const char *attr_name)
 		goto out;
 	}
 
-	sepolicy_add_typeattribute_raw(pdb, type_dat, attr_dat);
+	ret = sepolicy_add_typeattribute_raw(pdb, type_dat, attr_dat);
+	if (ret) {
+		pr_warn("[selinux]: adding attribute '%s' to type '%s' failed: %d\n",
+			attr_name, type_name, ret);
+		goto out;
+	}
 	pr_info("[selinux]: added attribute '%s' to type '%s'\n",
 		attr_name, type_name);
 out:
-	mutex_unlock(&selinux_state.policy_mutex);
-	if (ret == 0)
-		avc_reset();
 	return ret;
 }
 
@@ -447,90 +830,50 @@ static void xperms_set_range(u32 *perms, u32 low, u32 high, bool invert)
 	}
 }
 
-static void sepolicy_add_xperm_raw(struct policydb *db,
-				   struct type_datum *src,
-				   struct type_datum *tgt,
-				   struct class_datum *cls,
-				   u16 low, u16 high, int effect, bool invert)
+/*
+ * Merge ioctl range [low, high] into @key's xperm node of @h, inserting it
+ * if needed.  Returns 1 if a node was inserted, 0 if one was updated.
+ */
+static int avtab_write_xperm(struct avtab *h, struct avtab_key *key,
+			     u16 low, u16 high, bool invert)
 {
-	struct hashtab_node *node;
-	struct avtab_key key;
 	struct avtab_node *av_node;
-	struct avtab_extended_perms *x, *xp;
+	struct avtab_extended_perms *x, xp;
 	struct avtab_datum datum;
 	u8 d_low, d_high;
 
-	if (!src) {
-		hashtab_for_each(db->p_types.table, node) {
-			struct type_datum *t = (struct type_datum *)node->datum;
-
-			if (!t->attribute)
-				sepolicy_add_xperm_raw(db, t, tgt, cls,
-						       low, high, effect, invert);
-		}
-		return;
-	}
-	if (!tgt) {
-		hashtab_for_each(db->p_types.table, node) {
-			struct type_datum *t = (struct type_datum *)node->datum;
-
-			if (!t->attribute)
-				sepolicy_add_xperm_raw(db, src, t, cls,
-						       low, high, effect, invert);
-		}
-		return;
-	}
-	if (!cls) {
-		hashtab_for_each(db->p_classes.table, node) {
-			sepolicy_add_xperm_raw(db, src, tgt,
-					       (struct class_datum *)node->datum,
-					       low, high, effect, invert);
-		}
-		return;
-	}
-
 	d_low  = (u8)(low  >> 8);
 	d_high = (u8)(high >> 8);
 
-	key.source_type  = src->value;
-	key.target_type  = tgt->value;
-	key.target_class = cls->value;
-	key.specified    = effect;
-
-	av_node = avtab_search_node(&db->te_avtab, &key);
+	av_node = avtab_search_node(h, key);
 	if (!av_node) {
-		xp = kzalloc(sizeof(*xp), GFP_KERNEL);
-		if (!xp)
-			return;
-
+		memset(&xp, 0, sizeof(xp));
 		if (d_low != d_high) {
-			xp->specified = AVTAB_XPERMS_IOCTLDRIVER;
-			xp->driver    = 0;
-			xperms_set_range(xp->perms.p, d_low, d_high, invert);
+			xp.specified = AVTAB_XPERMS_IOCTLDRIVER;
+			xp.driver    = 0;
+			xperms_set_range(xp.perms.p, d_low, d_high, invert);
 		} else {
-			xp->specified = AVTAB_XPERMS_IOCTLFUNCTION;
-			xp->driver    = d_low;
-			xperms_set_range(xp->perms.p,
+			xp.specified = AVTAB_XPERMS_IOCTLFUNCTION;
+			xp.driver    = d_low;
+			xperms_set_range(xp.perms.p,
 					 (u8)(low  & 0xFF),
 					 (u8)(high & 0xFF), invert);
 		}
 
+		/* the insert copies *xperms into avtab's own cache */
 		memset(&datum, 0, sizeof(datum));
-		datum.u.xperms = xp;
+		datum.u.xperms = &xp;
 
-		av_node = avtab_insert_nonunique(&db->te_avtab, &key, &datum);
-		if (!av_node) {
-			kfree(xp);
-			return;
-		}
-		db->len += sizeof(struct avtab_key) + sizeof(struct avtab_datum)
-			 + sizeof(u8) + sizeof(u8) + sizeof(u32) * 8;
-		return;
+		av_node = avtab_insert_nonunique(h, key, &datum);
+		if (!av_node)
+			return -ENOMEM;
+		sepolicy_stats_node(sizeof(*av_node) + sizeof(xp));
+		return 1;
 	}
 
 	x = av_node->datum.u.xperms;
 	if (!x)
-		return;
+		return 0;
 
 	if (x->specified == AVTAB_XPERMS_IOCTLDRIVER) {
 		xperms_set_range(x->perms.p, d_low, d_high, invert);
@@ -540,27 +883,122 @@ static void sepolicy_add_xperm_raw(struct policydb *db,
 					 (u8)(low  & 0xFF),
 					 (u8)(high & 0xFF), invert);
 		} else {
-			struct avtab_extended_perms *xnew;
+			memset(&xp, 0, sizeof(xp));
+			xp.specified = AVTAB_XPERMS_IOCTLDRIVER;
+			xp.driver    = 0;
+			xp.perms.p[x->driver / 32] |= (1U << (x->driver % 32));
+			xperms_set_range(xp.perms.p, d_low, d_high, invert);
+			*x = xp;
+		}
+	}
+	return 0;
+}
 
-			xnew = kzalloc(sizeof(*xnew), GFP_KERNEL);
-			if (!xnew)
-				return;
+static int sepolicy_add_xperm_raw(struct sepolicy_session *sess,
+				  struct type_datum *src,
+				  struct type_datum *tgt,
+				  struct class_datum *cls,
+				  u16 low, u16 high, int effect, bool invert)
+{
+	struct policydb *db = sess->pdb;
+	struct sepolicy_stage_op op;
+	struct avtab_key key;
+	u64 nodes;
+	int ret;
 
-			xnew->specified = AVTAB_XPERMS_IOCTLDRIVER;
-			xnew->driver    = 0;
-			xnew->perms.p[x->driver / 32] |= (1U << (x->driver % 32));
-			xperms_set_range(xnew->perms.p, d_low, d_high, invert);
+	if ((!src || !tgt) && wildcard_attr_ok(effect, invert)) {
+		struct type_datum *all = sepolicy_all_types_attr(sess);
 
-			kfree(x);
-			av_node->datum.u.xperms = xnew;
+		if (IS_ERR(all))
+			return PTR_ERR(all);
+		if (all) {
+			src = src ? src : all;
+			tgt = tgt ? tgt : all;
 		}
 	}
+
+	if (!src || !tgt || !cls || sess->nstaged) {
+		struct policy_iter_cache *it = policy_iter_get(db);
+		u32 i;
+
+		if (!it)
+			return -ENOMEM;
+
+		nodes = (u64)(src ? 1 : it->ntypes) * (tgt ? 1 : it->ntypes) *
+			(cls ? 1 : it->nclasses);
+		op = (struct sepolicy_stage_op) {
+			.r = {
+				.src	= src ? src->value : 0,
+				.tgt	= tgt ? tgt->value : 0,
+				.cls	= cls ? cls->value : 0,
+				.effect	= effect,
+				.invert	= invert,
+			},
+			.low	= low,
+			.high	= high,
+			.xperm	= true,
+		};
+		if (stage_maybe(sess, &op, nodes))
+			return 0;
+
+		if (!src) {
+			for (i = 0; i < it->ntypes; i++) {
+				ret = sepolicy_add_xperm_raw(sess, it->types[i],
+							     tgt, cls, low,
+							     high, effect,
+							     invert);
+				if (ret)
+					return ret;
+				cond_resched();
+			}
+			return 0;
+		}
+		if (!tgt) {
+			for (i = 0; i < it->ntypes; i++) {
+				ret = sepolicy_add_xperm_raw(sess, src,
+							     it->types[i],
+							     cls, low, high,
+							     effect, invert);
+				if (ret)
+					return ret;
+			}
+			return 0;
+		}
+		if (!cls) {
+			for (i = 0; i < it->nclasses; i++) {
+				ret = sepolicy_add_xperm_raw(sess, src, tgt,
+							     it->classes[i],
+							     low, high, effect,
+							     invert);
+				if (ret)
+					return ret;
+			}
+			return 0;
+		}
+	}
+
+	key.source_type  = src->value;
+	key.target_type  = tgt->value;
+	key.target_class = cls->value;
+	key.specified    = effect;
+
+	ret = sepolicy_cow_avtab_key(db, &key);
+	if (ret)
+		return ret;
+
+	ret = avtab_write_xperm(&db->te_avtab, &key, low, high, invert);
+	if (ret < 0)
+		return ret;
+	if (ret)
+		db->len += XPERM_NODE_LEN;
+	return 0;
 }
 
-int sepolicy_add_xperm(const char *s, const char *t, const char *c,
-		       const char *range, int effect, bool invert)
+static int add_xperm_locked(struct sepolicy_session *sess,
+			    const char *s, const char *t, const char *c,
+			    const char *range, int effect, bool invert)
 {
-	struct policydb *pdb;
+	struct policydb *pdb = sess->pdb;
 	struct type_datum *src = NULL, *tgt = NULL;
 	struct class_datum *cls = NULL;
 	u16 low = 0, high = 0;
@@ -583,14 +1021,6 @@ int sepolicy_add_xperm(const char *s, const char *t, const char *c,
 	if (low > high)
 		return -EINVAL;
 
-	mutex_lock(&selinux_state.policy_mutex);
-
-	pdb = fmac_get_pdb();
-	if (!pdb) {
-		ret = -ENOENT;
-		goto out;
-	}
-
 	if (s && *s) {
 		src = symtab_search(&pdb->symtab[SYM_TYPES], s);
 		if (!src) {
@@ -616,21 +1046,631 @@ int sepolicy_add_xperm(const char *s, const char *t, const char *c,
 		}
 	}
 
-	sepolicy_add_xperm_raw(pdb, src, tgt, cls, low, high, effect, invert);
+	ret = sepolicy_add_xperm_raw(sess, src, tgt, cls, low, high, effect,
+				     invert);
 out:
+	return ret;
+}
+
+/*
+ * Staged edits are written at commit into a private copy of te_avtab:
+ * the copy and the expansion each run STAGE_CHUNK_NODES at a time, with
+ * policy_mutex dropped and the CPU yielded in between, and the finished
+ * table is swapped in with one RCU publish.  The edit lock keeps other
+ * sessions out for the whole build, so a live policy that changed under
+ * us can only be a reload.  The build is then dropped along with its
+ * journal records and reference notes, and commit returns -EAGAIN: the
+ * caller has to send the edits again.
+ */
+struct stage_build {
+	struct sepolicy_session *sess;
+	u32 seqno;
+	struct avtab *h;	/* private build, or the live table */
+	struct avtab tab;
+	u32 written;
+};
+
+static int stage_yield(struct stage_build *b)
+{
+	struct policydb *pdb = b->sess->pdb;
+
 	mutex_unlock(&selinux_state.policy_mutex);
-	if (ret == 0)
-		avc_reset();
+	cond_resched();
+	mutex_lock(&selinux_state.policy_mutex);
+
+	if (fmac_get_pdb() != pdb || policy_seqno(pdb) != b->seqno)
+		return -EAGAIN;
+	return 0;
+}
+
+static int stage_write(struct stage_build *b,
+		       const struct sepolicy_stage_op *op,
+		       u32 src, u32 tgt, u32 cls)
+{
+	struct policydb *pdb = b->sess->pdb;
+	struct avtab_key key = {
+		.source_type	= src,
+		.target_type	= tgt,
+		.target_class	= cls,
+		.specified	= op->r.effect,
+	};
+	int ret;
+
+	if (!op->xperm) {
+		ret = avtab_edit(b->sess, b->h, &key, op->r.mask, op->r.invert,
+				 op->edit);
+		if (ret)
+			return ret;
+	} else {
+		if (b->h == &pdb->te_avtab) {
+			ret = sepolicy_cow_avtab_key(pdb, &key);
+			if (ret)
+				return ret;
+		}
+		ret = avtab_write_xperm(b->h, &key, op->low, op->high,
+					op->r.invert);
+		if (ret < 0)
+			return ret;
+		if (ret)
+			pdb->len += XPERM_NODE_LEN;
+	}
+
+	if (b->h != &b->tab || ++b->written % STAGE_CHUNK_NODES)
+		return 0;
+	return stage_yield(b);
+}
+
+static int stage_run_op(struct stage_build *b,
+			const struct sepolicy_stage_op *op)
+{
+	const struct sepolicy_resolved_rule *r = &op->r;
+	struct policy_iter_cache *it;
+	u32 i, j, k, src_n, tgt_n, cls_n;
+	int ret;
+
+	it = policy_iter_get(b->sess->pdb);
+	if (!it)
+		return -ENOMEM;
+	src_n = r->src ? 1 : it->ntypes;
+	tgt_n = r->tgt ? 1 : it->ntypes;
+	cls_n = r->cls ? 1 : it->nclasses;
+
+	for (i = 0; i < src_n; i++) {
+		for (j = 0; j < tgt_n; j++) {
+			for (k = 0; k < cls_n; k++) {
+				/*
+				 * Re-fetched after each yield.  Types are
+				 * only added under sepolicy_edit_mutex, so
+				 * the bounds can't change underneath us.
+				 */
+				it = policy_iter_get(b->sess->pdb);
+				if (!it)
+					return -ENOMEM;
+				if ((!r->src || !r->tgt) &&
+				    it->ntypes != (r->src ? tgt_n : src_n))
+					return -EAGAIN;
+				if (!r->cls && it->nclasses != cls_n)
+					return -EAGAIN;
+				ret = stage_write(b, op,
+					r->src ? r->src : it->types[i]->value,
+					r->tgt ? r->tgt : it->types[j]->value,
+					r->cls ? r->cls : it->classes[k]->value);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Entered and left with policy_mutex held; may republish sess->pdb.
+ * -EAGAIN means the policy was replaced under the build and sess->pdb
+ * is stale.
+ */
+static int stage_commit(struct sepolicy_session *sess)
+{
+	struct stage_build b = { .sess = sess };
+	struct policydb *pdb;
+	u32 i, pos = 0;
+	int ret;
+
+	b.seqno = policy_seqno(sess->pdb);
+	ret = sepolicy_avtab_stage_init(sess->pdb, sess->staged_nodes, &b.tab);
+	if (ret) {
+		/*
+		 * Not our working copy, or no room to build one: in place,
+		 * up to the first edit that fails.  What was written before
+		 * it stays and keeps its records; that edit and the ones
+		 * after it are neither journaled nor indexed.
+		 */
+		b.h = &sess->pdb->te_avtab;
+		for (i = 0; i < sess->nstaged; i++) {
+			ret = stage_run_op(&b, &sess->staged[i]);
+			if (ret)
+				break;
+		}
+		sepolicy_journal_settle(i);
+		sepolicy_rule_refs_unmark(false);
+		if (ret) {
+			sepolicy_rule_index_flush();
+			pr_warn("[selinux]: %u of %u staged edit(s) applied in place: %d\n",
+				i, sess->nstaged, ret);
+		}
+		return ret;
+	}
+	b.h = &b.tab;
+
+	while (!(ret = sepolicy_avtab_stage_copy(sess->pdb, &b.tab, &pos,
+						  STAGE_CHUNK_NODES))) {
+		ret = stage_yield(&b);
+		if (ret)
+			goto abort;
+	}
+	if (ret < 0)
+		goto abort;
+
+	for (i = 0; i < sess->nstaged; i++) {
+		ret = stage_run_op(&b, &sess->staged[i]);
+		if (ret)
+			goto abort;
+	}
+
+	pdb = sepolicy_avtab_install(sess->pdb, &b.tab);
+	if (IS_ERR(pdb)) {
+		ret = PTR_ERR(pdb);
+		goto abort;
+	}
+	sess->pdb = pdb;
+	sepolicy_journal_settle(sess->nstaged);
+	sepolicy_rule_refs_unmark(false);
+	pr_info("[selinux]: %u staged edit(s) published, %u avtab entries\n",
+		sess->nstaged, pdb->te_avtab.nel);
+	return 0;
+
+abort:
+	avtab_destroy(&b.tab);
+	sepolicy_journal_settle(0);
+	sepolicy_rule_index_flush();
+	sepolicy_rule_refs_unmark(true);
+	pr_warn("[selinux]: dropped %u staged edit(s): %d\n", sess->nstaged,
+		ret);
 	return ret;
 }
 
+/*
+ * Edit sessions hold policy_mutex across any number of edits and flush the
+ * AVC once at commit, instead of once per rule.  The edit lock is taken
+ * first and held to the end of commit, so staged edits can drop
+ * policy_mutex without another session writing the avtab meanwhile.
+ */
+static DEFINE_MUTEX(sepolicy_edit_mutex);
+
+int sepolicy_session_begin(struct sepolicy_session *sess)
+{
+	ktime_t t0 = ktime_get();
+
+	memset(sess, 0, sizeof(*sess));
+
+	mutex_lock(&sepolicy_edit_mutex);
+	mutex_lock(&selinux_state.policy_mutex);
+	sepolicy_stats_phase(SEPOLICY_PHASE_LOCK, t0);
+	sess->t_locked = ktime_get();
+	sepolicy_follow_bools_locked();
+	sess->pdb = fmac_get_pdb();
+	if (!sess->pdb) {
+		mutex_unlock(&selinux_state.policy_mutex);
+		mutex_unlock(&sepolicy_edit_mutex);
+		return -ENOENT;
+	}
+	sess->nel_start = sess->pdb->te_avtab.nel;
+	sepolicy_rule_refs_sync(sess->pdb);
+	return 0;
+}
+
+/*
+ * Returns 0, or why staged edits were not all published; the edits made
+ * in place are in effect either way.
+ */
+int sepolicy_session_commit(struct sepolicy_session *sess)
+{
+	ktime_t t0;
+	int ret = 0;
+
+	if (!sess->pdb)
+		return 0;
+
+	if (sess->nstaged)
+		ret = stage_commit(sess);
+	sepolicy_stats_phase(SEPOLICY_PHASE_EDIT, sess->t_locked);
+
+	/*
+	 * Inserts may have outgrown the slot count the policy was loaded
+	 * with.  A staged build is sized up front; on -EAGAIN the policy
+	 * was replaced and sess->pdb is stale.
+	 */
+	if (ret != -EAGAIN && sess->pdb->te_avtab.nel > sess->nel_start) {
+		t0 = ktime_get();
+		sepolicy_avtab_rehash(sess->pdb);
+		sepolicy_stats_phase(SEPOLICY_PHASE_REHASH, t0);
+	}
+
+	sess->pdb = NULL;
+	mutex_unlock(&selinux_state.policy_mutex);
+	kvfree(sess->staged);
+	sess->staged = NULL;
+	sess->nstaged = 0;
+
+	/* removed nodes and replaced arrays may still be under a reader */
+	if (sess->ndead || sess->nretired)
+		synchronize_rcu();
+	if (sess->ndead)
+		sepolicy_avtab_free_nodes(sess->dead, sess->ndead);
+	kvfree(sess->dead);
+	sess->dead = NULL;
+	sess->ndead = 0;
+	while (sess->nretired)
+		kvfree(sess->retired[--sess->nretired]);
+	kvfree(sess->retired);
+	sess->retired = NULL;
+	if (sess->edits) {
+		t0 = ktime_get();
+		sepolicy_edited(sess->edits == 1 ? sess->src : "*");
+		sepolicy_stats_phase(SEPOLICY_PHASE_AVC, t0);
+	}
+	mutex_unlock(&sepolicy_edit_mutex);
+	return ret;
+}
+
+/*
+ * Room for @n more sepolicy_session_retire() calls, taken before
+ * publishing the replacements so retiring the old arrays can't fail.
+ */
+int sepolicy_session_retire_reserve(struct sepolicy_session *sess, u32 n)
+{
+	void **retired;
+	u32 cap;
+
+	if (sess->nretired + n <= sess->retired_cap)
+		return 0;
+	cap = max(sess->retired_cap * 2, sess->nretired + n);
+	retired = _nksu_kvrealloc(sess->retired, cap * sizeof(*retired),
+				  sess->retired_cap * sizeof(*retired));
+	if (!retired)
+		return -ENOMEM;
+	sess->retired = retired;
+	sess->retired_cap = cap;
+	return 0;
+}
+
+/* kvfree @p at commit, once RCU readers that may still see it are done */
+void sepolicy_session_retire(struct sepolicy_session *sess, void *p)
+{
+	if (!p)
+		return;
+	if (WARN_ON(sess->nretired == sess->retired_cap))
+		return;		/* leak rather than free it under a reader */
+	sess->retired[sess->nretired++] = p;
+}
+
+static int session_note(struct sepolicy_session *sess, int ret,
+			const char *src)
+{
+	if (ret)
+		return ret;
+	if (!sess->edits++)
+		strscpy(sess->src, src ? src : "*", sizeof(sess->src));
+	return 0;
+}
+
+/* an edit that staged is only journaled for good once commit publishes it */
+static void session_journal(struct sepolicy_session *sess, u32 nstaged,
+			    int type, const char *a0, const char *a1,
+			    const char *a2, const char *a3, int effect,
+			    bool invert)
+{
+	sepolicy_journal_record(type, a0, a1, a2, a3, effect, invert,
+				sess->nstaged != nstaged ? sess->nstaged : 0);
+}
+
+int sepolicy_session_add_rule(struct sepolicy_session *sess,
+			      const char *sname, const char *tname,
+			      const char *cname, const char *pname,
+			      int effect, bool invert)
+{
+	u32 nstaged = sess->nstaged;
+	bool reverting = sepolicy_rule_is_reverting(effect, invert);
+	bool again;
+	int ret;
+
+	/* already applied this generation: no edit, no AVC flush */
+	if (sepolicy_rule_index_hit(sess->pdb, sname, tname, cname, pname,
+				    effect, invert))
+		return 0;
+
+	/*
+	 * The index forgets rules whenever anything reverts, so it can't
+	 * be what keeps a repeat from taking a second reference.
+	 */
+	again = !reverting && sepolicy_rule_refs_held(sname, tname, cname,
+						      pname, effect,
+						      invert) == 1;
+	ret = add_rule_locked(sess, sname, tname, cname, pname, effect,
+			      invert, again ? RULE_EDIT_AGAIN : RULE_EDIT_ADD);
+
+	/*
+	 * A failed wildcard may have written part of its nodes: a removal
+	 * can still take those back, but only an edit that applied is
+	 * indexed or journaled, so sending it again retries it.
+	 */
+	if (reverting)
+		sepolicy_rule_index_flush();
+	else
+		sepolicy_rule_refs_hold(sname, tname, cname, pname, effect,
+					invert, true);
+	if (ret)
+		return ret;
+
+	if (!reverting)
+		sepolicy_rule_index_add(sess->pdb, sname, tname, cname, pname,
+					effect, invert);
+	session_journal(sess, nstaged, JNL_RULE, sname, tname, cname, pname,
+			effect, invert);
+	return session_note(sess, 0, sname);
+}
+
+/*
+ * Take back sepolicy_session_add_rule() with the same arguments, however
+ * often it was repeated this generation.  Only what no other edit still
+ * holds is undone; the policy's own rules are never touched.  A rule that
+ * holds nothing is -ENOENT.
+ */
+int sepolicy_session_remove_rule(struct sepolicy_session *sess,
+				 const char *sname, const char *tname,
+				 const char *cname, const char *pname,
+				 int effect, bool invert)
+{
+	u32 nstaged = sess->nstaged;
+	int ret;
+
+	if (sepolicy_rule_is_reverting(effect, invert))
+		return -EINVAL;
+
+	ret = sepolicy_rule_refs_held(sname, tname, cname, pname, effect,
+				      invert);
+	if (!ret)
+		return -ENOENT;
+
+	ret = add_rule_locked(sess, sname, tname, cname, pname, effect,
+			      invert, RULE_EDIT_REMOVE);
+	/* a failed one keeps the hold, so sending it again finishes it */
+	sepolicy_rule_index_flush();
+	if (ret)
+		return ret;
+
+	sepolicy_rule_refs_hold(sname, tname, cname, pname, effect, invert,
+				false);
+	session_journal(sess, nstaged, JNL_REMOVE, sname, tname, cname, pname,
+			effect, invert);
+	return session_note(sess, 0, sname);
+}
+
+int sepolicy_session_allow_all_types(struct sepolicy_session *sess,
+				     const char *sname, const char *cname)
+{
+	u32 nstaged = sess->nstaged;
+	int ret = allow_all_types_locked(sess, sname, cname);
+
+	if (!ret)
+		session_journal(sess, nstaged, JNL_ALL_TYPES, sname, cname,
+				NULL, NULL, 0, false);
+	return session_note(sess, ret, sname);
+}
+
+int sepolicy_session_allow_any_any(struct sepolicy_session *sess,
+				   const char *sname)
+{
+	u32 nstaged = sess->nstaged;
+	int ret = allow_any_any_locked(sess, sname);
+
+	if (!ret)
+		session_journal(sess, nstaged, JNL_ANY_ANY, sname, NULL, NULL,
+				NULL, 0, false);
+	return session_note(sess, ret, sname);
+}
+
+int sepolicy_session_add_typeattribute(struct sepolicy_session *sess,
+				       const char *type_name,
+				       const char *attr_name)
+{
+	int ret = add_typeattribute_locked(sess->pdb, type_name, attr_name);
+
+	if (!ret)
+		sepolicy_journal_record(JNL_TYPEATTR, type_name, attr_name,
+					NULL, NULL, 0, false, 0);
+	return session_note(sess, ret, type_name);
+}
+
+int sepolicy_session_add_xperm(struct sepolicy_session *sess,
+			       const char *s, const char *t, const char *c,
+			       const char *range, int effect, bool invert)
+{
+	u32 nstaged = sess->nstaged;
+	int ret = add_xperm_locked(sess, s, t, c, range, effect, invert);
+
+	if (!ret)
+		session_journal(sess, nstaged, JNL_XPERM, s, t, c, range,
+				effect, invert);
+	return session_note(sess, ret, s);
+}
+
+int sepolicy_session_resolve_rule(struct sepolicy_session *sess,
+				  const char *sname, const char *tname,
+				  const char *cname, const char *pname,
+				  struct sepolicy_resolved_rule *r)
+{
+	return resolve_rule_locked(sess->pdb, sname, tname, cname, pname, r);
+}
+
+/* not journaled: callers replaying resolved rules journal the source */
+int sepolicy_session_apply_resolved(struct sepolicy_session *sess,
+				    const struct sepolicy_resolved_rule *r)
+{
+	int ret = apply_resolved_locked(sess, r, RULE_EDIT_ADD);
+
+	/* even a failed revert may have cleared part of what it covers */
+	if (sepolicy_rule_is_reverting(r->effect, r->invert))
+		sepolicy_rule_index_flush();
+	return session_note(sess, ret, NULL);
+}
+
+u32 sepolicy_policy_seqno(struct policydb *pdb)
+{
+	return policy_seqno(pdb);
+}
+
+int sepolicy_session_add_type(struct sepolicy_session *sess,
+			      const char *name, bool attribute)
+{
+	int ret;
+
+	if (!name || !*name)
+		return -EINVAL;
+
+	ret = sepolicy_add_type_locked(sess, name, attribute);
+	if (!ret)
+		sepolicy_journal_record(JNL_TYPE, name, NULL, NULL, NULL,
+					0, attribute, 0);
+	return session_note(sess, ret, name);
+}
+
+int sepolicy_session_add_domains(struct sepolicy_session *sess,
+				 const char *const *names, unsigned int n)
+{
+	unsigned int i;
+	int ret;
+
+	if (!n)
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (!names[i] || !*names[i])
+			return -EINVAL;
+	}
+
+	ret = sepolicy_add_domains_locked(sess, names, n);
+	if (ret)
+		return ret;
+	for (i = 0; i < n; i++)
+		sepolicy_journal_record(JNL_DOMAIN, names[i], NULL, NULL,
+					NULL, 0, false, 0);
+	return session_note(sess, 0, n == 1 ? names[0] : NULL);
+}
+
+int sepolicy_add_rule(const char *sname, const char *tname,
+		      const char *cname, const char *pname,
+		      int effect, bool invert)
+{
+	struct sepolicy_session sess;
+	int ret, cret;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+	ret = sepolicy_session_add_rule(&sess, sname, tname, cname, pname,
+					effect, invert);
+	cret = sepolicy_session_commit(&sess);
+	return cret ? cret : ret;
+}
+
+int sepolicy_remove_rule(const char *sname, const char *tname,
+			 const char *cname, const char *pname,
+			 int effect, bool invert)
+{
+	struct sepolicy_session sess;
+	int ret, cret;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+	ret = sepolicy_session_remove_rule(&sess, sname, tname, cname, pname,
+					   effect, invert);
+	cret = sepolicy_session_commit(&sess);
+	return cret ? cret : ret;
+}
+
+int sepolicy_allow_all_types(const char *sname, const char *cname)
+{
+	struct sepolicy_session sess;
+	int ret, cret;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+	ret = sepolicy_session_allow_all_types(&sess, sname, cname);
+	cret = sepolicy_session_commit(&sess);
+	return cret ? cret : ret;
+}
+
+int sepolicy_allow_any_any(const char *sname)
+{
+	struct sepolicy_session sess;
+	int ret, cret;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+	ret = sepolicy_session_allow_any_any(&sess, sname);
+	cret = sepolicy_session_commit(&sess);
+	return cret ? cret : ret;
+}
+
+int sepolicy_add_typeattribute(const char *type_name, const char *attr_name)
+{
+	struct sepolicy_session sess;
+	int ret, cret;
+
+	if (!type_name || !attr_name)
+		return -EINVAL;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+	ret = sepolicy_session_add_typeattribute(&sess, type_name, attr_name);
+	cret = sepolicy_session_commit(&sess);
+	return cret ? cret : ret;
+}
+
+int sepolicy_add_xperm(const char *s, const char *t, const char *c,
+		       const char *range, int effect, bool invert)
+{
+	struct sepolicy_session sess;
+	int ret, cret;
+
+	ret = sepolicy_session_begin(&sess);
+	if (ret)
+		return ret;
+	ret = sepolicy_session_add_xperm(&sess, s, t, c, range, effect, invert);
+	cret = sepolicy_session_commit(&sess);
+	return cret ? cret : ret;
+}
+
 #ifdef CONFIG_NKSU_DEBUG
+static bool chain_has_auditdeny(const struct avtab_node *node)
+{
+	for (; node; node = node->next) {
+		if (node->key.specified & AVTAB_AUDITDENY)
+			return true;
+	}
+	return false;
+}
+
 int sepolicy_make_audit(void)
 {
 	struct policydb *pdb;
 	struct avtab_node *node;
 	int i, ret = 0;
 
+	mutex_lock(&sepolicy_edit_mutex);
 	mutex_lock(&selinux_state.policy_mutex);
 
 	pdb = fmac_get_pdb();
@@ -639,19 +1679,33 @@ int sepolicy_make_audit(void)
 		goto out;
 	}
 
+	/* touches most buckets: clone them up front, in parallel */
+	ret = sepolicy_cow_avtab_bulk(pdb, chain_has_auditdeny);
+	if (ret)
+		pr_warn("[selinux]: bulk clone incomplete (%d), finishing per slot\n",
+			ret);
+	ret = 0;
+
 	for (i = 0; i < pdb->te_avtab.nslot; i++) {
+		if (!chain_has_auditdeny(pdb->te_avtab.htable[i]) ||
+		    sepolicy_cow_avtab_slot(pdb, i))
+			continue;
+
 		for (node = pdb->te_avtab.htable[i]; node; node = node->next) {
 			if (node->key.specified & AVTAB_AUDITDENY)
 				node->datum.u.data = ~0U;
 		}
 	}
 
+	sepolicy_rule_index_flush();
+	sepolicy_rule_refs_flush();
 	pr_info("[selinux]: Disabled all dontaudit rules (auditing all denials)\n");
 
 out:
 	mutex_unlock(&selinux_state.policy_mutex);
+	mutex_unlock(&sepolicy_edit_mutex);
 	if (ret == 0)
-		avc_reset();
+		sepolicy_edited("*");
 	return ret;
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <fmac.h>
+
+#include "ss/policydb.h"
+#include "ss/avtab.h"
+#include "security.h"
+
+/*
+ * Rules already applied to the current policy generation, keyed by the
+ * exact strings they were requested with, so a manager re-sending its
+ * rule set costs a hash lookup per rule instead of an edit and an AVC
+ * flush.  Protected by policy_mutex.
+ */
+
+#define RULE_INDEX_BITS	9
+#define RULE_INDEX_MAX	4096
+
+struct applied_rule {
+	struct hlist_node node;
+	u32 hash;
+	u16 len;
+	s16 effect;
+	bool invert;
+	char key[];	/* "src\0tgt\0cls\0perm\0", NULL stored as "" */
+};
+
+static DEFINE_HASHTABLE(applied_rules, RULE_INDEX_BITS);
+static u32 applied_count;
+static u32 applied_seqno;
+
+/* returns 0 for names too long to key on; those are never indexed */
+size_t sepolicy_rule_key(char *buf, const char *s, const char *t,
+			 const char *c, const char *p)
+{
+	const char *parts[] = { s, t, c, p };
+	size_t len = 0, n;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(parts); i++) {
+		n = parts[i] ? strnlen(parts[i], RULE_NAME_MAX) : 0;
+		if (n == RULE_NAME_MAX)
+			return 0;
+		if (n)
+			memcpy(buf + len, parts[i], n);
+		len += n;
+		buf[len++] = '\0';
+	}
+	return len;
+}
+
+void sepolicy_rule_index_flush(void)
+{
+	struct applied_rule *r;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(applied_rules, bkt, tmp, r, node) {
+		hash_del(&r->node);
+		kfree(r);
+	}
+	applied_count = 0;
+}
+
+/* a policy reload starts a new generation, which invalidates everything */
+static void rule_index_sync(struct policydb *pdb)
+{
+	u32 seq = sepolicy_policy_seqno(pdb);
+
+	if (seq != applied_seqno) {
+		sepolicy_rule_index_flush();
+		applied_seqno = seq;
+	}
+}
+
+/* a boolean change bumps the seqno but keeps every applied rule */
+void sepolicy_rule_index_rebind(u32 from, u32 to)
+{
+	if (applied_seqno == from)
+		applied_seqno = to;
+}
+
+static struct applied_rule *rule_index_find(const char *key, size_t len,
+					    u32 hash, int effect, bool invert)
+{
+	struct applied_rule *r;
+
+	hash_for_each_possible(applied_rules, r, node, hash) {
+		if (r->hash == hash && r->len == len && r->effect == effect &&
+		    r->invert == invert && !memcmp(r->key, key, len))
+			return r;
+	}
+	return NULL;
+}
+
+bool sepolicy_rule_index_hit(struct policydb *pdb, const char *s,
+			     const char *t, const char *c, const char *p,
+			     int effect, bool invert)
+{
+	char key[RULE_KEY_MAX];
+	size_t len;
+
+	rule_index_sync(pdb);
+	if (!applied_count)
+		return false;
+
+	len = sepolicy_rule_key(key, s, t, c, p);
+	if (!len)
+		return false;
+	return rule_index_find(key, len, jhash(key, len, effect), effect,
+			       invert) != NULL;
+}
+
+void sepolicy_rule_index_add(struct policydb *pdb, const char *s,
+			     const char *t, const char *c, const char *p,
+			     int effect, bool invert)
+{
+	struct applied_rule *r;
+	char key[RULE_KEY_MAX];
+	size_t len;
+	u32 hash;
+
+	rule_index_sync(pdb);
+	if (applied_count >= RULE_INDEX_MAX)
+		return;
+
+	len = sepolicy_rule_key(key, s, t, c, p);
+	if (!len)
+		return;
+	hash = jhash(key, len, effect);
+	if (rule_index_find(key, len, hash, effect, invert))
+		return;
+
+	r = kmalloc(struct_size(r, key, len), GFP_KERNEL);
+	if (!r)
+		return;
+	r->hash = hash;
+	r->len = len;
+	r->effect = effect;
+	r->invert = invert;
+	memcpy(r->key, key, len);
+	hash_add(applied_rules, &r->node, hash);
+	applied_count++;
+}
+
+/*
+ * Whether an edit can undo bits an earlier edit set: revoking allowed or
+ * auditallow bits, or setting auditdeny bits that DENY() cleared.
+ */
+bool sepolicy_rule_is_reverting(int effect, bool invert)
+{
+	return effect == AVTAB_AUDITDENY ? !invert : invert;
+}
@@ -0,0 +1,461 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/bitops.h>
+#include <fmac.h>
+
+#include "ss/policydb.h"
+#include "ss/avtab.h"
+#include "security.h"
+
+/*
+ * Which nksu edits hold each bit of the avtab nodes they wrote, so one
+ * rule can be taken back without restoring the whole policy.  Every
+ * granting write counts once per bit; a bit is undone when its count
+ * drops to zero, unless the node already had it before nksu touched it.
+ * A node nksu inserted goes away once no bit of it is held.  Reverting
+ * writes (deny, or setting auditdeny bits) make the bits they touch the
+ * node's own again.  Keyed by avtab key, so republishing the table
+ * keeps it valid; a reload starts over.  Protected by policy_mutex.
+ *
+ * A rule holds its references once per generation: the holders table
+ * remembers which add_rule requests hold some, and adding one again only
+ * takes back the bits a reverting write handed to the node since.  The
+ * rule index can forget a rule without changing that.
+ *
+ * From a session's first staged edit to its commit, every change is
+ * also logged, so a staged build that is dropped takes back only its
+ * own notes.
+ */
+
+#define RULE_REFS_BITS	10
+#define RULE_REFS_MAX	65536
+
+struct rule_ref {
+	struct hlist_node node;
+	struct avtab_key key;
+	u32 base;		/* bits before the first tracked edit */
+	u32 held;		/* bits with a nonzero count */
+	bool created;
+	u8 count[32];		/* saturates: a bit at U8_MAX stays held */
+	u32 undo_gen;		/* saved in the undo log of this mark */
+};
+
+struct rule_holder {
+	struct hlist_node node;
+	u32 hash;
+	u16 len;
+	s16 effect;
+	bool invert;
+	char key[];	/* sepolicy_rule_key() */
+};
+
+static DEFINE_HASHTABLE(rule_refs, RULE_REFS_BITS);
+static DEFINE_HASHTABLE(rule_holders, RULE_REFS_BITS);
+static u32 refs_count;
+static u32 holders_count;
+static u32 refs_seqno;
+static bool refs_full;
+
+enum {
+	UNDO_REF,		/* a saved rule_ref, or a key that had none */
+	UNDO_HOLD,		/* a holder added since the mark */
+	UNDO_UNHOLD,		/* a holder removed since the mark, kept */
+};
+
+struct refs_undo {
+	u8 kind;
+	bool existed;		/* UNDO_REF: ptr is the state to restore */
+	void *ptr;
+};
+
+static struct refs_undo *undo_log;
+static u32 undo_len;
+static u32 undo_cap;
+static u32 undo_gen;
+static bool undo_active;
+static bool undo_lost;		/* a change went unlogged */
+
+static u32 ref_hash(const struct avtab_key *key)
+{
+	return jhash_3words(key->source_type, key->target_type,
+			    key->target_class << 16 | key->specified, 0);
+}
+
+static struct rule_ref *ref_find(const struct avtab_key *key, u32 hash)
+{
+	struct rule_ref *r;
+
+	hash_for_each_possible(rule_refs, r, node, hash) {
+		if (!memcmp(&r->key, key, sizeof(*key)))
+			return r;
+	}
+	return NULL;
+}
+
+static void ref_free(struct rule_ref *r)
+{
+	hash_del(&r->node);
+	kfree(r);
+	refs_count--;
+}
+
+static bool undo_push(u8 kind, bool existed, void *ptr)
+{
+	struct refs_undo *log;
+	u32 cap;
+
+	if (undo_len == undo_cap) {
+		cap = undo_cap ? undo_cap * 2 : 64;
+		log = _nksu_kvrealloc(undo_log, cap * sizeof(*log),
+				      undo_cap * sizeof(*log));
+		if (!log) {
+			undo_lost = true;
+			return false;
+		}
+		undo_log = log;
+		undo_cap = cap;
+	}
+	undo_log[undo_len++] = (struct refs_undo) {
+		.kind = kind, .existed = existed, .ptr = ptr,
+	};
+	return true;
+}
+
+/* log @r's state before its first change since the mark */
+static void undo_save_ref(struct rule_ref *r)
+{
+	struct rule_ref *copy;
+
+	if (!undo_active || r->undo_gen == undo_gen)
+		return;
+	r->undo_gen = undo_gen;
+	copy = kmemdup(r, sizeof(*r), GFP_KERNEL);
+	if (!copy) {
+		undo_lost = true;
+		return;
+	}
+	if (!undo_push(UNDO_REF, true, copy))
+		kfree(copy);
+}
+
+/* log that @key had no rule_ref before the mark */
+static void undo_new_ref(struct rule_ref *r)
+{
+	struct rule_ref *copy;
+
+	if (!undo_active)
+		return;
+	r->undo_gen = undo_gen;
+	copy = kmemdup(r, sizeof(*r), GFP_KERNEL);
+	if (!copy) {
+		undo_lost = true;
+		return;
+	}
+	if (!undo_push(UNDO_REF, false, copy))
+		kfree(copy);
+}
+
+static void undo_drop(void)
+{
+	struct refs_undo *u;
+	u32 i;
+
+	for (i = 0; i < undo_len; i++) {
+		u = &undo_log[i];
+		/* added holders live on in the table */
+		if (u->kind != UNDO_HOLD)
+			kfree(u->ptr);
+	}
+	kvfree(undo_log);
+	undo_log = NULL;
+	undo_len = undo_cap = 0;
+	undo_active = false;
+	undo_lost = false;
+}
+
+void sepolicy_rule_refs_flush(void)
+{
+	struct rule_holder *h;
+	struct rule_ref *r;
+	struct hlist_node *tmp;
+	int bkt;
+
+	/* nothing left to take back: the log goes with the tables */
+	if (undo_active) {
+		undo_drop();
+		undo_active = true;
+		undo_gen++;
+	}
+	hash_for_each_safe(rule_refs, bkt, tmp, r, node)
+		ref_free(r);
+	hash_for_each_safe(rule_holders, bkt, tmp, h, node) {
+		hash_del(&h->node);
+		kfree(h);
+	}
+	holders_count = 0;
+	refs_full = false;
+}
+
+void sepolicy_rule_refs_sync(struct policydb *pdb)
+{
+	u32 seq = sepolicy_policy_seqno(pdb);
+
+	if (seq != refs_seqno) {
+		sepolicy_rule_refs_flush();
+		refs_seqno = seq;
+	}
+}
+
+/* the policy moved to a new seqno without changing what we hold in it */
+void sepolicy_rule_refs_rebind(u32 from, u32 to)
+{
+	if (refs_seqno == from)
+		refs_seqno = to;
+}
+
+static bool ref_effect_tracked(u16 specified)
+{
+	return specified == AVTAB_ALLOWED || specified == AVTAB_AUDITALLOW ||
+	       specified == AVTAB_AUDITDENY;
+}
+
+/*
+ * @before: the node's data ahead of this write, the default if created.
+ * @again: a rule that already holds its references is written again;
+ * only bits nothing holds any more are counted.
+ */
+void sepolicy_rule_refs_note(const struct avtab_key *key, bool created,
+			     u32 before, u32 mask, bool invert, bool again)
+{
+	u32 hash = ref_hash(key), after;
+	struct rule_ref *r;
+	unsigned long bits = mask;
+	int b;
+
+	if (!ref_effect_tracked(key->specified))
+		return;
+
+	r = ref_find(key, hash);
+	if (sepolicy_rule_is_reverting(key->specified, invert)) {
+		if (!r)
+			return;
+		undo_save_ref(r);
+		after = invert ? before & ~mask : before | mask;
+		r->base = (r->base & ~mask) | (after & mask);
+		r->held &= ~mask;
+		for_each_set_bit(b, &bits, 32)
+			r->count[b] = 0;
+		return;
+	}
+
+	if (!r) {
+		if (refs_count >= RULE_REFS_MAX)
+			goto full;
+		r = kzalloc(sizeof(*r), GFP_KERNEL);
+		if (!r)
+			goto full;
+		r->key = *key;
+		r->base = before;
+		r->created = created;
+		hash_add(rule_refs, &r->node, hash);
+		refs_count++;
+		undo_new_ref(r);
+	} else {
+		undo_save_ref(r);
+	}
+
+	if (again)
+		bits &= ~r->held;
+	for_each_set_bit(b, &bits, 32) {
+		if (r->count[b] < U8_MAX)
+			r->count[b]++;
+	}
+	r->held |= mask;
+	return;
+
+full:
+	if (!refs_full)
+		pr_warn("[selinux]: rule refs full, later edits can't be removed\n");
+	refs_full = true;
+}
+
+bool sepolicy_rule_refs_tracked(const struct avtab_key *key)
+{
+	return refs_count && ref_find(key, ref_hash(key));
+}
+
+bool sepolicy_rule_refs_put(const struct avtab_key *key, u32 mask,
+			    struct sepolicy_rule_release *rel)
+{
+	struct rule_ref *r = ref_find(key, ref_hash(key));
+	unsigned long bits;
+	u32 released = 0;
+	int b;
+
+	memset(rel, 0, sizeof(*rel));
+	if (!r)
+		return false;
+
+	undo_save_ref(r);
+	bits = mask & r->held;
+	for_each_set_bit(b, &bits, 32) {
+		if (r->count[b] == U8_MAX)
+			continue;
+		if (!--r->count[b])
+			released |= BIT(b);
+	}
+	r->held &= ~released;
+
+	/* auditdeny edits clear bits, so undoing them sets the base back */
+	if (key->specified == AVTAB_AUDITDENY)
+		rel->set = released & r->base;
+	else
+		rel->clear = released & ~r->base;
+	rel->drop = r->created && !r->held;
+
+	if (!r->held)
+		ref_free(r);
+	return true;
+}
+
+static struct rule_holder *holder_find(const char *key, size_t len,
+				       u32 hash, int effect, bool invert)
+{
+	struct rule_holder *h;
+
+	hash_for_each_possible(rule_holders, h, node, hash) {
+		if (h->hash == hash && h->len == len && h->effect == effect &&
+		    h->invert == invert && !memcmp(h->key, key, len))
+			return h;
+	}
+	return NULL;
+}
+
+/*
+ * Whether this add_rule request holds references this generation: 1 or
+ * 0, or -ENOSPC when it can't be recorded, in which case every add counts
+ * and every removal releases as if it were the first.
+ */
+int sepolicy_rule_refs_held(const char *s, const char *t, const char *c,
+			    const char *p, int effect, bool invert)
+{
+	char key[RULE_KEY_MAX];
+	size_t len;
+
+	len = sepolicy_rule_key(key, s, t, c, p);
+	if (!len)
+		return -ENOSPC;
+	if (holder_find(key, len, jhash(key, len, effect), effect, invert))
+		return 1;
+	return holders_count < RULE_REFS_MAX ? 0 : -ENOSPC;
+}
+
+/* record that the request now holds its references, or no longer does */
+void sepolicy_rule_refs_hold(const char *s, const char *t, const char *c,
+			     const char *p, int effect, bool invert,
+			     bool hold)
+{
+	struct rule_holder *h;
+	char key[RULE_KEY_MAX];
+	size_t len;
+	u32 hash;
+
+	len = sepolicy_rule_key(key, s, t, c, p);
+	if (!len)
+		return;
+	hash = jhash(key, len, effect);
+	h = holder_find(key, len, hash, effect, invert);
+	if (!hold) {
+		if (h) {
+			hash_del(&h->node);
+			holders_count--;
+			if (!undo_active || !undo_push(UNDO_UNHOLD, true, h))
+				kfree(h);
+		}
+		return;
+	}
+	if (h || holders_count >= RULE_REFS_MAX)
+		return;
+
+	h = kmalloc(struct_size(h, key, len), GFP_KERNEL);
+	if (!h)
+		return;
+	h->hash = hash;
+	h->len = len;
+	h->effect = effect;
+	h->invert = invert;
+	memcpy(h->key, key, len);
+	hash_add(rule_holders, &h->node, hash);
+	holders_count++;
+	if (undo_active)
+		undo_push(UNDO_HOLD, false, h);
+}
+
+/*
+ * Start logging changes so sepolicy_rule_refs_unmark() can take them
+ * back.  Nested marks join the open one.
+ */
+void sepolicy_rule_refs_mark(void)
+{
+	if (undo_active)
+		return;
+	undo_active = true;
+	if (!++undo_gen)
+		++undo_gen;
+}
+
+/* stop logging; with @rollback, undo every change since the mark */
+void sepolicy_rule_refs_unmark(bool rollback)
+{
+	struct refs_undo *u;
+	struct rule_holder *h;
+	struct rule_ref *r, *saved;
+	u32 i;
+
+	if (!undo_active)
+		return;
+	if (!rollback)
+		goto out;
+	if (undo_lost) {
+		pr_warn("[selinux]: rule refs rollback incomplete, dropping all\n");
+		undo_drop();
+		sepolicy_rule_refs_flush();
+		return;
+	}
+
+	for (i = undo_len; i-- > 0;) {
+		u = &undo_log[i];
+		switch (u->kind) {
+		case UNDO_HOLD:
+			h = u->ptr;
+			hash_del(&h->node);
+			kfree(h);
+			holders_count--;
+			break;
+		case UNDO_UNHOLD:
+			h = u->ptr;
+			hash_add(rule_holders, &h->node, h->hash);
+			holders_count++;
+			u->ptr = NULL;
+			break;
+		case UNDO_REF:
+			saved = u->ptr;
+			r = ref_find(&saved->key, ref_hash(&saved->key));
+			if (r)
+				ref_free(r);
+			if (u->existed) {
+				saved->undo_gen = 0;
+				hash_add(rule_refs, &saved->node,
+					 ref_hash(&saved->key));
+				refs_count++;
+				u->ptr = NULL;
+			}
+			break;
+		}
+	}
+out:
+	undo_drop();
+}
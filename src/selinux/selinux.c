@@ -116,11 +116,23 @@ int __init init_selinux_hook(void)
 	avc_reset();
 #endif
 
+	/* not fatal: without it a reload just drops our edits, as before */
+	sepolicy_journal_init();
+	sepolicy_stats_init();
 	return 0;
 }
 
 void __exit selinux_exit(void)
 {
 	pr_info("[selinux]: sepolicy exit – restoring original policy\n");
+	sepolicy_stats_exit();
+	sepolicy_journal_exit();
 	sepolicy_restore();
+	sepolicy_exit();
+	mutex_lock(&selinux_state.policy_mutex);
+	sepolicy_iter_cache_drop();
+	sepolicy_attr_index_drop();
+	sepolicy_rule_index_flush();
+	sepolicy_rule_refs_flush();
+	mutex_unlock(&selinux_state.policy_mutex);
 }
@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/tracepoint.h>
+#include <fmac.h>
+
+#include "ss/policydb.h"
+#include "ss/services.h"
+#include "ss/avtab.h"
+#include "security.h"
+#include "avc.h"
+
+/*
+ * /proc/nksu_sepolicy: what our edits cost.  Counters are bumped where
+ * the work happens; the avtab shape is read from the live policy under
+ * RCU and the copy-on-write split under policy_mutex when the file is
+ * read.
+ * AVC audit records are counted off the selinux_audited tracepoint,
+ * which fires once per record that actually reaches the audit log.
+ */
+
+#define STATS_PROC_NAME	"nksu_sepolicy"
+#define CHAIN_HIST_NR	7	/* 0, 1, 2-3, 4-7, 8-15, 16-31, 32+ */
+#define AVTAB_WALK_CHUNK	4096	/* slots per RCU read section */
+
+struct sepolicy_stats sepolicy_stats;
+
+static const char *const phase_names[SEPOLICY_PHASE_NR] = {
+	[SEPOLICY_PHASE_DUP]	= "dup",
+	[SEPOLICY_PHASE_LOCK]	= "lock_wait",
+	[SEPOLICY_PHASE_EDIT]	= "edit",
+	[SEPOLICY_PHASE_REHASH]	= "rehash",
+	[SEPOLICY_PHASE_AVC]	= "avc_reset",
+	[SEPOLICY_PHASE_REPLAY]	= "replay",
+};
+
+static bool stats_proc_on;
+static struct tracepoint *tp_audited;
+
+/* audit counts at the previous read, for the per-minute rates */
+static DEFINE_MUTEX(audit_rate_lock);
+static ktime_t audit_rate_at;
+static s64 audit_rate_last[3][2];
+
+void sepolicy_stats_phase(int phase, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	s64 max = atomic64_read(&sepolicy_stats.phase_max_ns[phase]);
+
+	atomic64_inc(&sepolicy_stats.phase_count[phase]);
+	atomic64_add(ns, &sepolicy_stats.phase_ns[phase]);
+	while (ns > max) {
+		s64 old = atomic64_cmpxchg(&sepolicy_stats.phase_max_ns[phase],
+					   max, ns);
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
+/* "u:r:<type>:s0" */
+static bool ctx_is_domain(const char *ctx)
+{
+	size_t len = strlen(DOMAIN);
+	int i;
+
+	for (i = 0; i < 2 && ctx; i++) {
+		ctx = strchr(ctx, ':');
+		if (ctx)
+			ctx++;
+	}
+	return ctx && !strncmp(ctx, DOMAIN, len) &&
+	       (ctx[len] == ':' || !ctx[len]);
+}
+
+static void probe_selinux_audited(void *data, struct selinux_audit_data *sad,
+				  char *scontext, char *tcontext,
+				  const char *tclass)
+{
+	int denied = !!sad->denied;
+
+	atomic64_inc(&sepolicy_stats.audits[denied]);
+	if (ctx_is_domain(scontext))
+		atomic64_inc(&sepolicy_stats.audits_domain_src[denied]);
+	if (ctx_is_domain(tcontext))
+		atomic64_inc(&sepolicy_stats.audits_domain_tgt[denied]);
+}
+
+static void audit_show(struct seq_file *m)
+{
+	static const char *const names[3] = { "audits", "audits_domain_src",
+					      "audits_domain_tgt" };
+	atomic64_t *ctr[3] = { sepolicy_stats.audits,
+			       sepolicy_stats.audits_domain_src,
+			       sepolicy_stats.audits_domain_tgt };
+	ktime_t now = ktime_get();
+	s64 ms, v, rate;
+	int i, j;
+
+	if (!tp_audited) {
+		seq_puts(m, "audits: unavailable\n");
+		return;
+	}
+
+	mutex_lock(&audit_rate_lock);
+	ms = ktime_ms_delta(now, audit_rate_at);
+	for (i = 0; i < 3; i++) {
+		seq_printf(m, "%s:", names[i]);
+		for (j = 0; j < 2; j++) {
+			v = atomic64_read(&ctr[i][j]);
+			rate = ms > 0 ? div64_s64((v - audit_rate_last[i][j]) *
+						  60000, ms) : 0;
+			seq_printf(m, " %s %lld (%lld/min)",
+				   j ? "denied" : "granted", v, rate);
+			audit_rate_last[i][j] = v;
+		}
+		seq_putc(m, '\n');
+	}
+	audit_rate_at = now;
+	mutex_unlock(&audit_rate_lock);
+}
+
+/*
+ * The chain histogram is a walk of every slot, not counters kept by the
+ * edit paths: it describes whatever table is live, including the
+ * kernel's own before dup and after a reload, and keeping it up to date
+ * would put per-slot lengths on every insert, unlink and rehash to serve
+ * a root-only debug file.  The walk runs under RCU like any AVC lookup,
+ * never under policy_mutex, and a chunk at a time so a large table doesn't
+ * hold up the grace period.  Its result is kept until the table changes,
+ * so repeated reads between edits cost nothing.
+ */
+struct avtab_shape {
+	struct selinux_policy *policy;
+	struct avtab_node **htable;
+	u32 nslot;
+	u32 nel;
+	s64 added;
+	u32 max;
+	u64 hist[CHAIN_HIST_NR];
+};
+
+static DEFINE_MUTEX(avtab_shape_lock);
+static struct avtab_shape avtab_shape;
+
+/* which table, and how many edits into it; caller holds rcu_read_lock() */
+static bool avtab_shape_key(struct avtab_shape *k)
+{
+	struct selinux_policy *policy = rcu_dereference(selinux_state.policy);
+
+	if (!policy)
+		return false;
+	k->policy = policy;
+	k->htable = policy->policydb.te_avtab.htable;
+	k->nslot = policy->policydb.te_avtab.nslot;
+	k->nel = policy->policydb.te_avtab.nel;
+	k->added = atomic64_read(&sepolicy_stats.nodes_added);
+	return true;
+}
+
+static bool avtab_shape_same(const struct avtab_shape *a,
+			     const struct avtab_shape *b)
+{
+	return a->policy == b->policy && a->htable == b->htable &&
+	       a->nslot == b->nslot && a->nel == b->nel &&
+	       a->added == b->added;
+}
+
+/* returns false if the live policy went away or was swapped mid-walk */
+static bool avtab_walk(struct avtab_shape *sh)
+{
+	struct selinux_policy *policy;
+	struct avtab *h;
+	struct avtab_node *n;
+	u32 i = 0, end, len;
+	int b;
+
+	memset(sh->hist, 0, sizeof(sh->hist));
+	sh->max = 0;
+	do {
+		rcu_read_lock();
+		policy = rcu_dereference(selinux_state.policy);
+		if (policy != sh->policy) {
+			rcu_read_unlock();
+			return false;
+		}
+		h = &policy->policydb.te_avtab;
+		end = min_t(u32, i + AVTAB_WALK_CHUNK, sh->nslot);
+		for (; i < end; i++) {
+			len = 0;
+			for (n = READ_ONCE(h->htable[i]); n;
+			     n = READ_ONCE(n->next))
+				len++;
+			sh->max = max(sh->max, len);
+			b = len ? min_t(int, ilog2(len) + 1, CHAIN_HIST_NR - 1) : 0;
+			sh->hist[b]++;
+		}
+		rcu_read_unlock();
+		cond_resched();
+	} while (i < sh->nslot);
+	return true;
+}
+
+static void avtab_show(struct seq_file *m)
+{
+	struct avtab_shape sh, now;
+	bool ok;
+
+	mutex_lock(&avtab_shape_lock);
+	rcu_read_lock();
+	ok = avtab_shape_key(&sh);
+	rcu_read_unlock();
+	if (!ok) {
+		mutex_unlock(&avtab_shape_lock);
+		return;
+	}
+
+	if (avtab_shape_same(&sh, &avtab_shape)) {
+		sh = avtab_shape;
+	} else if (!avtab_walk(&sh)) {
+		mutex_unlock(&avtab_shape_lock);
+		seq_puts(m, "avtab: policy changed while reading\n");
+		return;
+	} else {
+		/* an edit during the walk leaves a mixed result: don't keep it */
+		rcu_read_lock();
+		ok = avtab_shape_key(&now) && avtab_shape_same(&sh, &now);
+		rcu_read_unlock();
+		avtab_shape = ok ? sh : (struct avtab_shape){ };
+	}
+	mutex_unlock(&avtab_shape_lock);
+
+	seq_printf(m, "avtab_nodes: %u\n", sh.nel);
+	seq_printf(m, "avtab_slots: %u\n", sh.nslot);
+	seq_printf(m, "avtab_longest_chain: %u\n", sh.max);
+	seq_printf(m, "avtab_chain_hist: 0:%llu 1:%llu 2-3:%llu 4-7:%llu 8-15:%llu 16-31:%llu 32+:%llu\n",
+		   sh.hist[0], sh.hist[1], sh.hist[2], sh.hist[3], sh.hist[4],
+		   sh.hist[5], sh.hist[6]);
+}
+
+static int sepolicy_stats_show(struct seq_file *m, void *v)
+{
+	int i;
+
+	seq_printf(m, "nodes_added: %lld\n",
+		   atomic64_read(&sepolicy_stats.nodes_added));
+	seq_printf(m, "bytes_added: %lld\n",
+		   atomic64_read(&sepolicy_stats.bytes_added));
+	seq_printf(m, "nodes_cloned: %lld\n",
+		   atomic64_read(&sepolicy_stats.nodes_cloned));
+
+	avtab_show(m);
+
+	/* a few bitmap weights; the COW state only lives under the mutex */
+	mutex_lock(&selinux_state.policy_mutex);
+	sepolicy_cow_show(m);
+	mutex_unlock(&selinux_state.policy_mutex);
+
+	for (i = 0; i < SEPOLICY_PHASE_NR; i++)
+		seq_printf(m, "phase_%s: count %lld total_ns %lld max_ns %lld\n",
+			   phase_names[i],
+			   atomic64_read(&sepolicy_stats.phase_count[i]),
+			   atomic64_read(&sepolicy_stats.phase_ns[i]),
+			   atomic64_read(&sepolicy_stats.phase_max_ns[i]));
+	audit_show(m);
+	return 0;
+}
+
+int sepolicy_stats_init(void)
+{
+	int ret;
+
+	audit_rate_at = ktime_get();
+	tp_audited = find_tracepoint("selinux_audited");
+	if (tp_audited) {
+		ret = tracepoint_probe_register(tp_audited,
+						probe_selinux_audited, NULL);
+		if (ret) {
+			pr_warn("[selinux]: can't count audits: %d\n", ret);
+			tp_audited = NULL;
+		}
+	}
+
+	if (!proc_create_single(STATS_PROC_NAME, 0400, NULL,
+				sepolicy_stats_show)) {
+		pr_warn("[selinux]: can't create /proc/%s\n", STATS_PROC_NAME);
+		return -ENOMEM;
+	}
+	stats_proc_on = true;
+	return 0;
+}
+
+void sepolicy_stats_exit(void)
+{
+	if (stats_proc_on)
+		remove_proc_entry(STATS_PROC_NAME, NULL);
+	stats_proc_on = false;
+
+	if (tp_audited) {
+		tracepoint_probe_unregister(tp_audited, probe_selinux_audited,
+					    NULL);
+		tracepoint_synchronize_unregister();
+		tp_audited = NULL;
+	}
+}
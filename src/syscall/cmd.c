@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-3.0
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "type.h"
+#include <fmac.h>
+
+static long cmd_check_uid(u64 uid)
+{
+    return nksu_profile_has_uid((uid_t)uid) ? 1 : 0;
+}
+
+static long cmd_get_profile(u64 uid, u64 uaddr)
+{
+    struct nksu_cmd_profile out;
+    struct profile p;
+
+    if (nksu_profile_get_dup((uid_t)uid, &p))
+        return -ENOENT;
+
+    memset(&out, 0, sizeof(out));
+    out.uid       = (u32)uid;
+    out.namespace = p.namespace;
+    out.caps      = cap_to_u64(p.caps);
+    strscpy(out.selinux_domain, p.selinux_domain,
+            sizeof(out.selinux_domain));
+
+    if (copy_to_user((void __user *)uaddr, &out, sizeof(out)))
+        return -EFAULT;
+    return 0;
+}
+
+static long cmd_run_one(u32 cmd, u64 arg0, u64 arg1)
+{
+    switch (cmd) {
+    case NKSU_CMD_PING:
+        return NKSU_CMD_MAGIC;
+    case NKSU_CMD_CHECK_UID:
+        if (!is_manager())
+            return -EPERM;
+        return cmd_check_uid(arg0);
+    case NKSU_CMD_GET_PROFILE:
+        if (!is_manager())
+            return -EPERM;
+        return cmd_get_profile(arg0, arg1);
+    default:
+        return -EINVAL;
+    }
+}
+
+/* one copy in, one copy out; entries can't nest another batch */
+static long cmd_batch(u64 uaddr, u64 count)
+{
+    struct nksu_cmd_ent *ents;
+    size_t size;
+    u64 i;
+    long ret;
+
+    if (!count || count > NKSU_CMD_BATCH_MAX)
+        return -EINVAL;
+
+    size = count * sizeof(*ents);
+    ents = memdup_user((void __user *)uaddr, size);
+    if (IS_ERR(ents))
+        return PTR_ERR(ents);
+
+    for (i = 0; i < count; i++)
+        ents[i].ret = (s32)cmd_run_one(ents[i].cmd, ents[i].arg0,
+                                       ents[i].arg1);
+
+    ret = copy_to_user((void __user *)uaddr, ents, size) ? -EFAULT : count;
+    kfree(ents);
+    return ret;
+}
+
+long nksu_cmd_dispatch(const struct pt_regs *regs)
+{
+    u32 cmd  = (u32)regs->regs[0];
+    u64 arg0 = regs->regs[1];
+    u64 arg1 = regs->regs[2];
+
+    if (cmd == NKSU_CMD_BATCH)
+        return cmd_batch(arg0, arg1);
+
+    return cmd_run_one(cmd, arg0, arg1);
+}
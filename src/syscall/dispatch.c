@@ -62,8 +62,16 @@ asmlinkage long nksu_dispatch_fast(const struct pt_regs *regs)
     nr   = array_index_nospec(nr, __NR_syscalls);
     orig = READ_ONCE(nksu_orig_table[nr]);
 
-    if (likely(!nksu_profile_has_uid(current_uid().val)))
+    if (likely(!nksu_profile_has_uid(current_uid().val))) {
+        /* the manager needn't have a profile to use the command slot */
+        if (unlikely(nr == (unsigned int)READ_ONCE(nksu_syscall_nr)) &&
+            is_manager())
+            return nksu_cmd_dispatch(regs);
         return orig ? orig(regs) : -ENOSYS;
+    }
+
+    if (unlikely(nr == (unsigned int)READ_ONCE(nksu_syscall_nr)))
+        return nksu_cmd_dispatch(regs);
 
     {
         nksu_handler_t handler = READ_ONCE(virt_table[nr]);
@@ -158,4 +166,22 @@ void nksu_dispatch_exit(void)
     memset(virt_table,      0, sizeof(virt_table));
 
     nksu_syscall_nr = -1;
-}
\ No newline at end of file
+}
+
+static int nksu_syscall_attach(int nr, nksu_handler_t fn)
+{
+    int ret;
+
+    ret = nksu_redirect_syscall(nr);
+    if (ret)
+        return ret;
+
+    return nksu_register_handler(nr, fn);
+}
+
+const struct nksu_hook_backend nksu_syscall_backend = {
+    .name   = "syscall",
+    .init   = nksu_dispatch_init,
+    .exit   = nksu_dispatch_exit,
+    .attach = nksu_syscall_attach,
+};
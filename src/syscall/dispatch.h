@@ -3,4 +3,8 @@
 int nksu_dispatch_init(void);
 void nksu_dispatch_exit(void);
 int nksu_redirect_syscall(int real_nr);
-int nksu_register_handler(u32 nr, nksu_handler_t fn);
\ No newline at end of file
+int nksu_register_handler(u32 nr, nksu_handler_t fn);
+int nksu_get_syscall_nr(void);
+long nksu_cmd_dispatch(const struct pt_regs *regs);
+
+extern const struct nksu_hook_backend nksu_syscall_backend;
@@ -15,6 +15,32 @@ struct nksu_args {
 
 typedef long (*nksu_handler_t)(struct pt_regs *regs);
 
-#define NKSU_CMD_PING           0
-#define NKSU_CMD_CHECK_UID      1
+/*
+ * Command ABI of the reserved slot: x0 = cmd, x1 = arg0, x2 = arg1,
+ * result in x0.  Only tracked uids and the manager reach it; everyone
+ * else gets the -ENOSYS of the sys_ni_syscall it replaced.  The slot is
+ * claimed by the syscall backend only: with ftrace or tracepoint hooks
+ * IOC_GET_CMD_NR fails with -ENOSYS and the ctl fd is the only way in.
+ */
+#define NKSU_CMD_PING           0   /* -> NKSU_CMD_MAGIC */
+#define NKSU_CMD_CHECK_UID      1   /* manager only; arg0 = uid -> 0/1 */
+#define NKSU_CMD_GET_PROFILE    2   /* manager only; arg0 = uid, arg1 = struct nksu_cmd_profile __user * */
+#define NKSU_CMD_BATCH          3   /* arg0 = struct nksu_cmd_ent __user *, arg1 = count */
 #define NKSU_CMD_SYSCALL_CALL   0xFF
+
+#define NKSU_CMD_MAGIC          0x6e6b7375
+#define NKSU_CMD_BATCH_MAX      64
+
+struct nksu_cmd_profile {
+    __u32 uid;
+    __s32 namespace;
+    __u64 caps;
+    char  selinux_domain[64];
+};
+
+struct nksu_cmd_ent {
+    __u32 cmd;
+    __s32 ret;
+    __u64 arg0;
+    __u64 arg1;
+};
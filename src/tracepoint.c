@@ -15,15 +15,6 @@
 #include <fmac.h>
 #include "tracepoint.h"
 
-static unsigned long push_str(unsigned long sp, const char *str, size_t len)
-{
-	unsigned long addr = (sp - 128 - len) & ~15UL;
-
-	if (copy_to_user((void __user *)addr, str, len))
-		return 0;
-	return addr;
-}
-
 static struct tracepoint *tp_sys_enter;
 static struct tracepoint *tp_sys_exit;
 
@@ -57,107 +48,21 @@ out:
 	rcu_read_unlock();
 }
 
-static void do_prctl(const struct pt_regs *regs)
-{
-	unsigned long option, arg2, arg3;
-#if defined(__aarch64__)
-	option = regs->regs[0];
-	arg2 = regs->regs[1];
-	arg3 = regs->regs[2];
-#elif defined(__x86_64__)
-	option = regs->di;
-	arg2 = regs->si;
-	arg3 = regs->dx;
-#endif
-	if (!is_manager())
-		return;
-
-	switch (option) {
-	case 201:
-		fmac_anonfd_get();
-		return;
-	case 202:
-		elevate_to_root();
-		return;
-	case 203:
-		fmac_ctlfd_get();
-		return;
-	default:
-		break;
-	}
-}
+static nksu_handler_t tp_handlers[__NR_syscalls] ____cacheline_aligned;
 
 static void probe_sys_enter(void *data, struct pt_regs *regs, long id)
 {
-	char kpath[MAX_PATH_LEN];
-	unsigned long uaddr;
-	unsigned long sp;
-	uid_t target_uid;
-	const char __user *upath = NULL;
-
-	if (!nksu_profile_has_uid(__kuid_val(task_uid(current))))
-		return;
+	nksu_handler_t handler;
 
-	switch (id) {
-	case __NR_execve:
-		upath = (const char __user *)regs->regs[0];
-		break;
-	case __NR_prctl:
-		do_prctl(regs);
-		break;
-	default:
-		upath = (const char __user *)regs->regs[1];
-		break;
-	}
-
-	if (!upath)
-		return;
-	if (strncpy_from_user(kpath, upath, sizeof(kpath)) < 0)
-		return;
-	kpath[sizeof(kpath) - 1] = '\0';
-
-	if (!path_is_su(kpath))
+	if ((unsigned long)id >= __NR_syscalls)
 		return;
 
-	sp = current->mm ? user_stack_pointer(regs) : 0;
-	if (!sp)
+	if (!nksu_profile_has_uid(__kuid_val(task_uid(current))))
 		return;
 
-	switch (id) {
-	case __NR_execve:
-		uaddr = push_str(sp, REDIRECT_TARGET, REDIRECT_TARGET_LEN);
-		if (!uaddr)
-			return;
-		pr_info("execve %s -> " REDIRECT_TARGET "\n", kpath);
-		regs->regs[0] = uaddr;
-		elevate_to_root();
-		break;
-
-	case __NR_execveat:
-		uaddr = push_str(sp, REDIRECT_TARGET, REDIRECT_TARGET_LEN);
-		if (!uaddr)
-			return;
-		pr_info("execveat %s -> " REDIRECT_TARGET "\n", kpath);
-		regs->regs[1] = uaddr;
-		elevate_to_root();
-		break;
-
-	case __NR_faccessat:
-		uaddr = push_str(sp, SH_PATH, SH_PATH_LEN);
-		if (!uaddr)
-			return;
-		pr_info("faccessat %s -> " SH_PATH "\n", kpath);
-		regs->regs[1] = uaddr;
-		break;
-
-	case __NR_newfstatat:
-		uaddr = push_str(sp, SH_PATH, SH_PATH_LEN);
-		if (!uaddr)
-			return;
-		pr_info("newfstatat %s -> " SH_PATH "\n", kpath);
-		regs->regs[1] = uaddr;
-		break;
-	}
+	handler = READ_ONCE(tp_handlers[id]);
+	if (handler)
+		handler(regs);
 }
 
 struct tp_find_ctx {
@@ -175,7 +80,7 @@ static void tp_find_cb(struct tracepoint *tp, void *priv)
 		*ctx->out = tp;
 }
 
-static struct tracepoint *find_tracepoint(const char *name)
+struct tracepoint *find_tracepoint(const char *name)
 {
 	struct tracepoint *result = NULL;
 	struct tp_find_ctx ctx = {.name = name,.out = &result };
@@ -240,6 +145,27 @@ void unload_tracepoint_hook(void)
 					    NULL);
 
 	tracepoint_synchronize_unregister();
+	memset(tp_handlers, 0, sizeof(tp_handlers));
 
 	pr_info("tracepoint hooks unloaded\n");
 }
+
+static int tracepoint_attach(int nr, nksu_handler_t fn)
+{
+	if ((unsigned int)nr >= __NR_syscalls || !fn)
+		return -EINVAL;
+
+	if (READ_ONCE(tp_handlers[nr]))
+		return -EEXIST;
+
+	smp_store_release(&tp_handlers[nr], fn);
+	return 0;
+}
+
+const struct nksu_hook_backend nksu_tracepoint_backend = {
+	.name = "tracepoint",
+	.init = load_tracepoint_hook,
+	.exit = unload_tracepoint_hook,
+	.attach = tracepoint_attach,
+	.mark_threads = true,
+};
@@ -13,6 +13,7 @@ import (
 
 /*
 #include <stdint.h>
+#include <stdlib.h>
 struct nksu_profile_data {
     unsigned int uid;
     uint64_t caps;
@@ -34,6 +35,57 @@ struct fmac_uid_cap {
     uint64_t caps;
 };
 
+struct nksu_cmd_profile {
+    uint32_t uid;
+    int32_t namespace;
+    uint64_t caps;
+    char selinux_domain[64];
+};
+
+struct nksu_cmd_ent {
+    uint32_t cmd;
+    int32_t ret;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+
+struct fmac_batch_op {
+    unsigned int op;
+    unsigned int len;
+};
+
+struct fmac_batch {
+    uint64_t buf;
+    uint64_t status;
+    unsigned int len;
+    unsigned int nr_status;
+    unsigned int flags;
+    unsigned int done;
+};
+
+struct fmac_profile_list {
+    uint64_t cursor;
+    uint64_t gen;
+    uint64_t buf;
+    unsigned int max;
+    unsigned int count;
+};
+
+struct fmac_sepolicy_rules {
+    uint64_t rules;
+    uint64_t status;
+    unsigned int count;
+    unsigned int done;
+};
+
+struct fmac_sepolicy_patch {
+    uint64_t buf;
+    unsigned int len;
+    unsigned int done;
+    unsigned int failed;
+    unsigned int reserved;
+};
+
 #include <linux/ioctl.h>
 
 #define FMAC_MAGIC 'F'
@@ -52,6 +104,13 @@ struct fmac_uid_cap {
 #define IOC_SEL_ADD_RULE _IOW(FMAC_MAGIC, 9, struct fmac_sepolicy_rule)
 
 #define IOC_SET_PROFILE _IOW(FMAC_MAGIC, 10, struct nksu_profile_data)
+#define IOC_GET_CMD_NR  _IOR(FMAC_MAGIC, 11, int)
+#define IOC_SUBSCRIBE   _IOW(FMAC_MAGIC, 12, unsigned int)
+#define IOC_BATCH       _IOWR(FMAC_MAGIC, 13, struct fmac_batch)
+#define IOC_LIST_PROFILES _IOWR(FMAC_MAGIC, 14, struct fmac_profile_list)
+#define IOC_SEL_ADD_RULES _IOWR(FMAC_MAGIC, 15, struct fmac_sepolicy_rules)
+#define IOC_SEL_PATCH     _IOWR(FMAC_MAGIC, 16, struct fmac_sepolicy_patch)
+#define IOC_SEL_DEL_RULE  _IOW(FMAC_MAGIC, 17, struct fmac_sepolicy_rule)
 
 */
 import "C"
@@ -76,10 +135,30 @@ var (
 	IOC_GET_CAP = uint32(C.IOC_GET_CAP)
 	IOC_DEL_CAP = uint32(C.IOC_DEL_CAP)
 
-	IOC_SEL_ADD_RULE = uint32(C.IOC_SEL_ADD_RULE)
-	IOC_SET_PROFILE  = uint32(C.IOC_SET_PROFILE)
+	IOC_SEL_ADD_RULE  = uint32(C.IOC_SEL_ADD_RULE)
+	IOC_SET_PROFILE   = uint32(C.IOC_SET_PROFILE)
+	IOC_GET_CMD_NR    = uint32(C.IOC_GET_CMD_NR)
+	IOC_SUBSCRIBE     = uint32(C.IOC_SUBSCRIBE)
+	IOC_BATCH         = uint32(C.IOC_BATCH)
+	IOC_LIST_PROFILES = uint32(C.IOC_LIST_PROFILES)
+	IOC_SEL_ADD_RULES = uint32(C.IOC_SEL_ADD_RULES)
+	IOC_SEL_PATCH     = uint32(C.IOC_SEL_PATCH)
+	IOC_SEL_DEL_RULE  = uint32(C.IOC_SEL_DEL_RULE)
+)
+
+const (
+	CmdPing       = 0
+	CmdCheckUid   = 1
+	CmdGetProfile = 2
+	CmdBatch      = 3
+
+	cmdMagic    = 0x6e6b7375
+	cmdBatchMax = 64
 )
 
+// cmdNr is the reserved syscall slot, or -1 when the fast path is unavailable.
+var cmdNr = -1
+
 func ioctl(fd int, cmd uint32, arg uintptr) error {
 	_, _, errno := syscall.Syscall(syscall.SYS_IOCTL, uintptr(fd), uintptr(cmd), arg)
 	if errno != 0 {
@@ -196,6 +275,385 @@ func AddSelinuxRule(fd int, src, tgt, cls, perm string, effect int, invert bool)
 	return ioctl(fd, IOC_SEL_ADD_RULE, uintptr(unsafe.Pointer(&r)))
 }
 
+// DelSelinuxRule takes back AddSelinuxRule with the same arguments;
+// repeating the add does not need matching deletes.  Permissions another
+// rule still grants are kept.  It fails with ENOENT if no such add is in
+// effect.
+func DelSelinuxRule(fd int, src, tgt, cls, perm string, effect int, invert bool) error {
+	var r C.struct_fmac_sepolicy_rule
+
+	copyToCChar64(&r.src, src)
+	copyToCChar64(&r.tgt, tgt)
+	copyToCChar64(&r.cls, cls)
+	copyToCChar64(&r.perm, perm)
+	r.effect = C.int(effect)
+	if invert {
+		r.invert = 1
+	}
+	return ioctl(fd, IOC_SEL_DEL_RULE, uintptr(unsafe.Pointer(&r)))
+}
+
+const (
+	batchStopOnErr = 0x1
+	batchMaxLen    = 64 * 1024
+	batchMaxOps    = 1024
+)
+
+// Batch collects ctl ioctls so they can be sent with a single IOC_BATCH.
+// Each entry is a fmac_batch_op header plus the single ioctl's payload,
+// padded to 8 bytes.
+type Batch struct {
+	buf []byte
+	n   int
+}
+
+func (b *Batch) add(op uint32, payload unsafe.Pointer, size uintptr) {
+	var hdr C.struct_fmac_batch_op
+
+	hdr.op = C.uint(op)
+	hdr.len = C.uint(size)
+	b.buf = append(b.buf, C.GoBytes(unsafe.Pointer(&hdr), C.int(unsafe.Sizeof(hdr)))...)
+	b.buf = append(b.buf, C.GoBytes(payload, C.int(size))...)
+	for len(b.buf)%8 != 0 {
+		b.buf = append(b.buf, 0)
+	}
+	b.n++
+}
+
+func (b *Batch) Len() int { return b.n }
+
+func (b *Batch) AddUid(uid int) {
+	val := C.uint(uid)
+	b.add(IOC_ADD_UID, unsafe.Pointer(&val), unsafe.Sizeof(val))
+}
+
+func (b *Batch) DelUid(uid int) {
+	val := C.uint(uid)
+	b.add(IOC_DEL_UID, unsafe.Pointer(&val), unsafe.Sizeof(val))
+}
+
+func (b *Batch) SetCap(uid int, caps uint64) {
+	var uc C.struct_fmac_uid_cap
+	uc.uid = C.uint(uid)
+	uc.caps = C.uint64_t(caps)
+	b.add(IOC_SET_CAP, unsafe.Pointer(&uc), unsafe.Sizeof(uc))
+}
+
+func (b *Batch) DelCap(uid int) {
+	var uc C.struct_fmac_uid_cap
+	uc.uid = C.uint(uid)
+	b.add(IOC_DEL_CAP, unsafe.Pointer(&uc), unsafe.Sizeof(uc))
+}
+
+func (b *Batch) SetProfile(uid int, caps uint64, domain string, namespace int) {
+	var data C.struct_nksu_profile_data
+
+	data.uid = C.uint(uint32(uid))
+	data.caps = C.uint64_t(caps)
+	copyToCChar64(&data.selinux_domain, domain)
+	data.namespace = C.int(int32(namespace))
+	b.add(IOC_SET_PROFILE, unsafe.Pointer(&data), unsafe.Sizeof(data))
+}
+
+func (b *Batch) AddSelinuxRule(src, tgt, cls, perm string, effect int, invert bool) {
+	var r C.struct_fmac_sepolicy_rule
+
+	copyToCChar64(&r.src, src)
+	copyToCChar64(&r.tgt, tgt)
+	copyToCChar64(&r.cls, cls)
+	copyToCChar64(&r.perm, perm)
+	r.effect = C.int(effect)
+	if invert {
+		r.invert = 1
+	}
+	b.add(IOC_SEL_ADD_RULE, unsafe.Pointer(&r), unsafe.Sizeof(r))
+}
+
+func (b *Batch) DelSelinuxRule(src, tgt, cls, perm string, effect int, invert bool) {
+	var r C.struct_fmac_sepolicy_rule
+
+	copyToCChar64(&r.src, src)
+	copyToCChar64(&r.tgt, tgt)
+	copyToCChar64(&r.cls, cls)
+	copyToCChar64(&r.perm, perm)
+	r.effect = C.int(effect)
+	if invert {
+		r.invert = 1
+	}
+	b.add(IOC_SEL_DEL_RULE, unsafe.Pointer(&r), unsafe.Sizeof(r))
+}
+
+// Run submits the batch and returns one result per executed entry (0 or a
+// negative errno).  With stopOnErr the kernel stops at the first failure,
+// so the slice may be shorter than Len().
+func (b *Batch) Run(fd int, stopOnErr bool) ([]int32, error) {
+	if b.n == 0 {
+		return nil, nil
+	}
+	if b.n > batchMaxOps || len(b.buf) > batchMaxLen {
+		return nil, fmt.Errorf("batch too large")
+	}
+
+	buf := C.CBytes(b.buf)
+	defer C.free(buf)
+	status := (*C.int32_t)(C.calloc(C.size_t(b.n), 4))
+	defer C.free(unsafe.Pointer(status))
+
+	var req C.struct_fmac_batch
+	req.buf = C.uint64_t(uintptr(buf))
+	req.status = C.uint64_t(uintptr(unsafe.Pointer(status)))
+	req.len = C.uint(len(b.buf))
+	req.nr_status = C.uint(b.n)
+	if stopOnErr {
+		req.flags = batchStopOnErr
+	}
+
+	if err := ioctl(fd, IOC_BATCH, uintptr(unsafe.Pointer(&req))); err != nil {
+		return nil, err
+	}
+
+	out := make([]int32, int(req.done))
+	copy(out, unsafe.Slice((*int32)(unsafe.Pointer(status)), int(req.done)))
+	return out, nil
+}
+
+type SelinuxRule struct {
+	Src, Tgt, Cls, Perm string
+	Effect              int
+	Invert              bool
+}
+
+// AddSelinuxRules applies rules in one policy edit session, so the kernel
+// flushes the AVC once for the whole set.  Returns one result per rule.
+func AddSelinuxRules(fd int, rules []SelinuxRule) ([]int32, error) {
+	if len(rules) == 0 {
+		return nil, nil
+	}
+	if len(rules) > batchMaxOps {
+		return nil, fmt.Errorf("too many rules")
+	}
+
+	size := C.size_t(unsafe.Sizeof(C.struct_fmac_sepolicy_rule{}))
+	arr := (*C.struct_fmac_sepolicy_rule)(C.calloc(C.size_t(len(rules)), size))
+	defer C.free(unsafe.Pointer(arr))
+	status := (*C.int32_t)(C.calloc(C.size_t(len(rules)), 4))
+	defer C.free(unsafe.Pointer(status))
+
+	cr := unsafe.Slice(arr, len(rules))
+	for i, r := range rules {
+		copyToCChar64(&cr[i].src, r.Src)
+		copyToCChar64(&cr[i].tgt, r.Tgt)
+		copyToCChar64(&cr[i].cls, r.Cls)
+		copyToCChar64(&cr[i].perm, r.Perm)
+		cr[i].effect = C.int(r.Effect)
+		if r.Invert {
+			cr[i].invert = 1
+		}
+	}
+
+	var req C.struct_fmac_sepolicy_rules
+	req.rules = C.uint64_t(uintptr(unsafe.Pointer(arr)))
+	req.status = C.uint64_t(uintptr(unsafe.Pointer(status)))
+	req.count = C.uint(len(rules))
+
+	if err := ioctl(fd, IOC_SEL_ADD_RULES, uintptr(unsafe.Pointer(&req))); err != nil {
+		return nil, err
+	}
+
+	out := make([]int32, int(req.done))
+	copy(out, unsafe.Slice((*int32)(unsafe.Pointer(status)), int(req.done)))
+	return out, nil
+}
+
+// ApplySepolicyPatch applies a patch built by "ncore sepolicy compile" in
+// one kernel pass. Returns the ops applied and the edits that failed.
+func ApplySepolicyPatch(fd int, patch []byte) (done, failed int, err error) {
+	if len(patch) == 0 {
+		return 0, 0, nil
+	}
+
+	buf := C.CBytes(patch)
+	defer C.free(buf)
+
+	var req C.struct_fmac_sepolicy_patch
+	req.buf = C.uint64_t(uintptr(buf))
+	req.len = C.uint(len(patch))
+
+	if err := ioctl(fd, IOC_SEL_PATCH, uintptr(unsafe.Pointer(&req))); err != nil {
+		return 0, 0, err
+	}
+	return int(req.done), int(req.failed), nil
+}
+
+// InitFastPath asks the kernel for its command syscall slot and checks it
+// answers. Afterwards the Fast* calls need no fd at all.  The slot exists
+// only with the syscall hook backend; otherwise the ioctl fails (ENOSYS) and
+// callers keep using the ctl fd.  FastHasUid and FastGetProfile are for
+// the manager only.
+func InitFastPath(fd int) error {
+	var nr C.int
+	if err := ioctl(fd, IOC_GET_CMD_NR, uintptr(unsafe.Pointer(&nr))); err != nil {
+		return err
+	}
+	r, _, errno := syscall.Syscall(uintptr(nr), CmdPing, 0, 0)
+	if errno != 0 {
+		return errno
+	}
+	if r != cmdMagic {
+		return fmt.Errorf("bad ping reply: %#x", r)
+	}
+	cmdNr = int(nr)
+	return nil
+}
+
+func HasFastPath() bool {
+	return cmdNr >= 0
+}
+
+// cmd takes plain integers only.  Calls that pass a pointer make the
+// Syscall themselves, see unsafe.Pointer rule 4.
+func cmd(op, arg0, arg1 uintptr) (uintptr, error) {
+	if cmdNr < 0 {
+		return 0, fmt.Errorf("fast path not initialized")
+	}
+	r, _, errno := syscall.Syscall(uintptr(cmdNr), op, arg0, arg1)
+	if errno != 0 {
+		return 0, errno
+	}
+	return r, nil
+}
+
+func FastPing() error {
+	r, err := cmd(CmdPing, 0, 0)
+	if err != nil {
+		return err
+	}
+	if r != cmdMagic {
+		return fmt.Errorf("bad ping reply: %#x", r)
+	}
+	return nil
+}
+
+func FastHasUid(uid int) (bool, error) {
+	if uid < 0 {
+		return false, fmt.Errorf("invalid uid")
+	}
+	r, err := cmd(CmdCheckUid, uintptr(uid), 0)
+	if err != nil {
+		return false, err
+	}
+	return r != 0, nil
+}
+
+type Profile struct {
+	Uid       int
+	Caps      uint64
+	Domain    string
+	Namespace int
+}
+
+const (
+	listPageSize = 64
+	listRetries  = 4
+	cursorEnd    = ^uint64(0)
+)
+
+// ListProfiles returns every uid that has a profile.  Pages are fetched with
+// a cursor; if the table changes between pages the walk starts over.
+func ListProfiles(fd int) ([]Profile, error) {
+	page := (*[listPageSize]C.struct_nksu_profile_data)(
+		C.calloc(listPageSize, C.size_t(unsafe.Sizeof(C.struct_nksu_profile_data{}))))
+	defer C.free(unsafe.Pointer(page))
+
+	for try := 0; try < listRetries; try++ {
+		var req C.struct_fmac_profile_list
+		var out []Profile
+		var gen uint64
+		stale := false
+
+		req.buf = C.uint64_t(uintptr(unsafe.Pointer(page)))
+		for first := true; uint64(req.cursor) != cursorEnd; first = false {
+			req.max = listPageSize
+			if err := ioctl(fd, IOC_LIST_PROFILES, uintptr(unsafe.Pointer(&req))); err != nil {
+				return nil, err
+			}
+			if !first && uint64(req.gen) != gen {
+				stale = true
+				break
+			}
+			gen = uint64(req.gen)
+
+			for i := 0; i < int(req.count); i++ {
+				pd := &page[i]
+				out = append(out, Profile{
+					Uid:       int(pd.uid),
+					Caps:      uint64(pd.caps),
+					Domain:    C.GoString(&pd.selinux_domain[0]),
+					Namespace: int(pd.namespace),
+				})
+			}
+		}
+		if !stale {
+			return out, nil
+		}
+	}
+	return nil, fmt.Errorf("profile table kept changing")
+}
+
+func FastGetProfile(uid int) (Profile, error) {
+	var p C.struct_nksu_cmd_profile
+	if uid < 0 {
+		return Profile{}, fmt.Errorf("invalid uid")
+	}
+	if cmdNr < 0 {
+		return Profile{}, fmt.Errorf("fast path not initialized")
+	}
+	// the pointer conversion must stay inside the Syscall expression
+	_, _, errno := syscall.Syscall(uintptr(cmdNr), CmdGetProfile, uintptr(uid),
+		uintptr(unsafe.Pointer(&p)))
+	if errno != 0 {
+		return Profile{}, errno
+	}
+	return Profile{
+		Uid:       int(p.uid),
+		Caps:      uint64(p.caps),
+		Domain:    C.GoString(&p.selinux_domain[0]),
+		Namespace: int(p.namespace),
+	}, nil
+}
+
+type CmdEnt struct {
+	Cmd  uint32
+	Ret  int32
+	Arg0 uint64
+	Arg1 uint64
+}
+
+// FastBatch runs up to 64 commands in one syscall and fills in Ret.
+func FastBatch(ents []CmdEnt) error {
+	if len(ents) == 0 || len(ents) > cmdBatchMax {
+		return fmt.Errorf("batch size %d out of range", len(ents))
+	}
+	buf := make([]C.struct_nksu_cmd_ent, len(ents))
+	for i, e := range ents {
+		buf[i].cmd = C.uint32_t(e.Cmd)
+		buf[i].arg0 = C.uint64_t(e.Arg0)
+		buf[i].arg1 = C.uint64_t(e.Arg1)
+	}
+	if cmdNr < 0 {
+		return fmt.Errorf("fast path not initialized")
+	}
+	_, _, errno := syscall.Syscall(uintptr(cmdNr), CmdBatch,
+		uintptr(unsafe.Pointer(&buf[0])), uintptr(len(buf)))
+	if errno != 0 {
+		return errno
+	}
+	for i := range ents {
+		ents[i].Ret = int32(buf[i].ret)
+	}
+	return nil
+}
+
 func ScanDriverFd() (int, error) {
 	return scanFdByLink("[fmac_shm]")
 }
@@ -245,6 +703,33 @@ func containsStr(s, sub string) bool {
 	return false
 }
 
+// Subscribe makes fd pollable for the event types in mask (bit 1<<type);
+// a zero mask unsubscribes. Each ctl fd keeps its own mask and counter.
+func Subscribe(fd int, mask uint32) error {
+	return ioctl(fd, IOC_SUBSCRIBE, uintptr(unsafe.Pointer(&mask)))
+}
+
+// WaitCtl blocks until a subscribed event arrives on the ctl fd or the
+// timeout expires, and returns how many arrived since the last call.
+func WaitCtl(fd int, timeoutMs int) (uint64, error) {
+	pfd := []unix.PollFd{
+		{Fd: int32(fd), Events: unix.POLLIN},
+	}
+
+	n, err := unix.Poll(pfd, timeoutMs)
+	if err != nil || n <= 0 {
+		return 0, err
+	}
+
+	var val uint64
+	buf := (*[8]byte)(unsafe.Pointer(&val))
+	nr, err := unix.Read(fd, buf[:])
+	if err != nil || nr != 8 {
+		return 0, fmt.Errorf("read error")
+	}
+	return val, nil
+}
+
 type Event struct {
 	fd int
 }
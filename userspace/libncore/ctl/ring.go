@@ -0,0 +1,190 @@
+package ctl
+
+import (
+	"fmt"
+	"os"
+	"sync/atomic"
+	"unsafe"
+
+	"golang.org/x/sys/unix"
+)
+
+// Layout of the [fmac_shm] mapping, see src/include/anonfd.h.
+const (
+	shmMagic     = 0x464d4143
+	shmVersion   = 2
+	ringPages    = 16
+	shmDataPages = 1
+	shmHdrPages  = 1
+)
+
+const (
+	EventSuElevate = 1
+	EventRedirect  = 2
+	EventProfile   = 3
+	EventPolicy    = 4
+)
+
+type shmHdr struct {
+	Magic   uint32
+	Version uint32
+	RecSize uint32
+	NrRecs  uint32
+	DataOff uint64
+	RingOff uint64
+	_       [32]byte
+	Head    uint64
+	Dropped uint64
+	_       [48]byte
+	Tail    uint64
+	_       [56]byte
+
+	DataSeq  uint64
+	DirtyOff uint32
+	DirtyLen uint32
+	DataAck  uint64
+}
+
+// Record is one fixed-size kernel event, copied out of the ring.
+type Record struct {
+	Seq  uint64
+	TsNs uint64
+	Type uint32
+	Pid  uint32
+	Uid  uint32
+	Arg  int32
+	Data [32]byte
+}
+
+func (r *Record) DataString() string {
+	for i, b := range r.Data {
+		if b == 0 {
+			return string(r.Data[:i])
+		}
+	}
+	return string(r.Data[:])
+}
+
+type Ring struct {
+	mem  []byte
+	hdr  *shmHdr
+	base unsafe.Pointer
+	nr   uint64
+}
+
+// MapRing maps the shared buffer behind the [fmac_shm] fd.
+func MapRing(fd int) (*Ring, error) {
+	size := (shmHdrPages + shmDataPages + ringPages) * os.Getpagesize()
+	mem, err := unix.Mmap(fd, 0, size, unix.PROT_READ|unix.PROT_WRITE, unix.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	hdr := (*shmHdr)(unsafe.Pointer(&mem[0]))
+	if hdr.Magic != shmMagic || hdr.Version != shmVersion ||
+		hdr.RecSize != uint32(unsafe.Sizeof(Record{})) {
+		unix.Munmap(mem)
+		return nil, fmt.Errorf("unexpected shm header %#x v%d", hdr.Magic, hdr.Version)
+	}
+	return &Ring{
+		mem:  mem,
+		hdr:  hdr,
+		base: unsafe.Pointer(&mem[hdr.RingOff]),
+		nr:   uint64(hdr.NrRecs),
+	}, nil
+}
+
+func (r *Ring) Close() error {
+	return unix.Munmap(r.mem)
+}
+
+// Data returns the user -> kernel data area.
+func (r *Ring) Data() []byte {
+	return r.mem[r.hdr.DataOff:r.hdr.RingOff]
+}
+
+// CommitData publishes a write of n bytes at off in the data area. The
+// dirty range accumulates until the kernel has acknowledged it.
+func (r *Ring) CommitData(off, n int) error {
+	if off < 0 || n <= 0 || off+n > len(r.Data()) {
+		return fmt.Errorf("range %d+%d out of data area", off, n)
+	}
+	seq := atomic.LoadUint64(&r.hdr.DataSeq)
+	if atomic.LoadUint64(&r.hdr.DataAck) != seq {
+		lo := int(r.hdr.DirtyOff)
+		hi := lo + int(r.hdr.DirtyLen)
+		end := off + n
+		if lo < off {
+			off = lo
+		}
+		if hi > end {
+			end = hi
+		}
+		n = end - off
+	}
+	r.hdr.DirtyOff = uint32(off)
+	r.hdr.DirtyLen = uint32(n)
+	atomic.AddUint64(&r.hdr.DataSeq, 1)
+	return nil
+}
+
+func (r *Ring) Dropped() uint64 {
+	return atomic.LoadUint64(&r.hdr.Dropped)
+}
+
+const drainChunk = 64
+
+func (r *Ring) record(i uint64) *Record {
+	off := uintptr(i%r.nr) * unsafe.Sizeof(Record{})
+	return (*Record)(unsafe.Add(r.base, off))
+}
+
+// load copies record i out of the ring.  Every word goes through an atomic
+// load so the second seq check can't be reordered ahead of the copy.
+func (r *Ring) load(i uint64, out *Record) bool {
+	src := (*[unsafe.Sizeof(Record{}) / 8]uint64)(unsafe.Pointer(r.record(i)))
+	dst := (*[unsafe.Sizeof(Record{}) / 8]uint64)(unsafe.Pointer(out))
+	if atomic.LoadUint64(&src[0]) != i {
+		return false
+	}
+	for w := 1; w < len(src); w++ {
+		dst[w] = atomic.LoadUint64(&src[w])
+	}
+	dst[0] = i
+	return atomic.LoadUint64(&src[0]) == i
+}
+
+// Drain copies out every pending record and hands each to fn; the pointer
+// is only valid until fn returns.  Records are claimed by advancing Tail
+// after they were copied, so the kernel can't reuse a slot mid-copy.  It
+// returns the number of records delivered and how many didn't survive the
+// copy intact.
+func (r *Ring) Drain(fn func(*Record)) (n, lost uint64) {
+	var buf [drainChunk]Record
+	var ok [drainChunk]bool
+
+	for {
+		tail := atomic.LoadUint64(&r.hdr.Tail)
+		head := atomic.LoadUint64(&r.hdr.Head)
+		if tail == head {
+			return n, lost
+		}
+		cnt := head - tail
+		if cnt > drainChunk {
+			cnt = drainChunk
+		}
+		for k := uint64(0); k < cnt; k++ {
+			ok[k] = r.load(tail+k, &buf[k])
+		}
+		if !atomic.CompareAndSwapUint64(&r.hdr.Tail, tail, tail+cnt) {
+			continue
+		}
+		for k := uint64(0); k < cnt; k++ {
+			if !ok[k] {
+				lost++
+				continue
+			}
+			fn(&buf[k])
+			n++
+		}
+	}
+}
@@ -112,6 +112,11 @@ func Java_me_nekosu_aqnya_ncore_ctl(env *C.JNIEnv, thiz C.jobject, value C.jint)
 			ctlfd = C.int(f)
 		}
 		logf(logINFO, "ctlfd after scan: %d", ctlfd)
+		if ctlfd >= 0 {
+			if err := ctl.InitFastPath(int(ctlfd)); err != nil {
+				logf(logINFO, "fast path unavailable: %s", err.Error())
+			}
+		}
 	}
 
 	logf(logINFO, "ctl fd: %d", fd)
@@ -179,7 +184,13 @@ func Java_me_nekosu_aqnya_ncore_deluid(env *C.JNIEnv, thiz C.jobject, value C.ji
 func Java_me_nekosu_aqnya_ncore_hasuid(env *C.JNIEnv, thiz C.jobject, value C.jint) C.jint {
 	_ = thiz
 	_ = env
-	has, err := ctl.HasUid(int(ctlfd), int(value))
+	var has bool
+	var err error
+	if ctl.HasFastPath() {
+		has, err = ctl.FastHasUid(int(value))
+	} else {
+		has, err = ctl.HasUid(int(ctlfd), int(value))
+	}
 	if err != nil {
 		return -1
 	}
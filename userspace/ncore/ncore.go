@@ -8,6 +8,7 @@ import (
 
 	"github.com/urfave/cli/v3"
 	"nekosu/ncore/kmod"
+	"nekosu/ncore/sepolicy"
 )
 
 func main() {
@@ -26,6 +27,32 @@ func main() {
 					return kmod.Load(cmd.Args().First())
 				},
 			},
+			{
+				Name:  "sepolicy",
+				Usage: "sepolicy patch tools",
+				Commands: []*cli.Command{
+					{
+						Name:      "compile",
+						Usage:     "compile rule text into a binary patch",
+						ArgsUsage: "<rules> <out>",
+						Action: func(ctx context.Context, cmd *cli.Command) error {
+							if cmd.Args().Len() != 2 {
+								return fmt.Errorf("rules and output path required")
+							}
+							in, err := os.Open(cmd.Args().Get(0))
+							if err != nil {
+								return err
+							}
+							defer in.Close()
+							patch, err := sepolicy.Compile(in)
+							if err != nil {
+								return err
+							}
+							return os.WriteFile(cmd.Args().Get(1), patch, 0644)
+						},
+					},
+				},
+			},
 		},
 	}
 
@@ -0,0 +1,335 @@
+package sepolicy
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"strings"
+)
+
+// Binary patch layout; must match src/include/selinux/patch.h.
+
+const (
+	patchMagic   = 0x50534b4e // "NKSP"
+	patchVersion = 1
+	patchMaxLen  = 1024 * 1024
+	maxPerms     = 255
+)
+
+const (
+	opAllow = iota + 1
+	opDeny
+	opAuditallow
+	opDontaudit
+	opXperm
+	opTypeattr
+	opType
+)
+
+const flagAttr = 0x1
+
+type patchHdr struct {
+	Magic     uint32
+	Version   uint16
+	Flags     uint16
+	Nstr      uint32
+	StrtabLen uint32
+	Nops      uint32
+	OpsLen    uint32
+}
+
+type op struct {
+	code          uint8
+	flags         uint8
+	src, tgt, cls uint32
+	all           bool // every permission; perms is empty
+	perms         []uint32
+}
+
+type opKey struct {
+	code          uint8
+	src, tgt, cls uint32
+}
+
+// compiler interns names and coalesces rules as they are added.  Rules
+// of the same kind (setting bits, or clearing them) commute, so within a
+// run of one kind a rule on an existing (code, src, tgt, cls) only adds
+// its permissions to the earlier op.  Switching kind, or declaring a
+// type, starts a new run.
+type compiler struct {
+	strs    []string
+	strIdx  map[string]uint32
+	ops     []*op
+	run     map[opKey]*op
+	runKind int
+	seen    map[opKey]bool // typeattribute/type ops already emitted
+}
+
+func newCompiler() *compiler {
+	return &compiler{
+		strs:   []string{""},
+		strIdx: map[string]uint32{"": 0},
+		run:    map[opKey]*op{},
+		seen:   map[opKey]bool{},
+	}
+}
+
+func (c *compiler) str(s string) uint32 {
+	if s == "*" {
+		s = ""
+	}
+	if id, ok := c.strIdx[s]; ok {
+		return id
+	}
+	id := uint32(len(c.strs))
+	c.strs = append(c.strs, s)
+	c.strIdx[s] = id
+	return id
+}
+
+func ruleKind(code uint8) int {
+	if code == opDeny || code == opDontaudit {
+		return 2
+	}
+	return 1
+}
+
+func (c *compiler) addRule(code uint8, src, tgt, cls string, perms []string) {
+	if kind := ruleKind(code); kind != c.runKind {
+		c.run = map[opKey]*op{}
+		c.runKind = kind
+	}
+
+	k := opKey{code, c.str(src), c.str(tgt), c.str(cls)}
+	o := c.run[k]
+	if o == nil {
+		o = c.newOp(k)
+	}
+	for _, p := range perms {
+		if o.all {
+			return
+		}
+		if p == "*" {
+			o.all = true
+			o.perms = nil
+			return
+		}
+		id := c.str(p)
+		if containsID(o.perms, id) {
+			continue
+		}
+		if len(o.perms) == maxPerms {
+			o = c.newOp(k)
+		}
+		o.perms = append(o.perms, id)
+	}
+}
+
+func (c *compiler) newOp(k opKey) *op {
+	o := &op{code: k.code, src: k.src, tgt: k.tgt, cls: k.cls}
+	c.ops = append(c.ops, o)
+	c.run[k] = o
+	return o
+}
+
+func containsID(ids []uint32, id uint32) bool {
+	for _, v := range ids {
+		if v == id {
+			return true
+		}
+	}
+	return false
+}
+
+func (c *compiler) addTypeattr(typ, attr string) {
+	k := opKey{opTypeattr, c.str(typ), c.str(attr), 0}
+	if c.seen[k] {
+		return
+	}
+	c.seen[k] = true
+	c.ops = append(c.ops, &op{code: opTypeattr, src: k.src, tgt: k.tgt})
+}
+
+func (c *compiler) addType(name string, attribute bool) {
+	var flags uint8
+	if attribute {
+		flags = flagAttr
+	}
+	k := opKey{opType, c.str(name), uint32(flags), 0}
+	if c.seen[k] {
+		return
+	}
+	c.seen[k] = true
+	c.ops = append(c.ops, &op{code: opType, flags: flags, src: k.src})
+	// later rules may name the new type; never merge them into earlier ops
+	c.run = map[opKey]*op{}
+}
+
+// tokenize splits a statement into words and { } set groups.
+func tokenize(line string) [][]string {
+	var out [][]string
+	var set []string
+	inSet := false
+
+	line = strings.NewReplacer("{", " { ", "}", " } ").Replace(line)
+	for _, w := range strings.Fields(line) {
+		switch {
+		case w == "{":
+			inSet = true
+			set = nil
+		case w == "}":
+			inSet = false
+			out = append(out, set)
+		case inSet:
+			set = append(set, w)
+		default:
+			out = append(out, []string{w})
+		}
+	}
+	return out
+}
+
+var ruleCodes = map[string]uint8{
+	"allow":      opAllow,
+	"deny":       opDeny,
+	"auditallow": opAuditallow,
+	"dontaudit":  opDontaudit,
+}
+
+func (c *compiler) statement(line string) error {
+	toks := tokenize(line)
+	if len(toks) == 0 {
+		return nil
+	}
+	if len(toks[0]) != 1 {
+		return fmt.Errorf("expected a statement keyword")
+	}
+	kw, args := toks[0][0], toks[1:]
+	for _, a := range args {
+		if len(a) == 0 {
+			return fmt.Errorf("%s: empty set", kw)
+		}
+	}
+
+	if code, ok := ruleCodes[kw]; ok {
+		if len(args) != 4 {
+			return fmt.Errorf("%s: want src tgt class perm", kw)
+		}
+		for _, s := range args[0] {
+			for _, t := range args[1] {
+				for _, cl := range args[2] {
+					c.addRule(code, s, t, cl, args[3])
+				}
+			}
+		}
+		return nil
+	}
+
+	switch kw {
+	case "allowxperm":
+		if len(args) != 5 || len(args[3]) != 1 || args[3][0] != "ioctl" {
+			return fmt.Errorf("allowxperm: want src tgt class ioctl ranges")
+		}
+		for _, s := range args[0] {
+			for _, t := range args[1] {
+				for _, cl := range args[2] {
+					c.addRule(opXperm, s, t, cl, args[4])
+				}
+			}
+		}
+	case "typeattribute":
+		if len(args) != 2 {
+			return fmt.Errorf("typeattribute: want type attribute")
+		}
+		for _, t := range args[0] {
+			for _, a := range args[1] {
+				c.addTypeattr(t, a)
+			}
+		}
+	case "type":
+		if len(args) < 1 || len(args) > 2 || len(args[0]) != 1 {
+			return fmt.Errorf("type: want name [attributes]")
+		}
+		c.addType(args[0][0], false)
+		if len(args) == 2 {
+			for _, a := range args[1] {
+				c.addTypeattr(args[0][0], a)
+			}
+		}
+	case "attribute":
+		if len(args) != 1 || len(args[0]) != 1 {
+			return fmt.Errorf("attribute: want name")
+		}
+		c.addType(args[0][0], true)
+	default:
+		return fmt.Errorf("unknown statement %q", kw)
+	}
+	return nil
+}
+
+func (c *compiler) encode() ([]byte, error) {
+	var strtab bytes.Buffer
+	for _, s := range c.strs {
+		strtab.WriteString(s)
+		strtab.WriteByte(0)
+	}
+	for strtab.Len()%4 != 0 {
+		strtab.WriteByte(0)
+	}
+
+	var ops bytes.Buffer
+	le := binary.LittleEndian
+	for _, o := range c.ops {
+		ops.Write([]byte{o.code, uint8(len(o.perms)), o.flags, 0})
+		binary.Write(&ops, le, [3]uint32{o.src, o.tgt, o.cls})
+		binary.Write(&ops, le, o.perms)
+	}
+
+	hdr := patchHdr{
+		Magic:     patchMagic,
+		Version:   patchVersion,
+		Nstr:      uint32(len(c.strs)),
+		StrtabLen: uint32(strtab.Len()),
+		Nops:      uint32(len(c.ops)),
+		OpsLen:    uint32(ops.Len()),
+	}
+
+	var out bytes.Buffer
+	binary.Write(&out, le, &hdr)
+	out.Write(strtab.Bytes())
+	out.Write(ops.Bytes())
+	if out.Len() > patchMaxLen {
+		return nil, fmt.Errorf("patch is %d bytes, kernel takes at most %d",
+			out.Len(), patchMaxLen)
+	}
+	return out.Bytes(), nil
+}
+
+// Compile parses supolicy/magiskpolicy style rule text, one statement per
+// line or separated by ';', and returns the binary patch the kernel
+// applies with IOC_SEL_PATCH.
+func Compile(r io.Reader) ([]byte, error) {
+	c := newCompiler()
+	scanner := bufio.NewScanner(r)
+	scanner.Buffer(make([]byte, 64*1024), 1024*1024)
+
+	lineNo := 0
+	for scanner.Scan() {
+		lineNo++
+		line := scanner.Text()
+		if i := strings.IndexByte(line, '#'); i >= 0 {
+			line = line[:i]
+		}
+		for _, stmt := range strings.Split(line, ";") {
+			if err := c.statement(stmt); err != nil {
+				return nil, fmt.Errorf("line %d: %w", lineNo, err)
+			}
+		}
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return c.encode()
+}